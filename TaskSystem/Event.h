@@ -1,2 +1,95 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include "Futex.h"
 
+class FEventCountToken
+{
+	friend class FEventCount;
+	uint32_t Epoch = 0;
+};
+
+// lets a thread sleep until "something changed" without a mutex. the waiter calls PrepareWait, re-checks its condition and either
+// calls CancelWait or Wait with the token. a Notify issued after PrepareWait is never lost: it bumps the epoch so Wait returns immediately.
+// Notify is a single load when nobody is waiting
+class FEventCount
+{
+public:
+	FEventCountToken PrepareWait()
+	{
+		NumWaiters.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		FEventCountToken Token;
+		Token.Epoch = Epoch.load(std::memory_order_acquire);
+		return Token;
+	}
+
+	void CancelWait()
+	{
+		NumWaiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// returns true if woken up by a notification, false on timeout
+	bool Wait(FEventCountToken Token, FTimeout Timeout = FTimeout::Never())
+	{
+		bool bNotified = true;
+		while (Epoch.load(std::memory_order_acquire) == Token.Epoch)
+		{
+			if (!FFutex::Wait(Epoch, Token.Epoch, Timeout))
+			{
+				bNotified = Epoch.load(std::memory_order_acquire) != Token.Epoch;
+				break;
+			}
+		}
+		NumWaiters.fetch_sub(1, std::memory_order_relaxed);
+		return bNotified;
+	}
+
+	// wakes a single waiter, returns false if there was nobody to wake
+	bool NotifyOne()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (NumWaiters.load(std::memory_order_relaxed) == 0)
+		{
+			return false;
+		}
+		Epoch.fetch_add(1, std::memory_order_release);
+		FFutex::WakeOne(Epoch);
+		return true;
+	}
+
+	// wakes up to Count waiters, returns how many there were to wake (at most Count)
+	uint32_t Notify(uint32_t Count)
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		uint32_t LocalNumWaiters = NumWaiters.load(std::memory_order_relaxed);
+		if (LocalNumWaiters == 0 || Count == 0)
+		{
+			return 0;
+		}
+		Epoch.fetch_add(1, std::memory_order_release);
+		FFutex::Wake(Epoch, Count);
+		return std::min(Count, LocalNumWaiters);
+	}
+
+	void NotifyAll()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (NumWaiters.load(std::memory_order_relaxed) == 0)
+		{
+			return;
+		}
+		Epoch.fetch_add(1, std::memory_order_release);
+		FFutex::WakeAll(Epoch);
+	}
+
+	uint32_t GetNumWaiters() const
+	{
+		return NumWaiters.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic_uint32_t Epoch{ 0 };
+	std::atomic_uint32_t NumWaiters{ 0 };
+};
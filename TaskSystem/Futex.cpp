@@ -0,0 +1,84 @@
+#include "Futex.h"
+#include <algorithm>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#pragma comment(lib, "Synchronization.lib")
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <ctime>
+#else
+#include <thread>
+#endif
+
+static_assert(sizeof(std::atomic_uint32_t) == sizeof(uint32_t), "futex word must be a plain 32-bit integer");
+
+bool FFutex::Wait(std::atomic_uint32_t& Address, uint32_t ExpectedValue, FTimeout Timeout)
+{
+	if (Timeout.IsExpired())
+	{
+		return false;
+	}
+
+#if defined(_WIN32)
+	DWORD Milliseconds = Timeout == FTimeout::Never() ? INFINITE : DWORD(Timeout.GetRemainingRoundedUpMilliseconds());
+	if (!WaitOnAddress(&Address, &ExpectedValue, sizeof(uint32_t), Milliseconds))
+	{
+		return GetLastError() != ERROR_TIMEOUT;
+	}
+	return true;
+#elif defined(__linux__)
+	timespec RelativeTimeout;
+	timespec* RelativeTimeoutPtr = nullptr;
+	if (Timeout != FTimeout::Never())
+	{
+		int64_t Nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(Timeout.GetRemainingTime()).count();
+		RelativeTimeout.tv_sec = time_t(Nanoseconds / 1000000000);
+		RelativeTimeout.tv_nsec = long(Nanoseconds % 1000000000);
+		RelativeTimeoutPtr = &RelativeTimeout;
+	}
+	// EAGAIN (value already changed) and EINTR are treated as wake-ups
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&Address), FUTEX_WAIT_PRIVATE, ExpectedValue, RelativeTimeoutPtr, nullptr, 0);
+	return !Timeout.IsExpired();
+#else
+	// no wait-on-address with a timeout available, fall back to polling
+	while (Address.load(std::memory_order_acquire) == ExpectedValue && !Timeout.IsExpired())
+	{
+		std::this_thread::yield();
+	}
+	return !Timeout.IsExpired();
+#endif
+}
+
+void FFutex::WakeOne(std::atomic_uint32_t& Address)
+{
+#if defined(_WIN32)
+	WakeByAddressSingle(&Address);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&Address), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+}
+
+void FFutex::Wake(std::atomic_uint32_t& Address, uint32_t Count)
+{
+#if defined(_WIN32)
+	for (uint32_t Index = 0; Index < Count; Index += 1)
+	{
+		WakeByAddressSingle(&Address);
+	}
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&Address), FUTEX_WAKE_PRIVATE, int(std::min<uint32_t>(Count, INT32_MAX)), nullptr, nullptr, 0);
+#endif
+}
+
+void FFutex::WakeAll(std::atomic_uint32_t& Address)
+{
+#if defined(_WIN32)
+	WakeByAddressAll(&Address);
+#elif defined(__linux__)
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&Address), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#endif
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include "Timeout.h"
+
+// thin wrapper over the OS wait-on-address primitive: futex on linux, WaitOnAddress on windows
+class FFutex
+{
+public:
+	// blocks while Address holds ExpectedValue. can return early (spurious wake-ups, signals), callers must re-check their condition.
+	// returns false if the timeout expired
+	static bool Wait(std::atomic_uint32_t& Address, uint32_t ExpectedValue, FTimeout Timeout = FTimeout::Never());
+
+	static void WakeOne(std::atomic_uint32_t& Address);
+	static void Wake(std::atomic_uint32_t& Address, uint32_t Count);
+	static void WakeAll(std::atomic_uint32_t& Address);
+};
@@ -0,0 +1,133 @@
+#include "HazardPointers.h"
+#include <cassert>
+#include <algorithm>
+
+struct FHazardPointers::FThreadState
+{
+	~FThreadState()
+	{
+		if (Record == nullptr)
+		{
+			return;
+		}
+
+		for (std::atomic<void*>& Hazard : Record->Hazards)
+		{
+			Hazard.store(nullptr, std::memory_order_relaxed);
+		}
+		Record->bInUse.store(false, std::memory_order_release);
+
+		// not reclaimed here, the reclaim functions may use thread locals that are already destroyed
+		if (!Retired.empty())
+		{
+			FHazardPointers& HazardPointers = FHazardPointers::Get();
+			std::lock_guard guard(HazardPointers.OrphansMtx);
+			HazardPointers.Orphans.insert(HazardPointers.Orphans.end(), Retired.begin(), Retired.end());
+			HazardPointers.bHasOrphans.store(true, std::memory_order_relaxed);
+		}
+	}
+
+	FRecord* Record = nullptr;
+	std::vector<FRetired> Retired;
+};
+
+FHazardPointers& FHazardPointers::Get()
+{
+	// never destroyed, exiting threads hand their retired nodes over to it
+	static FHazardPointers* HazardPointers = new FHazardPointers();
+	return *HazardPointers;
+}
+
+FHazardPointers::FThreadState& FHazardPointers::GetThreadState()
+{
+	static thread_local FThreadState State;
+	return State;
+}
+
+std::atomic<void*>& FHazardPointers::GetSlot(uint32_t Slot)
+{
+	assert(Slot < NumSlotsPerThread);
+	FThreadState& State = GetThreadState();
+	if (State.Record == nullptr)
+	{
+		State.Record = AcquireRecord();
+	}
+	return State.Record->Hazards[Slot];
+}
+
+FHazardPointers::FRecord* FHazardPointers::AcquireRecord()
+{
+	for (FRecord* Record = Records.load(std::memory_order_acquire); Record != nullptr; Record = Record->Next)
+	{
+		bool bInUse = false;
+		if (!Record->bInUse.load(std::memory_order_relaxed) && Record->bInUse.compare_exchange_strong(bInUse, true, std::memory_order_acquire))
+		{
+			return Record;
+		}
+	}
+
+	FRecord* Record = new FRecord();
+	Record->bInUse.store(true, std::memory_order_relaxed);
+	Record->Next = Records.load(std::memory_order_relaxed);
+	while (!Records.compare_exchange_weak(Record->Next, Record, std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+	NumRecords.fetch_add(1, std::memory_order_relaxed);
+	return Record;
+}
+
+void FHazardPointers::Retire(void* Ptr, FReclaimFunc Reclaim)
+{
+	FThreadState& State = GetThreadState();
+	State.Retired.push_back({ Ptr, Reclaim });
+
+	// scanning costs O(threads * slots), amortize it over at least as many retired nodes so reclamation stays O(1) per node and
+	// at most that many nodes per thread wait for reclamation
+	size_t Threshold = 2 * size_t(NumRecords.load(std::memory_order_relaxed)) * NumSlotsPerThread + 64;
+	if (State.Retired.size() >= Threshold)
+	{
+		Scan(State);
+	}
+}
+
+void FHazardPointers::Scan(FThreadState& State)
+{
+	if (bHasOrphans.load(std::memory_order_relaxed))
+	{
+		std::lock_guard guard(OrphansMtx);
+		State.Retired.insert(State.Retired.end(), Orphans.begin(), Orphans.end());
+		Orphans.clear();
+		bHasOrphans.store(false, std::memory_order_relaxed);
+	}
+
+	// pairs with the seq_cst store in Protect: a thread that published a pointer before it was unlinked is seen here, one that
+	// publishes it later finds it unlinked when it re-reads the source
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	std::vector<void*> Protected;
+	for (FRecord* Record = Records.load(std::memory_order_acquire); Record != nullptr; Record = Record->Next)
+	{
+		for (std::atomic<void*>& Hazard : Record->Hazards)
+		{
+			if (void* Ptr = Hazard.load(std::memory_order_seq_cst))
+			{
+				Protected.push_back(Ptr);
+			}
+		}
+	}
+	std::sort(Protected.begin(), Protected.end());
+
+	size_t NumKept = 0;
+	for (FRetired& Retired : State.Retired)
+	{
+		if (std::binary_search(Protected.begin(), Protected.end(), Retired.Ptr))
+		{
+			State.Retired[NumKept++] = Retired;
+		}
+		else
+		{
+			Retired.Reclaim(Retired.Ptr);
+		}
+	}
+	State.Retired.resize(NumKept);
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// hazard pointers (Michael 2004) for lock-free structures that unlink and free nodes other threads may still be reading. a thread
+// publishes the node it's about to dereference in one of its slots, unlinked nodes are retired instead of freed and only reclaimed
+// once no slot of any thread points at them. every thread gets its record on first use and gives it back when it exits
+class FHazardPointers
+{
+public:
+	static constexpr uint32_t NumSlotsPerThread = 2;
+
+	using FReclaimFunc = void (*)(void* Ptr);
+
+	static FHazardPointers& Get();
+
+	// loads Source and keeps the result protected in the calling thread's Slot until Clear or the next Protect on that slot.
+	// the caller still has to check that the node is reachable, e.g. by re-reading the pointer it got Source from
+	template<typename T>
+	T* Protect(uint32_t Slot, const std::atomic<T*>& Source)
+	{
+		std::atomic<void*>& Hazard = GetSlot(Slot);
+		T* Ptr = Source.load(std::memory_order_relaxed);
+		while (true)
+		{
+			// the store has to be visible before Source is read again, a reclaiming thread reads the slots after unlinking
+			Hazard.store(Ptr, std::memory_order_seq_cst);
+			T* Current = Source.load(std::memory_order_seq_cst);
+			if (Current == Ptr)
+			{
+				return Ptr;
+			}
+			Ptr = Current;
+		}
+	}
+
+	void Clear(uint32_t Slot)
+	{
+		GetSlot(Slot).store(nullptr, std::memory_order_release);
+	}
+
+	// Ptr must be unlinked already, Reclaim is called with it once no thread protects it anymore
+	void Retire(void* Ptr, FReclaimFunc Reclaim);
+
+private:
+	struct FRecord
+	{
+		std::atomic<void*> Hazards[NumSlotsPerThread] = {};
+		std::atomic<bool> bInUse{ false };
+		// records are never freed, a new thread takes over one that is not in use
+		FRecord* Next = nullptr;
+	};
+
+	struct FRetired
+	{
+		void* Ptr;
+		FReclaimFunc Reclaim;
+	};
+
+	struct FThreadState;
+
+	static FThreadState& GetThreadState();
+
+	std::atomic<void*>& GetSlot(uint32_t Slot);
+
+	FRecord* AcquireRecord();
+	// reclaims every retired node of the calling thread that is not protected
+	void Scan(FThreadState& State);
+
+	std::atomic<FRecord*> Records{ nullptr };
+	std::atomic<uint32_t> NumRecords{ 0 };
+
+	// retired nodes of exited threads that were still protected, adopted by the next scan
+	std::mutex OrphansMtx;
+	std::vector<FRetired> Orphans;
+	std::atomic<bool> bHasOrphans{ false };
+};
@@ -0,0 +1,64 @@
+#include "Histogram.h"
+
+void FLatencyHistogram::Merge(const FLatencyHistogram& Other)
+{
+	for (uint32_t Bucket = 0; Bucket < NumBuckets; Bucket += 1)
+	{
+		Counts[Bucket] += Other.Counts[Bucket];
+	}
+	Count += Other.Count;
+	Sum += Other.Sum;
+	Max = std::max(Max, Other.Max);
+}
+
+uint64_t FLatencyHistogram::GetPercentile(double Percentile) const
+{
+	if (Count == 0)
+	{
+		return 0;
+	}
+
+	// the rank of the value, 1-based: the 50th percentile of 10 values is the 5th one
+	double Rank = std::clamp(Percentile, 0.0, 100.0) / 100.0 * double(Count);
+	uint64_t Target = std::max<uint64_t>(uint64_t(Rank + 0.5), 1);
+	uint64_t Seen = 0;
+	for (uint32_t Bucket = 0; Bucket < NumBuckets; Bucket += 1)
+	{
+		Seen += Counts[Bucket];
+		if (Seen >= Target)
+		{
+			uint64_t UpperEnd = Bucket + 1 < NumBuckets ? GetBucketValue(Bucket + 1) - 1 : UINT64_MAX;
+			return std::min(UpperEnd, Max);
+		}
+	}
+	return Max;
+}
+
+void FAtomicLatencyHistogram::MergeInto(FLatencyHistogram& Histogram) const
+{
+	// the count is derived from the buckets, so percentiles stay consistent with it
+	uint64_t LocalCount = 0;
+	for (uint32_t Bucket = 0; Bucket < FLatencyHistogram::NumBuckets; Bucket += 1)
+	{
+		uint64_t BucketCount = Counts[Bucket].load(std::memory_order_relaxed);
+		Histogram.Counts[Bucket] += BucketCount;
+		LocalCount += BucketCount;
+	}
+	Histogram.Count += LocalCount;
+	Histogram.Sum += Sum.load(std::memory_order_relaxed);
+	Histogram.Max = std::max(Histogram.Max, Max.load(std::memory_order_relaxed));
+}
+
+void FAtomicLatencyHistogram::Merge(const FAtomicLatencyHistogram& Other)
+{
+	for (uint32_t Bucket = 0; Bucket < FLatencyHistogram::NumBuckets; Bucket += 1)
+	{
+		IncrementCounter(Counts[Bucket], Other.Counts[Bucket].load(std::memory_order_relaxed), true);
+	}
+	IncrementCounter(Sum, Other.Sum.load(std::memory_order_relaxed), true);
+	uint64_t OtherMax = Other.Max.load(std::memory_order_relaxed);
+	uint64_t LocalMax = Max.load(std::memory_order_relaxed);
+	while (OtherMax > LocalMax && !Max.compare_exchange_weak(LocalMax, OtherMax, std::memory_order_relaxed))
+	{
+	}
+}
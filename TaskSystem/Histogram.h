@@ -0,0 +1,101 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+
+// for counters with a single writer a plain load and store is enough and avoids the locked instruction of a fetch_add, counters
+// shared by several threads pass bShared
+inline void IncrementCounter(std::atomic<uint64_t>& Counter, uint64_t Value, bool bShared)
+{
+	if (bShared)
+	{
+		Counter.fetch_add(Value, std::memory_order_relaxed);
+	}
+	else
+	{
+		Counter.store(Counter.load(std::memory_order_relaxed) + Value, std::memory_order_relaxed);
+	}
+}
+
+// HDR-style histogram of durations in nanoseconds. values below NumSubBuckets are exact, above that every power of two is split
+// into NumSubBuckets linear buckets, so a percentile is off by less than 1/NumSubBuckets. fixed size, covers the whole uint64 range
+class FLatencyHistogram
+{
+public:
+	static constexpr uint32_t SubBucketBits = 4;
+	static constexpr uint32_t NumSubBuckets = 1 << SubBucketBits;
+	static constexpr uint32_t NumBuckets = (64 - SubBucketBits + 1) * NumSubBuckets;
+
+	static uint32_t GetBucket(uint64_t Value)
+	{
+		if (Value < NumSubBuckets)
+		{
+			return uint32_t(Value);
+		}
+		uint32_t Shift = uint32_t(63 - std::countl_zero(Value)) - SubBucketBits;
+		return (Shift + 1) * NumSubBuckets + uint32_t((Value >> Shift) & (NumSubBuckets - 1));
+	}
+
+	// the lowest value that falls into the bucket
+	static uint64_t GetBucketValue(uint32_t Bucket)
+	{
+		if (Bucket < NumSubBuckets)
+		{
+			return Bucket;
+		}
+		uint32_t Shift = Bucket / NumSubBuckets - 1;
+		return (uint64_t(NumSubBuckets + Bucket % NumSubBuckets)) << Shift;
+	}
+
+	void Add(uint64_t Value)
+	{
+		Counts[GetBucket(Value)] += 1;
+		Count += 1;
+		Sum += Value;
+		Max = std::max(Max, Value);
+	}
+
+	void Merge(const FLatencyHistogram& Other);
+
+	uint64_t GetCount() const { return Count; }
+	uint64_t GetMax() const { return Max; }
+	double GetMean() const { return Count != 0 ? double(Sum) / double(Count) : 0.0; }
+
+	// Percentile in [0, 100], 0 for an empty histogram. reports the upper end of the bucket, never more than the max
+	uint64_t GetPercentile(double Percentile) const;
+
+private:
+	friend class FAtomicLatencyHistogram;
+
+	uint64_t Counts[NumBuckets] = {};
+	uint64_t Count = 0;
+	uint64_t Sum = 0;
+	uint64_t Max = 0;
+};
+
+// a FLatencyHistogram that one thread records into while others read it. the owner updates with plain loads and stores, threads
+// that share a histogram pass bShared and pay for atomic read-modify-writes
+class FAtomicLatencyHistogram
+{
+public:
+	void Add(uint64_t Value, bool bShared)
+	{
+		IncrementCounter(Counts[FLatencyHistogram::GetBucket(Value)], 1, bShared);
+		IncrementCounter(Sum, Value, bShared);
+		uint64_t LocalMax = Max.load(std::memory_order_relaxed);
+		while (Value > LocalMax && !Max.compare_exchange_weak(LocalMax, Value, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	// adds the recorded values to Histogram, a snapshot taken while the owner records can be off by the values in flight
+	void MergeInto(FLatencyHistogram& Histogram) const;
+	// atomically adds the values recorded by Other
+	void Merge(const FAtomicLatencyHistogram& Other);
+
+private:
+	std::atomic<uint64_t> Counts[FLatencyHistogram::NumBuckets] = {};
+	std::atomic<uint64_t> Sum{ 0 };
+	std::atomic<uint64_t> Max{ 0 };
+};
@@ -2,7 +2,40 @@
 #include "TaskSystem.h"
 #include "Queue.h"
 #include "Pipe.h"
+#include "ParallelFor.h"
+#include "ParallelAlgorithms.h"
+#include "Trace.h"
+#include "TaskGraphAnalysis.h"
+#include "PerfCounters.h"
 #include <iostream>
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <new>
+
+// heap allocations made by the calling thread, for the tests that check a path doesn't allocate
+static thread_local uint64_t NumThreadHeapAllocations = 0;
+
+// the memory comes from the aligned overloads the program doesn't replace, they're a matching new/delete pair
+void* operator new(size_t Size)
+{
+	NumThreadHeapAllocations += 1;
+	return ::operator new(Size, std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+
+void operator delete(void* Ptr) noexcept
+{
+	::operator delete(Ptr, std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
+
+void operator delete(void* Ptr, size_t) noexcept
+{
+	::operator delete(Ptr, std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__));
+}
 
 void TestBasic()
 {
@@ -31,6 +64,8 @@ void TestBasic()
 		Event.Trigger();
 		assert(Event.IsCompleted());
 		Event.Wait(std::chrono::seconds(0));
+		// the task still uses Event
+		Task.Wait();
 	}
 
 	{
@@ -111,124 +146,2026 @@ void TestPipe()
 		std::this_thread::sleep_for(std::chrono::milliseconds(100));
 		Prereq.Trigger();
 		Task3.Wait();
+		// Task1 entered the pipe after Task3 when Prereq was triggered, it's executed last but Task3 can complete before that
+		Task.Wait();
 		assert(value == 1);
 	}
 }
 
-template<typename QueueType>
-void TestQueue()
+void TestWorkerWakeUp()
 {
-	const int NUM_ITEMS_PER_PRODUCER = 1000;
-	const int NUM_PRODUCERS = 12;
-	const int NUM_CONSUMERS = 4;
-	QueueType queue;
-	std::atomic_int totalSum{ 0 };
-	std::atomic_int producedCount{ 0 };
-	std::atomic_int consumedCount{ 0 };
+	FSchedulerWaitStats StatsBefore = FScheduler::Get().GetWaitStats();
+	// give the workers time to run out of spinning and park
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
-	auto producer = [&](int id) {
-		for (int i = 0; i < NUM_ITEMS_PER_PRODUCER; i++)
+	std::atomic<bool> bDone{ false };
+	Launch("A", [&bDone] { bDone = true; });
+	while (!bDone)
+	{
+		std::this_thread::yield();
+	}
+
+	FSchedulerWaitStats StatsAfter = FScheduler::Get().GetWaitStats();
+	assert(StatsAfter.NumWakeUps > StatsBefore.NumWakeUps);
+	assert(StatsAfter.ParkedTime > StatsBefore.ParkedTime);
+}
+
+// a thread waiting for a long task parks instead of spinning, and a timed wait gives up in time
+void TestBlockingWait()
+{
+	FTaskHandle Task = Launch("Long", [] { std::this_thread::sleep_for(std::chrono::milliseconds(200)); });
+	// let a worker pick it up, otherwise Wait would retract and execute it on this thread
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	auto Start = std::chrono::steady_clock::now();
+	bool bCompleted = Task.Wait(std::chrono::milliseconds(20));
+	assert(!bCompleted);
+	assert(std::chrono::steady_clock::now() - Start >= std::chrono::milliseconds(20));
+
+	std::chrono::nanoseconds CpuTimeBefore = FPlatformThread::GetCurrentThreadCpuTime();
+	Task.Wait();
+	std::chrono::nanoseconds CpuTime = FPlatformThread::GetCurrentThreadCpuTime() - CpuTimeBefore;
+	assert(Task.IsCompleted());
+	// the ~170ms left were spent parked
+	assert(CpuTime < std::chrono::milliseconds(20));
+}
+
+// the only worker blocks in a wait. it helps with the nested tasks of the awaited task that were started elsewhere, never with
+// unrelated queued work
+void TestHelpWhileWaiting()
+{
+	FSchedulerConfig Config;
+	Config.NumForegroundWorkers = 1;
+	Config.MaxHelpDepth = 4;
+
+	auto WaitFor = [](std::atomic<int>& Counter, int Expected)
+	{
+		// polls instead of waiting on the tasks, Wait would retract them to this thread
+		auto Deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (Counter.load() < Expected && std::chrono::steady_clock::now() < Deadline)
 		{
-			int* value = new int(id * NUM_ITEMS_PER_PRODUCER + i);
-			queue.enqueue(value);
-			totalSum.fetch_add(*value);
-			producedCount.fetch_add(1);
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
 		}
+		return Counter.load();
 	};
 
-	auto consumer = [&]()
+	for (EWaitHelpPolicy Policy : { EWaitHelpPolicy::None, EWaitHelpPolicy::EqualOrHigherPriority, EWaitHelpPolicy::AnyPriority })
 	{
-		int* value;
-		while (consumedCount.load() < NUM_PRODUCERS * NUM_ITEMS_PER_PRODUCER)
+		// Waiter is queued while the worker is blocked in Blocked. it isn't picked up further up Blocked's stack, where it would
+		// wait for Blocked forever
+		Config.WaitHelpPolicy = Policy;
+		FScheduler::Get().StartWorkers(Config);
+		FTaskEvent Event{ "Event" };
+		std::atomic<int> NumStarted{ 0 };
+		FTaskHandle Blocked = Launch("Blocked", [&Event, &NumStarted] { NumStarted += 1; Event.Wait(); });
+		WaitFor(NumStarted, 1);
+		FTaskHandle Waiter = Launch("Waiter", [Blocked] { Blocked.Wait(); });
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		Event.Trigger();
+		assert(Waiter.Wait(std::chrono::seconds(10)));
+		assert(Blocked.IsCompleted());
+		FScheduler::Get().StopWorkers();
+	}
+
+	for (EWaitHelpPolicy Policy : { EWaitHelpPolicy::EqualOrHigherPriority, EWaitHelpPolicy::AnyPriority })
+	{
+		// Outer's body returned on the worker, its nested tasks get unlocked while the worker waits for Outer in Waiter. nobody
+		// else would execute them
+		Config.WaitHelpPolicy = Policy;
+		FScheduler::Get().StartWorkers(Config);
+		uint64_t NumHelpedBefore = FScheduler::Get().GetMetrics().Total.NumHelped;
+
+		FTaskEvent Gate{ "Gate" };
+		std::atomic<int> NumLaunched{ 0 };
+		std::atomic<int> NumExecuted{ 0 };
+		std::atomic<int> NumBackground{ 0 };
+		FTaskHandle Background;
+		FTaskHandle Outer = Launch("Outer", [&] {
+			AddNested(Launch("Nested", [&NumExecuted] { NumExecuted += 1; }, Gate));
+			Background = Launch("Background", [&NumBackground] { NumBackground += 1; }, Gate, ETaskPriority::BackgroundNormal);
+			AddNested(Background);
+			NumLaunched += 1;
+		});
+		WaitFor(NumLaunched, 1);
+
+		std::atomic<int> NumWaiting{ 0 };
+		FTaskHandle Waiter = Launch("Waiter", [Outer, &NumWaiting] { NumWaiting += 1; Outer.Wait(); });
+		WaitFor(NumWaiting, 1);
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		Gate.Trigger();
+		assert(WaitFor(NumExecuted, 1) == 1);
+
+		// a lower priority than Waiter's is only helped with AnyPriority, otherwise this thread retracts it
+		if (Policy == EWaitHelpPolicy::EqualOrHigherPriority)
 		{
-			if (value = queue.dequeue())
-			{
-				totalSum.fetch_sub(*value);
-				consumedCount.fetch_add(1);
-				delete value;
-			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			assert(NumBackground.load() == 0);
+			Background.Wait();
 		}
-	};
-	std::vector<std::thread> threads1;
-	std::vector<std::thread> threads2;
-	for (int i = 0; i < NUM_PRODUCERS; ++i) {
-		threads1.emplace_back(producer, i);
+		assert(Waiter.Wait(std::chrono::seconds(10)));
+		assert(NumBackground.load() == 1);
+		uint64_t NumHelped = FScheduler::Get().GetMetrics().Total.NumHelped - NumHelpedBefore;
+		assert(NumHelped == (Policy == EWaitHelpPolicy::AnyPriority ? 2 : 1));
+		FScheduler::Get().StopWorkers();
 	}
-	for (auto& t : threads1) {
-		t.join();
+
+	{
+		// every helped task waits for the next Outer in turn, helping nests up to MaxHelpDepth and then the worker just waits
+		Config.WaitHelpPolicy = EWaitHelpPolicy::EqualOrHigherPriority;
+		FScheduler::Get().StartWorkers(Config);
+		const int NumOuters = 8;
+		FTaskEvent Gate{ "Gate" };
+		std::atomic<int> NumLaunched{ 0 };
+		std::atomic<int> NumStarted{ 0 };
+		std::vector<FTaskHandle> Outers(NumOuters);
+		std::vector<FTaskHandle> Nested(NumOuters);
+		for (int i = 0; i < NumOuters; ++i)
+		{
+			Outers[i] = Launch("Outer", [&, i] {
+				Nested[i] = Launch("Nested", [&, i] {
+					NumStarted += 1;
+					if (i + 1 < NumOuters)
+					{
+						Outers[i + 1].Wait();
+					}
+				}, Gate);
+				AddNested(Nested[i]);
+				NumLaunched += 1;
+			});
+		}
+		WaitFor(NumLaunched, NumOuters);
+
+		std::atomic<int> NumWaiting{ 0 };
+		FTaskHandle Waiter = Launch("Waiter", [&Outers, &NumWaiting] { NumWaiting += 1; Outers[0].Wait(); });
+		WaitFor(NumWaiting, 1);
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		Gate.Trigger();
+		WaitFor(NumStarted, int(Config.MaxHelpDepth));
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		assert(NumStarted.load() == int(Config.MaxHelpDepth));
+
+		// the rest are retracted by this thread, the last one first so none of them blocks
+		for (int i = NumOuters - 1; i >= int(Config.MaxHelpDepth); --i)
+		{
+			Nested[i].Wait();
+		}
+		assert(Waiter.Wait(std::chrono::seconds(10)));
+		assert(NumStarted.load() == NumOuters);
+		FScheduler::Get().StopWorkers();
 	}
+}
 
-	queue.debug();
+void TestSchedulerMetrics()
+{
+	for (uint64_t Value : { 0ull, 1ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull, ~0ull })
+	{
+		uint32_t Bucket = FLatencyHistogram::GetBucket(Value);
+		assert(Bucket < FLatencyHistogram::NumBuckets && FLatencyHistogram::GetBucketValue(Bucket) <= Value);
+		assert(Bucket + 1 == FLatencyHistogram::NumBuckets || FLatencyHistogram::GetBucketValue(Bucket + 1) > Value);
+	}
+	FLatencyHistogram Histogram;
+	for (uint64_t Value = 1; Value <= 1000; ++Value)
+	{
+		Histogram.Add(Value);
+	}
+	assert(Histogram.GetCount() == 1000 && Histogram.GetMax() == 1000 && Histogram.GetMean() == 500.5);
+	assert(Histogram.GetPercentile(50) >= 500 && Histogram.GetPercentile(50) < 500 + 500 / FLatencyHistogram::NumSubBuckets);
+	assert(Histogram.GetPercentile(100) == 1000 && Histogram.GetPercentile(0) == 1);
 
-	for (int i = 0; i < NUM_CONSUMERS; ++i) {
-		threads2.emplace_back(consumer);
+	FSchedulerConfig Config;
+	Config.NumForegroundWorkers = 2;
+	Config.MetricsSampleInterval = 1;
+	FScheduler::Get().StartWorkers(Config);
+	FSchedulerMetrics Before = FScheduler::Get().GetMetrics();
+	assert(Before.Workers.size() == 2);
+
+	// polls instead of waiting on the tasks, Wait would retract them to this thread
+	std::atomic<int> NumExecuted{ 0 };
+	for (int i = 0; i < 1000; ++i)
+	{
+		Launch("Counted", [&NumExecuted] { NumExecuted += 1; });
+	}
+	while (NumExecuted.load() != 1000)
+	{
+		std::this_thread::yield();
 	}
+	Launch("Inline", [] {}, ETaskPriority::Normal, EExtendedTaskPriority::Inline);
 
-	for (auto& t : threads2) {
-		t.join();
+	// both workers spin, the next task can only be executed by retracting it
+	std::atomic<bool> bRelease{ false };
+	std::atomic<int> NumSpinning{ 0 };
+	for (int i = 0; i < 2; ++i)
+	{
+		Launch("Spinning", [&] { NumSpinning += 1; while (!bRelease) {} });
 	}
+	while (NumSpinning.load() != 2)
+	{
+		std::this_thread::yield();
+	}
+	FTaskHandle Retracted = Launch("Retracted", [] {});
+	FSchedulerMetrics Queued = FScheduler::Get().GetMetrics();
+	Retracted.Wait();
+	bRelease = true;
+	FScheduler::Get().StopWorkers();
 
-	assert(producedCount.load() == NUM_PRODUCERS * NUM_ITEMS_PER_PRODUCER);
-	assert(consumedCount.load() == NUM_PRODUCERS * NUM_ITEMS_PER_PRODUCER);
-	assert(totalSum.load() == 0);
-	assert(queue.isEmpty());
+	FSchedulerMetrics After = FScheduler::Get().GetMetrics();
+	assert(Queued.QueueDepth[int(ETaskPriority::Normal)] >= 1);
+	assert(After.Workers.empty() && After.Total.NumExecuted == After.External.NumExecuted);
+	// the retracted task's queue entry is executed as well, and finds the task done
+	assert(After.Total.NumExecuted - Before.Total.NumExecuted >= 1003);
+	assert(After.Total.NumRetractions - Before.Total.NumRetractions == 1);
+	assert(After.Total.NumInlineExecutions - Before.Total.NumInlineExecutions == 1);
+	uint64_t NumDequeues = After.Total.NumLocalDequeues + After.Total.NumGlobalDequeues + After.Total.NumSteals;
+	assert(NumDequeues - (Before.Total.NumLocalDequeues + Before.Total.NumGlobalDequeues + Before.Total.NumSteals) >= 1003);
+	assert(After.QueueWaitTime.GetCount() - Before.QueueWaitTime.GetCount() >= 1003);
+	assert(After.RunTime.GetCount() == After.QueueWaitTime.GetCount());
+	assert(After.QueueWaitTime.GetPercentile(50) <= After.QueueWaitTime.GetMax());
 }
 
-template<typename Q>
-void BenchmarkQueue(const std::string& name) {
-	const static int NUM_OPERATIONS = 10000000;
-	const static int NUM_THREADS = 4;
-	Q queue;
-	std::atomic<int> operationCount(0);
+// no workers are running, everything Wait gets done is retracted to the waiting thread
+void TestRetraction()
+{
+	const int NumTasks = 10000;
+	const auto Timeout = std::chrono::seconds(10);
 
-	auto worker = [&]() {
-		while (true) {
-			int count = operationCount.fetch_add(1);
-			if (count >= NUM_OPERATIONS) break;
+	{
+		// a long prerequisites chain doesn't overflow the stack
+		int Value = 0;
+		FTaskHandle Prev = Launch("Chain", [&Value] { Value += 1; });
+		for (int i = 1; i < NumTasks; ++i)
+		{
+			Prev = Launch("Chain", [&Value, i] { assert(Value == i); Value += 1; }, Prev);
+		}
+		bool bCompleted = Prev.Wait(Timeout);
+		assert(bCompleted && Value == NumTasks);
+	}
 
-			if (count % 2 == 0) {
-				int* value = new int(count);
-				queue.enqueue(value);
-			}
-			else {
-				int* value;
-				if (value = queue.dequeue()) {
-					delete value;
-				}
+	{
+		// piped tasks depend on the previous one in the pipe
+		FPipe Pipe{ "Pipe" };
+		int Value = 0;
+		FTaskHandle Last;
+		for (int i = 0; i < NumTasks; ++i)
+		{
+			Last = Pipe.Launch("Piped", [&Value, i] { assert(Value == i); Value += 1; });
+		}
+		bool bCompleted = Last.Wait(Timeout);
+		assert(bCompleted && Value == NumTasks);
+	}
+
+	{
+		// retraction fails while the chain is blocked, it's retried by the next wait
+		FTaskEvent Event{ "Event" };
+		std::atomic<int> Value = 0;
+		FTaskHandle Prev = Event;
+		for (int i = 0; i < 100; ++i)
+		{
+			Prev = Launch("Blocked", [&Value] { Value += 1; }, Prev);
+		}
+		bool bCompleted = Prev.Wait(std::chrono::milliseconds(10));
+		assert(!bCompleted && Value == 0);
+
+		Event.Trigger();
+		bCompleted = Prev.Wait(Timeout);
+		assert(bCompleted && Value == 100);
+	}
+
+	{
+		// nested tasks of a retracted task are retracted too
+		std::atomic<int> Value = 0;
+		FTaskHandle Parent = Launch("Parent", [&Value]
+		{
+			for (int i = 0; i < 100; ++i)
+			{
+				AddNested(Launch("Nested", [&Value] { Value += 1; }));
 			}
+		});
+		bool bCompleted = Parent.Wait(Timeout);
+		assert(bCompleted && Value == 100);
+	}
+
+	{
+		// a lattice where every layer depends on both tasks of the layer before: 2^Depth paths, the walk stops following tasks it
+		// has seen once it gets long
+		const int Depth = 40;
+		FTaskEvent Event{ "Event" };
+		std::atomic<int> Value = 0;
+		FTaskHandle Left = Event;
+		FTaskHandle Right = Event;
+		for (int i = 0; i < Depth; ++i)
+		{
+			FTaskEvent Join{ "Join" };
+			Join.AddPrerequisites(Left);
+			Join.AddPrerequisites(Right);
+			Join.Trigger();
+			Left = Launch("Lattice", [&Value] { Value += 1; }, Join);
+			Right = Launch("Lattice", [&Value] { Value += 1; }, Join);
 		}
-		};
+		bool bCompleted = Left.Wait(std::chrono::milliseconds(10));
+		assert(!bCompleted && Value == 0);
 
-	std::vector<std::thread> threads;
-	auto start = std::chrono::high_resolution_clock::now();
+		Event.Trigger();
+		bCompleted = Left.Wait(Timeout) && Right.Wait(Timeout);
+		assert(bCompleted && Value == 2 * Depth);
+	}
+}
 
-	for (int i = 0; i < NUM_THREADS; ++i) {
-		threads.emplace_back(worker);
+// a chain of tasks runs on the worker that started it, every completed task hands its subsequent over as the continuation
+void TestContinuations()
+{
+	for (bool bUseContinuations : { true, false })
+	{
+		FSchedulerConfig Config;
+		Config.NumForegroundWorkers = 2;
+		Config.bUseContinuations = bUseContinuations;
+		FScheduler::Get().StartWorkers(Config);
+
+		const int NumTasks = 1000;
+		FTaskEvent Event{ "Event" };
+		std::vector<std::thread::id> ThreadIds(NumTasks);
+		FTaskHandle Prev = Event;
+		for (int i = 0; i < NumTasks; ++i)
+		{
+			Prev = Launch("Chain", [&ThreadIds, i] { ThreadIds[i] = std::this_thread::get_id(); }, Prev);
+		}
+		Event.Trigger();
+
+		// polls instead of waiting on the chain, Wait would retract it to this thread
+		while (!Prev.IsCompleted())
+		{
+			std::this_thread::yield();
+		}
+		if (bUseContinuations)
+		{
+			assert(std::count(ThreadIds.begin(), ThreadIds.end(), ThreadIds[0]) == NumTasks);
+		}
+
+		FScheduler::Get().StopWorkers();
 	}
+}
 
-	for (auto& t : threads) {
-		t.join();
+// no workers are running, launched tasks are executed right away by this thread and everything is recorded into its buffer
+void TestTrace()
+{
+#if TASK_TRACE_ENABLED
+	FTaskTrace::Start();
+	FTaskHandle First = Launch("First", [] {});
+	FTaskHandle Second = Launch("Second", [] {}, First);
+	{
+		FPipe Pipe{ "Pipe" };
+		Pipe.Launch("Piped", [] {}).Wait();
 	}
+	FTaskTrace::Stop();
+	Launch("NotRecorded", [] {});
 
-	auto end = std::chrono::high_resolution_clock::now();
-	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+	std::vector<FTraceEvent> Events = FTaskTrace::GetThreadEvents();
+	std::vector<std::pair<ETraceEventType, std::string>> Expected = {
+		{ ETraceEventType::Ready, "First" }, { ETraceEventType::ExecuteBegin, "First" }, { ETraceEventType::ExecuteEnd, "First" },
+		{ ETraceEventType::Ready, "Second" }, { ETraceEventType::ExecuteBegin, "Second" }, { ETraceEventType::ExecuteEnd, "Second" },
+		{ ETraceEventType::Ready, "Piped" }, { ETraceEventType::PipeBegin, "Pipe" }, { ETraceEventType::ExecuteBegin, "Piped" },
+		{ ETraceEventType::ExecuteEnd, "Piped" }, { ETraceEventType::PipeEnd, "Pipe" },
+	};
+	assert(Events.size() == Expected.size());
+	for (size_t Index = 0; Index < Events.size(); ++Index)
+	{
+		assert(Events[Index].Type == Expected[Index].first && Events[Index].Name == Expected[Index].second);
+		assert(Index == 0 || Events[Index].TimeNs >= Events[Index - 1].TimeNs);
+	}
 
-	std::cout << name << " took " << duration.count() << " ms" << std::endl;
+	std::ostringstream Json;
+	FTaskTrace::WriteChromeTrace(Json);
+	assert(Json.str().find("\"traceEvents\"") != std::string::npos);
+	assert(Json.str().find("\"name\":\"Ready: Second\"") != std::string::npos);
+	assert(Json.str().find("NotRecorded") == std::string::npos);
+#endif
+}
 
-	// ʣڴ
-	int* remainingValue;
-	while (remainingValue = queue.dequeue()) {
-		delete remainingValue;
+void TestTaskGraphAnalysis()
+{
+#if TASK_TRACE_ENABLED
+	auto Sleep = [](int Ms) { std::this_thread::sleep_for(std::chrono::milliseconds(Ms)); };
+
+	// Gate -> A -> B -> Join -> D, C runs next to A and B and has slack
+	FTaskTrace::Start();
+	{
+		FTaskEvent Gate{ "Gate" };
+		FTaskHandle A = Launch("A", [&] { Sleep(20); }, Gate);
+		FTaskHandle B = Launch("B", [&] { Sleep(20); }, A);
+		FTaskHandle C = Launch("C", [&] { Sleep(5); }, Gate);
+		FTaskEvent Join{ "Join" };
+		Join.AddPrerequisites(B);
+		Join.AddPrerequisites(C);
+		FTaskHandle D = Launch("D", [&] { Sleep(10); }, Join);
+		Join.Trigger();
+		Gate.Trigger();
+		D.Wait();
+	}
+	FTaskTrace::Stop();
+
+	FTaskGraphAnalysis Analysis = FTaskGraphAnalysis::FromCapture();
+	assert(Analysis.GetNodes().size() == 6);
+	assert(Analysis.GetNumEdges() == 6 && Analysis.GetNumUnresolvedEdges() == 0);
+	assert(Analysis.GetSpanNs() >= 50'000'000 && Analysis.GetSpanNs() < Analysis.GetWorkNs());
+	assert(Analysis.GetParallelism() > 1.0);
+
+	std::vector<std::string> Path;
+	for (uint32_t Index : Analysis.GetCriticalPath())
+	{
+		Path.push_back(Analysis.GetNodes()[Index].Name);
+	}
+	assert((Path == std::vector<std::string>{ "Gate", "A", "B", "Join", "D" }));
+
+	std::vector<FTaskGraphAnalysis::FNameStats> Stats = Analysis.GetNameStats();
+	auto FindStats = [&Stats](const char* Name)
+	{
+		return *std::find_if(Stats.begin(), Stats.end(), [Name](const FTaskGraphAnalysis::FNameStats& Entry) { return Entry.Name == Name; });
+	};
+	assert(FindStats("C").MinSlackNs >= 30'000'000 && FindStats("C").NumOnCriticalPath == 0);
+	assert(FindStats("A").MinSlackNs == 0 && FindStats("A").NumOnCriticalPath == 1);
+
+	// a parent completes with its nested task, which makes the nested task part of the path to the parent's subsequent
+	FTaskTrace::Start();
+	{
+		FTaskEvent NestedGate{ "NestedGate" };
+		FTaskHandle Parent = Launch("Parent", [&] {
+			AddNested(Launch("Nested", [&] { Sleep(20); }, NestedGate));
+			Sleep(5);
+		});
+		FTaskHandle After = Launch("After", [&] { Sleep(5); }, Parent);
+		NestedGate.Trigger();
+		After.Wait();
 	}
+	FTaskTrace::Stop();
+
+	FTaskGraphAnalysis NestedAnalysis = FTaskGraphAnalysis::FromCapture();
+	assert(NestedAnalysis.GetNumUnresolvedEdges() == 0);
+	assert(NestedAnalysis.GetSpanNs() >= 25'000'000);
+	Path.clear();
+	for (uint32_t Index : NestedAnalysis.GetCriticalPath())
+	{
+		Path.push_back(NestedAnalysis.GetNodes()[Index].Name);
+	}
+	assert(Path.size() >= 2 && Path[Path.size() - 2] == "Nested" && Path.back() == "After");
+
+	std::ostringstream Report;
+	NestedAnalysis.WriteReport(Report);
+	assert(Report.str().find("critical path:") != std::string::npos);
+#endif
 }
-int main()
+
+void TestBackgroundWorkers()
 {
-	FScheduler::Get().StartWorkers(2);// std::thread::hardware_concurrency());
+	FSchedulerConfig Config;
+	Config.NumForegroundWorkers = 1;
+	Config.NumBackgroundWorkers = 1;
+	FScheduler::Get().StartWorkers(Config);
 
-	
-	//TestQueue<FOverflowQueue<int>>();
-	TestQueue<FLockFreeQueue<int>>();
-	//BenchmarkQueue<FOverflowQueue<int>>("OverflowQueue");
+	std::atomic<bool> bForegroundRanOnBackground{ true };
+	std::atomic<bool> bBackgroundRanOnBackground{ false };
+	std::atomic<int> NumDone{ 0 };
+	Launch("Foreground", [&] {
+		bForegroundRanOnBackground = FSchedulerTls::IsBackgroundWorker();
+		NumDone += 1;
+	}, ETaskPriority::High);
+	Launch("Background", [&] {
+		bBackgroundRanOnBackground = FSchedulerTls::IsBackgroundWorker();
+		NumDone += 1;
+	}, ETaskPriority::BackgroundNormal);
+	while (NumDone != 2)
+	{
+		std::this_thread::yield();
+	}
+	assert(!bForegroundRanOnBackground);
+	assert(bBackgroundRanOnBackground);
+
+	// the only foreground worker is blocked, so the background worker has to pick up the starved foreground task
+	FTaskEvent Blocker{ "Blocker" };
+	Launch("Blocking", [&Blocker] { Blocker.Wait(); }, ETaskPriority::Normal);
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	std::atomic<bool> bStarvedRan{ false };
+	Launch("Starved", [&bStarvedRan] { bStarvedRan = true; }, ETaskPriority::Normal);
+	while (!bStarvedRan)
+	{
+		std::this_thread::yield();
+	}
+	Blocker.Trigger();
+
+	FScheduler::Get().StopWorkers();
+}
+
+void TestAffinity()
+{
+	assert((FCpuTopology::ParseCpuList("0-3,8,10-11") == std::vector<uint32_t>{ 0, 1, 2, 3, 8, 10, 11 }));
+
+	const FCpuTopology& Topology = FCpuTopology::Get();
+	assert(Topology.AssignCpus(EAffinityPolicy::None, 4, {}).empty());
+	assert((Topology.AssignCpus(EAffinityPolicy::Explicit, 3, { 0 }) == std::vector<uint32_t>{ 0, 0, 0 }));
+	for (EAffinityPolicy Policy : { EAffinityPolicy::Compact, EAffinityPolicy::Scatter })
+	{
+		std::vector<uint32_t> Cpus = Topology.AssignCpus(Policy, 4, {});
+		assert(Cpus.size() == 4);
+		for (uint32_t Cpu : Cpus)
+		{
+			assert(Topology.FindCpu(Cpu) != nullptr);
+		}
+	}
+
+	FSchedulerConfig Config;
+	Config.NumForegroundWorkers = 2;
+	Config.AffinityPolicy = EAffinityPolicy::Compact;
+	FScheduler::Get().StartWorkers(Config);
+	std::atomic<bool> bDone{ false };
+	Launch("A", [&bDone] { bDone = true; });
+	while (!bDone)
+	{
+		std::this_thread::yield();
+	}
+	FScheduler::Get().StopWorkers();
+}
+
+void TestDynamicWorkers()
+{
+	FSchedulerConfig Config;
+	Config.NumForegroundWorkers = 1;
+	Config.MinForegroundWorkers = 1;
+	Config.MaxForegroundWorkers = 4;
+	Config.ScaleUpWaitTime = std::chrono::microseconds(1000);
+	Config.WorkerIdleTimeout = std::chrono::milliseconds(20);
+	FScheduler::Get().StartWorkers(Config);
+	assert(FScheduler::Get().GetNumActiveForegroundWorkers() == 1);
+
+	// blocking tasks keep the queue backed up, the pool has to grow
+	std::atomic<int> NumDone{ 0 };
+	const int NumTasks = 200;
+	for (int i = 0; i < NumTasks; ++i)
+	{
+		Launch("Sleep", [&NumDone] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			NumDone += 1;
+		});
+	}
+	uint32_t MaxActive = 1;
+	while (NumDone != NumTasks)
+	{
+		MaxActive = std::max(MaxActive, FScheduler::Get().GetNumActiveForegroundWorkers());
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	assert(MaxActive > 1 && MaxActive <= 4);
+
+	// idle workers retire down to the minimum
+	while (FScheduler::Get().GetNumActiveForegroundWorkers() != 1)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	assert(FScheduler::Get().GetNumActiveWorkers() == 1);
 
+	// the remaining worker still runs tasks
+	std::atomic<bool> bDone{ false };
+	Launch("A", [&bDone] { bDone = true; });
+	while (!bDone)
+	{
+		std::this_thread::yield();
+	}
 	FScheduler::Get().StopWorkers();
+}
+
+void TestTaskList()
+{
+	const int NUM_ITEMS_PER_PRODUCER = 10000;
+	const int NUM_PRODUCERS = 4;
+
+	std::vector<int> Items(NUM_ITEMS_PER_PRODUCER * NUM_PRODUCERS);
+	std::vector<std::atomic<int>> NumConsumed(Items.size());
+	std::vector<std::atomic<bool>> bPushed(Items.size());
+	TTaskList<int, 4> List;
+
+	std::atomic<bool> bClose{ false };
+	std::vector<std::thread> Producers;
+	for (int i = 0; i < NUM_PRODUCERS; ++i)
+	{
+		Producers.emplace_back([&, i] {
+			for (int j = 0; j < NUM_ITEMS_PER_PRODUCER; ++j)
+			{
+				int Index = i * NUM_ITEMS_PER_PRODUCER + j;
+				bPushed[Index] = List.PushIfNotClosed(&Items[Index]);
+				if (j == NUM_ITEMS_PER_PRODUCER / 2)
+				{
+					bClose = true;
+				}
+			}
+		});
+	}
+
+	// consume concurrently with the producers, then close in the middle of pushing
+	while (!bClose)
+	{
+		List.ConsumeAll([&](int* Item) { NumConsumed[Item - Items.data()] += 1; });
+	}
+	List.ConsumeAll([&](int* Item) { NumConsumed[Item - Items.data()] += 1; });
+	std::vector<bool> bClosedOver(Items.size());
+	List.Close([&](int* Item) { bClosedOver[Item - Items.data()] = true; });
+	assert(List.IsClosed());
+	for (std::thread& Producer : Producers)
+	{
+		Producer.join();
+	}
+	List.ConsumeAll([&](int* Item) { NumConsumed[Item - Items.data()] += 1; });
+
+	for (size_t Index = 0; Index < Items.size(); ++Index)
+	{
+		// every successful push is seen by Close and consumed exactly once, failed pushes are not seen at all
+		assert(bClosedOver[Index] == bPushed[Index]);
+		assert(NumConsumed[Index] == (bPushed[Index] ? 1 : 0));
+	}
+	assert(!List.PushIfNotClosed(&Items[0]));
+
+	// a task keeps up to 4 prerequisites and 4 subsequents inline, one more of each goes to overflow chunks
+	auto CountEdgeAllocations = [](uint32_t NumEdges)
+	{
+		FTaskEvent Join{ "Join" };
+		std::vector<FTaskEvent> Prerequisites;
+		std::vector<FTaskEvent> Subsequents;
+		for (uint32_t Index = 0; Index < NumEdges; ++Index)
+		{
+			Prerequisites.emplace_back("Prerequisite");
+			Subsequents.emplace_back("Subsequent");
+		}
+		uint64_t NumAllocations = NumThreadHeapAllocations;
+		for (uint32_t Index = 0; Index < NumEdges; ++Index)
+		{
+			Join.AddPrerequisites(Prerequisites[Index]);
+			Subsequents[Index].AddPrerequisites(Join);
+		}
+		NumAllocations = NumThreadHeapAllocations - NumAllocations;
+
+		Join.Trigger();
+		for (uint32_t Index = 0; Index < NumEdges; ++Index)
+		{
+			Prerequisites[Index].Trigger();
+			Subsequents[Index].Trigger();
+		}
+		for (FTaskEvent& Subsequent : Subsequents)
+		{
+			Subsequent.Wait();
+		}
+		return NumAllocations;
+	};
+	assert(CountEdgeAllocations(4) == 0);
+	assert(CountEdgeAllocations(5) != 0);
+}
+
+void TestTaskAllocator()
+{
+	FTaskAllocator& Allocator = FTaskAllocator::Get();
+	FTaskAllocatorStats Before = Allocator.GetStats();
+
+	// allocated on one thread, freed on another: the blocks travel back through the central freelist
+	const int NUM_BLOCKS = 10000;
+	std::vector<void*> Blocks;
+	std::thread Producer([&] {
+		for (int i = 0; i < NUM_BLOCKS; ++i)
+		{
+			void* Block = Allocator.Allocate(200);
+			assert(uintptr_t(Block) % PLATFORM_CACHE_LINE_SIZE == 0);
+			Blocks.push_back(Block);
+		}
+	});
+	Producer.join();
+	FTaskAllocatorStats Allocated = Allocator.GetStats();
+	// 256 byte blocks with 64 byte cache lines
+	const uint32_t SizeClass = (200 + PLATFORM_CACHE_LINE_SIZE - 1) / PLATFORM_CACHE_LINE_SIZE - 1;
+	assert(Allocated.SizeClasses[SizeClass].BlockSize == (SizeClass + 1) * PLATFORM_CACHE_LINE_SIZE);
+	assert(Allocated.SizeClasses[SizeClass].NumBlocksInUse >= Before.SizeClasses[SizeClass].NumBlocksInUse + NUM_BLOCKS);
+	assert(Allocated.SizeClasses[SizeClass].NumBlocks >= Allocated.SizeClasses[SizeClass].NumBlocksInUse);
+
+	std::thread Consumer([&] {
+		for (void* Block : Blocks)
+		{
+			Allocator.Free(Block, 200);
+		}
+	});
+	Consumer.join();
+	FTaskAllocatorStats Freed = Allocator.GetStats();
+	assert(Freed.SizeClasses[SizeClass].NumBlocksInUse == Before.SizeClasses[SizeClass].NumBlocksInUse);
+	assert(Freed.SizeClasses[SizeClass].NumSlabs == Allocated.SizeClasses[SizeClass].NumSlabs);
+
+	{
+		// a thread of the last node is served from slabs carved for that node
+		const uint32_t LargestClass = FTaskAllocator::NumSizeClasses - 1;
+		const uint32_t NumBlocksPerSlab = FTaskAllocator::SlabSize / FTaskAllocator::MaxBlockSize;
+		const uint32_t Node = uint32_t(Before.SizeClasses[LargestClass].NumSlabsPerNode.size()) - 1;
+		std::thread NodeThread([&] {
+			FTaskAllocator::SetThreadNode(Node);
+			std::vector<void*> NodeBlocks;
+			for (uint32_t i = 0; i < 2 * NumBlocksPerSlab; ++i)
+			{
+				NodeBlocks.push_back(Allocator.Allocate(FTaskAllocator::MaxBlockSize));
+			}
+			FTaskAllocatorStats NodeStats = Allocator.GetStats();
+			assert(NodeStats.SizeClasses[LargestClass].NumSlabsPerNode[Node] >= 2);
+			for (void* Block : NodeBlocks)
+			{
+				Allocator.Free(Block, FTaskAllocator::MaxBlockSize);
+			}
+		});
+		NodeThread.join();
+	}
+
+	// too big for the slabs
+	void* Big = Allocator.Allocate(FTaskAllocator::MaxBlockSize + 1);
+	Allocator.Free(Big, FTaskAllocator::MaxBlockSize + 1);
+	assert(Allocator.GetStats().NumFallbackAllocations == Before.NumFallbackAllocations + 1);
+
+	// tasks go through the allocator
+	uint64_t NumAllocations = Allocator.GetStats().NumAllocations;
+	Launch("A", [] {}).Wait();
+	assert(Allocator.GetStats().NumAllocations == NumAllocations + 1);
+}
+
+void TestTaskDelegate()
+{
+	using FDelegate = TTaskDelegate<int(), 32>;
+	std::array<int, 32> Big;
+	for (int i = 0; i < 32; ++i)
+	{
+		Big[i] = i;
+	}
+	auto BigCallable = [Big, Owner = std::make_unique<int>(1)] { return Big[31] + *Owner; };
+	static_assert(!FDelegate::IsInline<decltype(BigCallable)>);
+	static_assert(FDelegate::IsInline<int(*)()>);
+
+	// too big for the inline storage, goes to the heap and survives moving between delegates
+	FDelegate Delegate = std::move(BigCallable);
+	assert(Delegate() == 32);
+	FDelegate Moved;
+	assert(Delegate.CallAndMove(Moved) == 32);
+	assert(Moved() == 32);
+
+	// spills of low-level task bodies are counted per call site. sized from the delegate, LOWLEVEL_TASK_SIZE can be overridden
+	std::array<char, FTaskDelegate::InlineStorageSize> TooBig{};
+	TooBig[0] = 31;
+	FLowLevelTask Task;
+	int Result = 0;
+	Task.Init("SpillingTask", ETaskPriority::Normal, [TooBig, &Result] { Result = TooBig[0]; });
+	bool bPrepared = Task.TryPrepareLaunch();
+	assert(bPrepared);
+	Task.ExecuteTask();
+	assert(Result == 31);
+	std::vector<FTaskDelegateSpillCounter::FEntry> Spills = FTaskDelegateSpillCounter::GetAll();
+	auto Spill = std::find_if(Spills.begin(), Spills.end(), [](const FTaskDelegateSpillCounter::FEntry& Entry) { return std::string(Entry.DebugName) == "SpillingTask"; });
+	assert(Spill != Spills.end() && Spill->NumSpills >= 1 && Spill->CallableSize > sizeof(TooBig));
+
+	// a Launch body is stored in the task object, it's counted if it makes the task too big for FTaskAllocator
+	std::array<char, FTaskAllocator::MaxBlockSize> Huge{};
+	Huge[0] = 1;
+	TTask<int> HugeTask = Launch("HugeTask", [Huge] { return int(Huge[0]); });
+	assert(HugeTask.GetResult() == 1);
+	Launch("SmallTask", [&Result] { Result = 1; }).Wait();
+	Spills = FTaskDelegateSpillCounter::GetAll();
+	auto DebugNameIs = [](const char* DebugName)
+	{
+		return [DebugName](const FTaskDelegateSpillCounter::FEntry& Entry) { return std::string(Entry.DebugName) == DebugName; };
+	};
+	Spill = std::find_if(Spills.begin(), Spills.end(), DebugNameIs("HugeTask"));
+	assert(Spill != Spills.end() && Spill->NumSpills == 1 && Spill->CallableSize == sizeof(Huge));
+	assert(std::find_if(Spills.begin(), Spills.end(), DebugNameIs("SmallTask")) == Spills.end());
+}
+
+struct FCounted
+{
+	FCounted(int InValue) : Value(InValue) {}
+	FCounted(const FCounted& Other) : Value(Other.Value) { NumCopies += 1; }
+	FCounted(FCounted&& Other) : Value(Other.Value) {}
+	int Value;
+	static inline std::atomic<int> NumCopies{ 0 };
+};
+
+void TestTaskResult()
+{
+	FScheduler::Get().StartWorkers(2);
+
+	TTask<int> Answer = Launch("Answer", [] { return 42; });
+	assert(Answer.GetResult() == 42);
+
+	// copies are counted, results must only ever be constructed in place or moved
+	TTask<FCounted> Counted = Launch("Counted", [] { return FCounted(7); });
+	FCounted Taken = std::move(Counted.GetResult());
+	assert(Taken.Value == 7 && FCounted::NumCopies == 0);
+
+	// a buffer passed between pipeline stages keeps its allocation
+	FPipe Pipe{ "Stages" };
+	TTask<std::vector<int>> Produce = Pipe.Launch("Produce", [] { return std::vector<int>(1 << 20, 1); });
+	const int* Data = nullptr;
+	TTask<std::unique_ptr<int>> Consume = Pipe.Launch("Consume", [&Produce, &Data] {
+		std::vector<int> Buffer = std::move(Produce.GetResult());
+		Data = Buffer.data();
+		return std::make_unique<int>(int(Buffer.size()));
+	});
+	std::unique_ptr<int> Size = std::move(Consume.GetResult());
+	assert(*Size == 1 << 20);
+	assert(Produce.GetResult().empty());
+
+	// retraction: the result is available even if no worker picked up the task yet
+	FTaskEvent Blocker{ "Blocker" };
+	TTask<int> Retracted = Launch("Retracted", [] { return 1; }, Blocker);
+	Blocker.Trigger();
+	assert(Retracted.GetResult() == 1);
+
+	FScheduler::Get().StopWorkers();
+}
+
+void TestCancellation()
+{
+	FScheduler::Get().StartWorkers(2);
+
+	// canceled before it could run: the body is skipped, the task completes and so does what depends on it, canceled as well
+	{
+		FCancellationToken Token;
+		FTaskEvent Blocker{ "Blocker" };
+		std::atomic<int> NumExecuted{ 0 };
+		TTask<int> Canceled = Launch("Canceled", [&NumExecuted] { NumExecuted += 1; return 1; }, Blocker, Token);
+		FTaskHandle Downstream = Launch("Downstream", [&NumExecuted] { NumExecuted += 1; }, Canceled);
+		FTaskEvent Event{ "Event" };
+		Event.AddPrerequisites(Downstream);
+		Event.Trigger();
+		FTaskHandle AfterEvent = Launch("AfterEvent", [&NumExecuted] { NumExecuted += 1; }, Event);
+
+		Token.Cancel();
+		Blocker.Trigger();
+		AfterEvent.Wait();
+		assert(NumExecuted == 0);
+		assert(Canceled.IsCompleted() && Canceled.IsCanceled());
+		assert(Downstream.IsCanceled() && Event.IsCanceled() && AfterEvent.IsCanceled());
+		assert(!Blocker.IsCanceled());
+	}
+
+	// a token canceled after the task ran doesn't change anything
+	{
+		FCancellationToken Token;
+		TTask<int> Done = Launch("Done", [] { return 1; }, Token);
+		assert(Done.GetResult() == 1);
+		Token.Cancel();
+		FTaskHandle Downstream = Launch("Downstream", [] {}, Done);
+		Downstream.Wait();
+		assert(!Done.IsCanceled() && !Downstream.IsCanceled());
+	}
+
+	// nested tasks get the token of their parent, canceling it while the parent runs sheds what the parent launched and what
+	// depends on the parent
+	{
+		FCancellationToken Token;
+		FTaskEvent Blocker{ "Blocker" };
+		std::atomic<int> NumExecuted{ 0 };
+		FTaskHandle Child;
+		FTaskHandle Parent = Launch("Parent", [&] {
+			assert(FCancellationTokenScope::GetCurrentToken() != nullptr && !FCancellationTokenScope::IsCurrentWorkCanceled());
+			Child = Launch("Child", [&NumExecuted] { NumExecuted += 1; }, Blocker);
+			AddNested(Child);
+			Token.Cancel();
+			assert(FCancellationTokenScope::IsCurrentWorkCanceled());
+		}, Token);
+		FTaskHandle Downstream = Launch("Downstream", [&NumExecuted] { NumExecuted += 1; }, Parent);
+
+		while (!Token.IsCanceled())
+		{
+			std::this_thread::yield();
+		}
+		Blocker.Trigger();
+		Downstream.Wait();
+		assert(NumExecuted == 0);
+		assert(Child.IsCanceled() && Parent.IsCanceled() && Downstream.IsCanceled());
+	}
+
+	// a nested task with a token of its own doesn't cancel its parent, which already ran
+	{
+		FCancellationToken Token;
+		Token.Cancel();
+		std::atomic<int> NumExecuted{ 0 };
+		FTaskHandle Child;
+		FTaskHandle Parent = Launch("Parent", [&] {
+			Child = Launch("Child", [&NumExecuted] { NumExecuted += 1; }, Token);
+			AddNested(Child);
+		});
+		FTaskHandle Downstream = Launch("Downstream", [&NumExecuted] { NumExecuted += 1; }, Parent);
+		Downstream.Wait();
+		assert(NumExecuted == 1);
+		assert(Child.IsCanceled() && !Parent.IsCanceled() && !Downstream.IsCanceled());
+	}
+
+	// a task launched in a scope gets the scope's token, a scope of nullptr detaches a task from the token of the running one
+	{
+		FCancellationToken Token;
+		Token.Cancel();
+		std::atomic<int> NumExecuted{ 0 };
+		FTaskHandle Scoped;
+		FTaskHandle Detached;
+		{
+			FCancellationTokenScope Scope(&Token);
+			FPipe Pipe{ "Pipe" };
+			Scoped = Pipe.Launch("Scoped", [&NumExecuted] { NumExecuted += 1; });
+			{
+				FCancellationTokenScope DetachedScope(nullptr);
+				// ordered after Scoped by the pipe, but doesn't depend on it
+				Detached = Pipe.Launch("Detached", [&NumExecuted] { NumExecuted += 1; });
+			}
+			Detached.Wait();
+		}
+		assert(FCancellationTokenScope::GetCurrentToken() == nullptr);
+		assert(Scoped.IsCanceled() && !Detached.IsCanceled() && NumExecuted == 1);
+	}
+
+	// inline tasks and retraction check the token as well
+	{
+		FCancellationToken Token;
+		Token.Cancel();
+		std::atomic<int> NumExecuted{ 0 };
+		FTaskHandle Inline = Launch("Inline", [&NumExecuted] { NumExecuted += 1; }, Token, ETaskPriority::Normal, EExtendedTaskPriority::Inline);
+		FTaskEvent Blocker{ "Blocker" };
+		FTaskHandle Retracted = Launch("Retracted", [&NumExecuted] { NumExecuted += 1; }, Blocker, Token);
+		Blocker.Trigger();
+		Retracted.Wait();
+		assert(Inline.IsCompleted() && Inline.IsCanceled() && Retracted.IsCanceled() && NumExecuted == 0);
+	}
+
+	// canceling while many tasks are queued: every task completes, each one either ran or was canceled
+	{
+		const int NUM_TASKS = 10000;
+		FCancellationToken Token;
+		std::atomic<int> NumExecuted{ 0 };
+		std::vector<FTaskHandle> Tasks;
+		for (int i = 0; i < NUM_TASKS; ++i)
+		{
+			Tasks.push_back(Launch("Shed", [&NumExecuted] { NumExecuted += 1; }, Token));
+			if (i == NUM_TASKS / 2)
+			{
+				Token.Cancel();
+			}
+		}
+		int NumCanceled = 0;
+		for (FTaskHandle& Task : Tasks)
+		{
+			Task.Wait();
+			NumCanceled += Task.IsCanceled() ? 1 : 0;
+		}
+		assert(NumCanceled + NumExecuted == NUM_TASKS && NumCanceled >= NUM_TASKS / 2 - 1);
+	}
+
+	FScheduler::Get().StopWorkers();
+}
+
+void TestParallelFor()
+{
+	auto Check = [](int32_t Num, int32_t MinBatchSize)
+	{
+		std::vector<std::atomic<int>> Visits(Num);
+		ParallelFor(Num, [&Visits](int32_t Index) { Visits[Index] += 1; }, MinBatchSize);
+		for (std::atomic<int>& NumVisits : Visits)
+		{
+			assert(NumVisits == 1);
+		}
+	};
+
+	// without workers the loop runs on the calling thread
+	Check(1000, 10);
+
+	FScheduler::Get().StartWorkers(4);
+	for (int32_t Num : { 0, 1, 7, 1000, 100000 })
+	{
+		for (int32_t MinBatchSize : { 1, 16, 1024 })
+		{
+			Check(Num, MinBatchSize);
+		}
+	}
+
+	// nested loops, the inner ones run inside tasks of the outer one
+	std::atomic<int> Sum{ 0 };
+	ParallelFor(64, [&Sum](int32_t) {
+		ParallelFor(64, [&Sum](int32_t Index) { Sum += Index; }, 4);
+	}, 1);
+	assert(Sum == 64 * (63 * 64 / 2));
+	FScheduler::Get().StopWorkers();
+}
+
+void TestParallelAlgorithms()
+{
+	std::mt19937 Random(42);
+	auto Check = [&Random](int64_t Num)
+	{
+		std::vector<int64_t> Values(Num);
+		for (int64_t& Value : Values)
+		{
+			Value = int64_t(Random() % 1000) - 500;
+		}
+
+		assert(ParallelReduce(Values.data(), Num, int64_t(0)) == std::accumulate(Values.begin(), Values.end(), int64_t(0)));
+		int64_t Max = ParallelReduce(Values.data(), Num, INT64_MIN, [](int64_t A, int64_t B) { return std::max(A, B); });
+		assert(Num == 0 || Max == *std::max_element(Values.begin(), Values.end()));
+
+		std::vector<int64_t> Scanned(Num);
+		std::vector<int64_t> Expected(Num);
+		ParallelInclusiveScan(Values.data(), Scanned.data(), Num);
+		std::partial_sum(Values.begin(), Values.end(), Expected.begin());
+		assert(Scanned == Expected);
+		// in place
+		ParallelInclusiveScan(Values.data(), Values.data(), Num);
+		assert(Values == Expected);
+
+		std::shuffle(Values.begin(), Values.end(), Random);
+		std::vector<int64_t> Sorted = Values;
+		ParallelSort(Sorted.data(), Num);
+		std::sort(Values.begin(), Values.end());
+		assert(Sorted == Values);
+		ParallelSort(Sorted.data(), Num, std::greater<>());
+		assert(std::is_sorted(Sorted.begin(), Sorted.end(), std::greater<>()));
+	};
+
+	Check(100000);
+	FScheduler::Get().StartWorkers(4);
+	for (int64_t Num : { 0, 1, 2, 4095, 4096, 4097, 100000, 1000003 })
+	{
+		Check(Num);
+	}
+	FScheduler::Get().StopWorkers();
+}
+
+// every task goes through the global queue. the burst is bigger than the ring of the bounded queue, so part of it overflows
+void TestGlobalQueue(EGlobalQueueType GlobalQueueType)
+{
+	FSchedulerConfig Config;
+	Config.NumForegroundWorkers = 4;
+	Config.bUseLocalQueues = false;
+	Config.GlobalQueueType = GlobalQueueType;
+	FScheduler::Get().StartWorkers(Config);
+
+	const uint32_t NumTasks = 20000;
+	std::atomic<uint32_t> NumExecuted{ 0 };
+	std::vector<FTaskHandle> Tasks;
+	for (uint32_t Index = 0; Index < NumTasks; Index += 1)
+	{
+		Tasks.push_back(Launch("GlobalQueue", [&NumExecuted] { NumExecuted.fetch_add(1, std::memory_order_relaxed); }));
+	}
+	for (FTaskHandle& Task : Tasks)
+	{
+		Task.Wait();
+	}
+	assert(NumExecuted.load() == NumTasks);
+
+	FScheduler::Get().StopWorkers();
+}
+
+// batched tasks are queued together when the batch ends, tasks that get ready meanwhile join the batch
+void TestLaunchBatch(EGlobalQueueType GlobalQueueType)
+{
+	FSchedulerConfig Config;
+	Config.NumForegroundWorkers = 4;
+	Config.GlobalQueueType = GlobalQueueType;
+	FScheduler::Get().StartWorkers(Config);
+
+	{
+		const uint32_t NumTasks = 10000;
+		std::vector<TTask<uint32_t>> Tasks = LaunchBatch("Batch", NumTasks, [](uint32_t Index) { return Index * 2; });
+		for (uint32_t Index = 0; Index < NumTasks; Index += 1)
+		{
+			assert(Tasks[Index].GetResult() == Index * 2);
+		}
+	}
+
+	{
+		// different priorities and a dependency inside one batch
+		std::atomic<int> Value{ 0 };
+		FTaskHandle First;
+		FTaskHandle Second;
+		{
+			FLaunchBatch Batch;
+			First = Launch("First", [&Value] { Value += 1; }, ETaskPriority::High);
+			Second = Launch("Second", [&Value] { assert(Value == 1); Value += 1; }, First, ETaskPriority::BackgroundNormal);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			assert(Value == 0);
+		}
+		Second.Wait();
+		assert(Value == 2);
+	}
+
+	FScheduler::Get().StopWorkers();
+
+	{
+		// without workers the batch is executed by the thread that ends it
+		std::atomic<uint32_t> NumExecuted{ 0 };
+		std::vector<TTask<void>> Tasks = LaunchBatch("Inline", 100, [&NumExecuted](uint32_t) { NumExecuted += 1; });
+		assert(NumExecuted == 100);
+	}
+
+	{
+		// higher priorities first, launch order within a priority
+		std::vector<int> Order;
+		{
+			FLaunchBatch Batch;
+			for (int Index = 0; Index < 6; ++Index)
+			{
+				Launch("Ordered", [&Order, Index] { Order.push_back(Index); }, Index % 2 == 0 ? ETaskPriority::Normal : ETaskPriority::High);
+			}
+		}
+		assert((Order == std::vector<int>{ 1, 3, 5, 0, 2, 4 }));
+	}
+
+	{
+		// collecting doesn't allocate, the tasks are linked through their queue links
+		const uint32_t NumTasks = 1000;
+		std::vector<FTaskHandle> Tasks;
+		Tasks.reserve(NumTasks);
+		Launch("Warmup", [] {}).Wait();
+		uint64_t NumAllocations = NumThreadHeapAllocations;
+		{
+			FLaunchBatch Batch;
+			for (uint32_t Index = 0; Index < NumTasks; Index += 1)
+			{
+				Tasks.push_back(Launch("Linked", [] {}));
+			}
+		}
+		assert(NumThreadHeapAllocations - NumAllocations == 0);
+		for (FTaskHandle& Task : Tasks)
+		{
+			assert(Task.IsCompleted());
+		}
+	}
+
+	{
+		// every task gets a copy of the body, the last one takes it over
+		int NumCopiesBefore = FCounted::NumCopies;
+		FCounted Counted(3);
+		std::vector<TTask<int>> Tasks = LaunchBatch("Counted", 10, [Counted = std::move(Counted)](uint32_t Index) { return Counted.Value + int(Index); });
+		assert(Tasks[9].GetResult() == 12);
+		assert(FCounted::NumCopies - NumCopiesBefore == 9);
+	}
+}
+
+template<typename QueueType>
+void TestQueue()
+{
+	const int NUM_ITEMS_PER_PRODUCER = 1000;
+	const int NUM_PRODUCERS = 12;
+	const int NUM_CONSUMERS = 4;
+	QueueType queue;
+	std::atomic_int totalSum{ 0 };
+	std::atomic_int producedCount{ 0 };
+	std::atomic_int consumedCount{ 0 };
+
+	auto producer = [&](int id) {
+		for (int i = 0; i < NUM_ITEMS_PER_PRODUCER; i++)
+		{
+			int* value = new int(id * NUM_ITEMS_PER_PRODUCER + i);
+			queue.enqueue(value);
+			totalSum.fetch_add(*value);
+			producedCount.fetch_add(1);
+		}
+	};
+
+	auto consumer = [&]()
+	{
+		int* value;
+		while (consumedCount.load() < NUM_PRODUCERS * NUM_ITEMS_PER_PRODUCER)
+		{
+			if ((value = queue.dequeue()) != nullptr)
+			{
+				totalSum.fetch_sub(*value);
+				consumedCount.fetch_add(1);
+				delete value;
+			}
+		}
+	};
+	std::vector<std::thread> threads1;
+	std::vector<std::thread> threads2;
+	for (int i = 0; i < NUM_PRODUCERS; ++i) {
+		threads1.emplace_back(producer, i);
+	}
+	for (auto& t : threads1) {
+		t.join();
+	}
+
+	queue.debug();
+
+	for (int i = 0; i < NUM_CONSUMERS; ++i) {
+		threads2.emplace_back(consumer);
+	}
+
+	for (auto& t : threads2) {
+		t.join();
+	}
+
+	assert(producedCount.load() == NUM_PRODUCERS * NUM_ITEMS_PER_PRODUCER);
+	assert(consumedCount.load() == NUM_PRODUCERS * NUM_ITEMS_PER_PRODUCER);
+	assert(totalSum.load() == 0);
+	assert(queue.isEmpty());
+}
+
+// sustained producer/consumer traffic: dequeued nodes are reclaimed, once the queue is drained only the nodes that wait for
+// reclamation are still alive instead of one per operation
+void TestLockFreeQueueReclamation()
+{
+	const int NUM_ITEMS = 1000000;
+	const int NUM_PAIRS = 2;
+	FTaskAllocatorStats Before = FTaskAllocator::Get().GetStats();
+	{
+		FLockFreeQueue<int> Queue;
+		int Item = 0;
+		std::vector<std::thread> Threads;
+		for (int i = 0; i < NUM_PAIRS; ++i)
+		{
+			Threads.emplace_back([&] {
+				for (int n = 0; n < NUM_ITEMS; ++n)
+				{
+					Queue.enqueue(&Item);
+				}
+			});
+			Threads.emplace_back([&] {
+				for (int n = 0; n < NUM_ITEMS;)
+				{
+					if (Queue.dequeue() != nullptr)
+					{
+						n += 1;
+					}
+				}
+			});
+		}
+		for (std::thread& Thread : Threads)
+		{
+			Thread.join();
+		}
+		assert(Queue.isEmpty());
+	}
+	FTaskAllocatorStats After = FTaskAllocator::Get().GetStats();
+	assert(After.SizeClasses[0].NumBlocksInUse < Before.SizeClasses[0].NumBlocksInUse + 10000);
+}
+
+template<typename Q>
+void BenchmarkQueue(const std::string& name) {
+	const static int NUM_OPERATIONS = 10000000;
+	const static int NUM_THREADS = 4;
+	Q queue;
+	std::atomic<int> operationCount(0);
+
+	auto worker = [&]() {
+		while (true) {
+			int count = operationCount.fetch_add(1);
+			if (count >= NUM_OPERATIONS) break;
+
+			if (count % 2 == 0) {
+				int* value = new int(count);
+				queue.enqueue(value);
+			}
+			else {
+				int* value;
+				if (value = queue.dequeue()) {
+					delete value;
+				}
+			}
+		}
+		};
+
+	std::vector<std::thread> threads;
+	auto start = std::chrono::high_resolution_clock::now();
+
+	for (int i = 0; i < NUM_THREADS; ++i) {
+		threads.emplace_back(worker);
+	}
+
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	auto end = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+	std::cout << name << " took " << duration.count() << " ms" << std::endl;
+
+	// ʣڴ
+	int* remainingValue;
+	while (remainingValue = queue.dequeue()) {
+		delete remainingValue;
+	}
+}
+static void SpawnTaskTree(uint32_t Depth, std::atomic<uint32_t>& NumLeaves)
+{
+	if (Depth == 0)
+	{
+		NumLeaves.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	Launch("TreeNode", [Depth, &NumLeaves] { SpawnTaskTree(Depth - 1, NumLeaves); });
+	Launch("TreeNode", [Depth, &NumLeaves] { SpawnTaskTree(Depth - 1, NumLeaves); });
+}
+
+// fine-grained fan-out: every task spawns two children from inside a worker, so with local queues almost every launch
+// and dequeue stays off the global queue
+void BenchmarkScheduler(const std::string& name, bool bUseLocalQueues, EGlobalQueueType GlobalQueueType = EGlobalQueueType::Intrusive)
+{
+	const static uint32_t TREE_DEPTH = 18;
+	const static uint32_t NUM_TASKS = (2u << TREE_DEPTH) - 1;
+
+	for (uint32_t NumWorkers : { 1u, 2u, 4u, 8u, 16u })
+	{
+		FSchedulerConfig Config;
+		Config.NumForegroundWorkers = NumWorkers;
+		Config.bUseLocalQueues = bUseLocalQueues;
+		Config.GlobalQueueType = GlobalQueueType;
+		FScheduler::Get().StartWorkers(Config);
+
+		std::atomic<uint32_t> NumLeaves{ 0 };
+		auto start = std::chrono::high_resolution_clock::now();
+
+		SpawnTaskTree(TREE_DEPTH, NumLeaves);
+		while (NumLeaves.load(std::memory_order_relaxed) != (1u << TREE_DEPTH))
+		{
+			std::this_thread::yield();
+		}
+
+		auto end = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+		FScheduler::Get().StopWorkers();
+
+		std::cout << name << " workers: " << NumWorkers << " took " << duration.count() / 1000 << " ms, "
+			<< uint64_t(NUM_TASKS * 1000000.0 / std::max<int64_t>(duration.count(), 1)) << " tasks/s" << std::endl;
+	}
+}
+
+// cost per task of the task tree of BenchmarkScheduler and of a join: workers completing the join's prerequisites (NumLocks)
+// while the launching thread adds subsequents to it (Subsequents, RefCount) and polls it. cache misses where perf events are
+// available, compare builds with a different FTask layout or PLATFORM_CACHE_LINE_SIZE
+void BenchmarkTaskLayout()
+{
+	const static uint32_t TREE_DEPTH = 18;
+	const static uint32_t NUM_JOIN_ROUNDS = 2000;
+	const static uint32_t NUM_JOIN_EDGES = 64;
+	const static uint32_t NUM_WORKERS = 4;
+
+	std::cout << "sizeof(FTask): " << sizeof(FTaskEventBase) << ", PLATFORM_CACHE_LINE_SIZE: " << PLATFORM_CACHE_LINE_SIZE
+		<< ", cache line size: " << FCpuTopology::Get().GetCacheLineSize() << std::endl;
+
+	for (bool bJoin : { false, true })
+	{
+		// the counters have to exist before the workers start to count them
+		FPerfCounters Counters;
+		FScheduler::Get().StartWorkers(NUM_WORKERS);
+
+		uint64_t NumTasks = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		if (!bJoin)
+		{
+			std::atomic<uint32_t> NumLeaves{ 0 };
+			SpawnTaskTree(TREE_DEPTH, NumLeaves);
+			while (NumLeaves.load(std::memory_order_relaxed) != (1u << TREE_DEPTH))
+			{
+				std::this_thread::yield();
+			}
+			NumTasks = (2u << TREE_DEPTH) - 1;
+		}
+		else
+		{
+			for (uint32_t Round = 0; Round < NUM_JOIN_ROUNDS; Round += 1)
+			{
+				FTaskEvent Start{ "Start" };
+				FTaskEvent Join{ "Join" };
+				for (uint32_t Index = 0; Index < NUM_JOIN_EDGES; Index += 1)
+				{
+					Join.AddPrerequisites(Launch("Leaf", [] {}, Start));
+				}
+				Join.Trigger();
+				Start.Trigger();
+
+				std::atomic<uint32_t> NumSubsequents{ 0 };
+				for (uint32_t Index = 0; Index < NUM_JOIN_EDGES; Index += 1)
+				{
+					Launch("Subsequent", [&NumSubsequents] { NumSubsequents.fetch_add(1, std::memory_order_relaxed); }, Join);
+					Join.IsCompleted();
+				}
+				while (NumSubsequents.load(std::memory_order_relaxed) != NUM_JOIN_EDGES)
+				{
+					std::this_thread::yield();
+				}
+			}
+			NumTasks = uint64_t(NUM_JOIN_ROUNDS) * (2 * NUM_JOIN_EDGES + 3);
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		FScheduler::Get().StopWorkers();
+
+		auto PerTask = [&Counters, NumTasks](FPerfCounters::EEvent Event)
+		{
+			return Counters.IsAvailable(Event) ? std::to_string(double(Counters.Read(Event)) / double(NumTasks)) : std::string("n/a");
+		};
+		std::cout << (bJoin ? "join" : "tree") << ": " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / NumTasks
+			<< " ns, " << PerTask(FPerfCounters::EEvent::Instructions) << " instructions, " << PerTask(FPerfCounters::EEvent::CacheMisses)
+			<< " cache misses, " << PerTask(FPerfCounters::EEvent::L1DataReadMisses) << " L1D read misses per task" << std::endl;
+	}
+}
+
+// the task tree of BenchmarkScheduler with launch timing off, at its default rate and for every launch
+void BenchmarkSchedulerMetrics()
+{
+	const static uint32_t TREE_DEPTH = 18;
+	const static int NUM_RUNS = 10;
+
+	for (uint32_t SampleInterval : { 0u, 64u, 1u })
+	{
+		FSchedulerConfig Config;
+		Config.NumForegroundWorkers = 4;
+		Config.MetricsSampleInterval = SampleInterval;
+		FScheduler::Get().StartWorkers(Config);
+
+		int64_t BestUs = INT64_MAX;
+		for (int Run = 0; Run < NUM_RUNS; ++Run)
+		{
+			std::atomic<uint32_t> NumLeaves{ 0 };
+			auto start = std::chrono::high_resolution_clock::now();
+			SpawnTaskTree(TREE_DEPTH, NumLeaves);
+			while (NumLeaves.load(std::memory_order_relaxed) != (1u << TREE_DEPTH))
+			{
+				std::this_thread::yield();
+			}
+			auto end = std::chrono::high_resolution_clock::now();
+			BestUs = std::min<int64_t>(BestUs, std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+		}
+
+		FSchedulerMetrics Metrics = FScheduler::Get().GetMetrics();
+		FScheduler::Get().StopWorkers();
+		std::cout << "sample interval " << SampleInterval << ": best of " << NUM_RUNS << " " << BestUs << " us, executed "
+			<< Metrics.Total.NumExecuted << ", steals " << Metrics.Total.NumSteals << ", queue wait p50/p99 "
+			<< Metrics.QueueWaitTime.GetPercentile(50) << "/" << Metrics.QueueWaitTime.GetPercentile(99) << " ns, run time p50/p99 "
+			<< Metrics.RunTime.GetPercentile(50) << "/" << Metrics.RunTime.GetPercentile(99) << " ns" << std::endl;
+	}
+}
+
+// launches latency probes while the workers are saturated with long background tasks and reports the launch-to-start latency
+// of the probes, once with probes at the same priority as the bulk work and once with high priority probes
+void BenchmarkPriorityLatency()
+{
+	const static uint32_t NUM_WORKERS = 4;
+	const static uint32_t NUM_BULK_TASKS = 20000;
+	const static uint32_t NUM_PROBES = 500;
+	const static auto BULK_TASK_DURATION = std::chrono::microseconds(50);
+	const static auto PROBE_INTERVAL = std::chrono::microseconds(200);
+
+	for (ETaskPriority ProbePriority : { ETaskPriority::BackgroundLow, ETaskPriority::High })
+	{
+		FScheduler::Get().StartWorkers(NUM_WORKERS);
+
+		std::atomic<bool> bStopBulk{ false };
+		for (uint32_t Index = 0; Index < NUM_BULK_TASKS; Index += 1)
+		{
+			Launch("Bulk", [&bStopBulk] {
+				auto End = std::chrono::steady_clock::now() + BULK_TASK_DURATION;
+				while (!bStopBulk.load(std::memory_order_relaxed) && std::chrono::steady_clock::now() < End)
+				{
+				}
+			}, ETaskPriority::BackgroundLow);
+		}
+
+		std::vector<int64_t> Latencies(NUM_PROBES);
+		std::atomic<uint32_t> NumProbesDone{ 0 };
+		for (uint32_t Index = 0; Index < NUM_PROBES; Index += 1)
+		{
+			Launch("Probe", [&Latencies, &NumProbesDone, Index, LaunchTime = std::chrono::steady_clock::now()] {
+				Latencies[Index] = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - LaunchTime).count();
+				NumProbesDone.fetch_add(1, std::memory_order_release);
+			}, ProbePriority);
+			std::this_thread::sleep_for(PROBE_INTERVAL);
+		}
+		while (NumProbesDone.load(std::memory_order_acquire) != NUM_PROBES)
+		{
+			std::this_thread::yield();
+		}
+
+		bStopBulk = true;
+		FScheduler::Get().StopWorkers();
+
+		std::sort(Latencies.begin(), Latencies.end());
+		std::cout << "probe priority " << int(ProbePriority) << ": p50 " << Latencies[NUM_PROBES / 2] << " us, p99 "
+			<< Latencies[NUM_PROBES * 99 / 100] << " us" << std::endl;
+	}
+}
+
+// latency from the end of a task body to the return of a parked Wait, and the cpu time the waiting thread spends per wait
+void BenchmarkWaitLatency()
+{
+	const int NUM_WAITS = 200;
+	FScheduler::Get().StartWorkers(2);
+
+	std::vector<int64_t> Latencies;
+	std::chrono::nanoseconds CpuTime{ 0 };
+	for (int i = 0; i < NUM_WAITS; ++i)
+	{
+		std::atomic<int64_t> BodyEndNs{ 0 };
+		FTaskHandle Task = Launch("Sleep", [&BodyEndNs] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			BodyEndNs = std::chrono::steady_clock::now().time_since_epoch().count();
+		});
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+		std::chrono::nanoseconds CpuTimeBefore = FPlatformThread::GetCurrentThreadCpuTime();
+		Task.Wait();
+		int64_t ReturnNs = std::chrono::steady_clock::now().time_since_epoch().count();
+		CpuTime += FPlatformThread::GetCurrentThreadCpuTime() - CpuTimeBefore;
+		Latencies.push_back(ReturnNs - BodyEndNs.load());
+	}
+	FScheduler::Get().StopWorkers();
+
+	std::sort(Latencies.begin(), Latencies.end());
+	std::cout << "wait latency: median " << Latencies[NUM_WAITS / 2] / 1000.0 << " us, p99 " << Latencies[NUM_WAITS * 99 / 100] / 1000.0
+		<< " us, waiter cpu " << CpuTime.count() / NUM_WAITS / 1000.0 << " us per 2ms wait" << std::endl;
+}
+
+static void ForkJoin(uint32_t Depth)
+{
+	if (Depth == 0)
+	{
+		volatile uint32_t Sink = 0;
+		for (uint32_t i = 0; i < 1000; ++i)
+		{
+			Sink = Sink + i;
+		}
+		return;
+	}
+	FTaskHandle Left = Launch("Left", [Depth] { ForkJoin(Depth - 1); });
+	FTaskHandle Right = Launch("Right", [Depth] { ForkJoin(Depth - 1); });
+	AddNested(Left);
+	AddNested(Right);
+	Left.Wait();
+	Right.Wait();
+}
+
+// recursive fork-join with blocking waits. children that got stolen leave their parent waiting, with helping the parent's worker
+// executes the stolen children's nested tasks meanwhile
+void BenchmarkHelpWhileWaiting()
+{
+	const static uint32_t TREE_DEPTH = 14;
+	for (EWaitHelpPolicy Policy : { EWaitHelpPolicy::None, EWaitHelpPolicy::EqualOrHigherPriority, EWaitHelpPolicy::AnyPriority })
+	{
+		for (uint32_t NumWorkers : { 2u, 4u, 8u })
+		{
+			FSchedulerConfig Config;
+			Config.NumForegroundWorkers = NumWorkers;
+			Config.WaitHelpPolicy = Policy;
+			FScheduler::Get().StartWorkers(Config);
+
+			auto Start = std::chrono::high_resolution_clock::now();
+			Launch("Root", [] { ForkJoin(TREE_DEPTH); }).Wait();
+			auto End = std::chrono::high_resolution_clock::now();
+			FScheduler::Get().StopWorkers();
+
+			std::cout << "help policy " << int(Policy) << " workers " << NumWorkers << ": "
+				<< std::chrono::duration_cast<std::chrono::microseconds>(End - Start).count() / 1000.0 << " ms" << std::endl;
+		}
+	}
+}
+
+// linear chains of tasks, each unlocked by the previous one. with continuations the chain runs back-to-back on one worker,
+// without them every link is a round trip through the queues
+void BenchmarkContinuations()
+{
+	for (bool bUseContinuations : { false, true })
+	{
+		FSchedulerConfig Config;
+		Config.NumForegroundWorkers = 4;
+		Config.bUseContinuations = bUseContinuations;
+		FScheduler::Get().StartWorkers(Config);
+
+		for (int ChainLength : { 1, 10, 100, 1000, 10000, 100000, 1000000 })
+		{
+			// the chain is built behind an event so it doesn't start running while it's built
+			FTaskEvent Event{ "Event" };
+			FTaskHandle Prev = Event;
+			int64_t Sum = 0;
+			for (int i = 0; i < ChainLength; ++i)
+			{
+				Prev = Launch("Chain", [&Sum, i] { Sum += i; }, Prev);
+			}
+
+			auto Start = std::chrono::high_resolution_clock::now();
+			Event.Trigger();
+			// polls instead of waiting on the chain, Wait would retract it to this thread
+			while (!Prev.IsCompleted())
+			{
+				std::this_thread::yield();
+			}
+			auto End = std::chrono::high_resolution_clock::now();
+			assert(Sum == int64_t(ChainLength) * (ChainLength - 1) / 2);
+
+			std::cout << (bUseContinuations ? "continuations" : "scheduled") << ", chain of " << ChainLength << ": "
+				<< std::chrono::duration_cast<std::chrono::nanoseconds>(End - Start).count() / ChainLength << " ns per task" << std::endl;
+		}
+
+		FScheduler::Get().StopWorkers();
+	}
+}
+
+// fan-out of many small tasks from one producer outside of the pool: launched one by one each task is a queue operation and a
+// wake-up attempt, LaunchBatch queues all of them with one operation and wakes the workers at once
+void BenchmarkLaunchBatch()
+{
+	const uint32_t NUM_TASKS = 10000;
+	const int NUM_RUNS = 20;
+	for (EGlobalQueueType GlobalQueueType : { EGlobalQueueType::Intrusive, EGlobalQueueType::Locked, EGlobalQueueType::Bounded })
+	{
+		FSchedulerConfig Config;
+		Config.NumForegroundWorkers = 4;
+		Config.GlobalQueueType = GlobalQueueType;
+		FScheduler::Get().StartWorkers(Config);
+
+		for (bool bBatched : { false, true })
+		{
+			int64_t LaunchNs = 0;
+			int64_t TotalNs = 0;
+			for (int Run = 0; Run < NUM_RUNS; ++Run)
+			{
+				std::atomic<uint32_t> NumExecuted{ 0 };
+				auto Body = [&NumExecuted](uint32_t) { NumExecuted.fetch_add(1, std::memory_order_relaxed); };
+
+				auto Start = std::chrono::high_resolution_clock::now();
+				std::vector<TTask<void>> Tasks;
+				if (bBatched)
+				{
+					Tasks = LaunchBatch("Batched", NUM_TASKS, Body);
+				}
+				else
+				{
+					Tasks.reserve(NUM_TASKS);
+					for (uint32_t Index = 0; Index < NUM_TASKS; ++Index)
+					{
+						Tasks.push_back(Launch("Single", [Body, Index]() mutable { Body(Index); }));
+					}
+				}
+				auto Launched = std::chrono::high_resolution_clock::now();
+				// polls instead of waiting on the tasks, Wait would retract them to this thread
+				while (NumExecuted.load(std::memory_order_relaxed) != NUM_TASKS)
+				{
+					std::this_thread::yield();
+				}
+				auto End = std::chrono::high_resolution_clock::now();
+
+				LaunchNs += std::chrono::duration_cast<std::chrono::nanoseconds>(Launched - Start).count();
+				TotalNs += std::chrono::duration_cast<std::chrono::nanoseconds>(End - Start).count();
+			}
+
+			std::cout << "global queue " << int(GlobalQueueType) << (bBatched ? ", LaunchBatch: " : ", Launch: ") << LaunchNs / NUM_RUNS / 1000
+				<< " us to launch, " << TotalNs / NUM_RUNS / 1000 << " us until all executed (" << NUM_TASKS << " tasks)" << std::endl;
+		}
+
+		FScheduler::Get().StopWorkers();
+	}
+}
+
+// shedding queued work: a fan-out of tasks with a few microseconds of work each is queued behind an event, then either runs or
+// is canceled before the event is triggered. "no token" vs "token" is what attaching a token costs a task that isn't canceled
+void BenchmarkCancellation()
+{
+	const int NUM_TASKS = 20000;
+	const int NUM_RUNS = 10;
+	FSchedulerConfig Config;
+	Config.NumForegroundWorkers = 4;
+	FScheduler::Get().StartWorkers(Config);
+
+	for (int WorkNs : { 0, 5000 })
+	{
+		for (const char* Mode : { "no token", "token", "canceled" })
+		{
+			int64_t TotalNs = 0;
+			for (int Run = 0; Run < NUM_RUNS; ++Run)
+			{
+				FCancellationToken Token;
+				FTaskEvent Event{ "Event" };
+				// completes when all tasks did, canceled or not
+				FTaskEvent AllDone{ "AllDone" };
+				auto Body = [WorkNs] {
+					auto Until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(WorkNs);
+					while (std::chrono::steady_clock::now() < Until)
+					{
+					}
+				};
+				for (int i = 0; i < NUM_TASKS; ++i)
+				{
+					AllDone.AddPrerequisites(Mode[0] == 'n' ? Launch("Work", Body, Event) : Launch("Work", Body, Event, Token));
+				}
+				AllDone.Trigger();
+				if (Mode[0] == 'c')
+				{
+					Token.Cancel();
+				}
+
+				auto Start = std::chrono::high_resolution_clock::now();
+				Event.Trigger();
+				// polls instead of waiting on the tasks, Wait would retract them to this thread
+				while (!AllDone.IsCompleted())
+				{
+					std::this_thread::yield();
+				}
+				auto End = std::chrono::high_resolution_clock::now();
+				TotalNs += std::chrono::duration_cast<std::chrono::nanoseconds>(End - Start).count();
+			}
+
+			std::cout << WorkNs << " ns of work, " << Mode << ": " << TotalNs / NUM_RUNS / NUM_TASKS << " ns per task" << std::endl;
+		}
+	}
+
+	FScheduler::Get().StopWorkers();
+}
+
+// per-edge cost of the dependency bookkeeping: adding an edge (AddPrerequisite + AddSubsequent) and completing it (Close of the
+// prerequisite unlocking the subsequent). task events never reach the scheduler and are created outside of the timed sections,
+// so this measures the task graph alone. fan-in: K prerequisites feed one joiner, fan-out: one prerequisite feeds K subsequents
+void BenchmarkTaskEdges()
+{
+	const static uint32_t NUM_EDGES_PER_BATCH = 1 << 16;
+	const static uint32_t NUM_BATCHES = 16;
+
+	std::cout << "sizeof(FTask): " << sizeof(FTaskEventBase) << std::endl;
+	for (bool bFanIn : { true, false })
+	{
+		for (uint32_t NumEdgesPerTask : { 1u, 2u, 4u, 8u, 64u })
+		{
+			std::chrono::nanoseconds AddTime{ 0 };
+			std::chrono::nanoseconds CompleteTime{ 0 };
+			for (uint32_t Batch = 0; Batch < NUM_BATCHES; Batch += 1)
+			{
+				uint32_t NumHubs = NUM_EDGES_PER_BATCH / NumEdgesPerTask;
+				std::vector<FTaskEvent> Hubs;
+				std::vector<FTaskEvent> Leaves;
+				Hubs.reserve(NumHubs);
+				Leaves.reserve(NUM_EDGES_PER_BATCH);
+				for (uint32_t Index = 0; Index < NumHubs; Index += 1)
+				{
+					Hubs.emplace_back("Hub");
+				}
+				for (uint32_t Index = 0; Index < NUM_EDGES_PER_BATCH; Index += 1)
+				{
+					Leaves.emplace_back("Leaf");
+				}
+
+				auto start = std::chrono::high_resolution_clock::now();
+				for (uint32_t Index = 0; Index < NUM_EDGES_PER_BATCH; Index += 1)
+				{
+					FTaskEvent& Hub = Hubs[Index / NumEdgesPerTask];
+					if (bFanIn)
+					{
+						Hub.AddPrerequisites(Leaves[Index]);
+					}
+					else
+					{
+						Leaves[Index].AddPrerequisites(Hub);
+					}
+				}
+				auto mid = std::chrono::high_resolution_clock::now();
+
+				// the dependent side is triggered first so completing the other side unlocks it
+				std::vector<FTaskEvent>& Dependents = bFanIn ? Hubs : Leaves;
+				std::vector<FTaskEvent>& Dependencies = bFanIn ? Leaves : Hubs;
+				for (FTaskEvent& Event : Dependents)
+				{
+					Event.Trigger();
+				}
+				auto mid2 = std::chrono::high_resolution_clock::now();
+				for (FTaskEvent& Event : Dependencies)
+				{
+					Event.Trigger();
+				}
+				auto end = std::chrono::high_resolution_clock::now();
+				assert(Dependents.back().IsCompleted());
+
+				AddTime += mid - start;
+				CompleteTime += end - mid2;
+			}
+
+			std::cout << (bFanIn ? "fan-in " : "fan-out ") << NumEdgesPerTask << ": add "
+				<< AddTime.count() / (NUM_BATCHES * NUM_EDGES_PER_BATCH) << " ns/edge, complete "
+				<< CompleteTime.count() / (NUM_BATCHES * NUM_EDGES_PER_BATCH) << " ns/edge" << std::endl;
+		}
+	}
+}
+
+// task-sized allocations through FTaskAllocator vs the system allocator, on one thread and with frees on another thread
+void BenchmarkTaskAllocator()
+{
+	const static uint32_t NUM_BLOCKS = 1 << 16;
+	const static uint32_t NUM_ROUNDS = 64;
+	const static size_t BLOCK_SIZE = 200;
+
+	auto Run = [](const char* Name, auto&& Allocate, auto&& Free)
+	{
+		std::vector<void*> Blocks(NUM_BLOCKS);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (uint32_t Round = 0; Round < NUM_ROUNDS; Round += 1)
+		{
+			for (void*& Block : Blocks)
+			{
+				Block = Allocate();
+			}
+			for (void* Block : Blocks)
+			{
+				Free(Block);
+			}
+		}
+		auto mid = std::chrono::high_resolution_clock::now();
+
+		for (uint32_t Round = 0; Round < NUM_ROUNDS; Round += 1)
+		{
+			for (void*& Block : Blocks)
+			{
+				Block = Allocate();
+			}
+			std::thread([&Blocks, &Free] {
+				for (void* Block : Blocks)
+				{
+					Free(Block);
+				}
+			}).join();
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+
+		std::cout << Name << ": same thread " << std::chrono::duration_cast<std::chrono::nanoseconds>(mid - start).count() / (NUM_ROUNDS * NUM_BLOCKS)
+			<< " ns, cross thread " << std::chrono::duration_cast<std::chrono::nanoseconds>(end - mid).count() / (NUM_ROUNDS * NUM_BLOCKS)
+			<< " ns per allocation" << std::endl;
+	};
+
+	Run("system", [] { return ::operator new(BLOCK_SIZE); }, [](void* Ptr) { ::operator delete(Ptr); });
+	Run("FTaskAllocator", [] { return FTaskAllocator::Get().Allocate(BLOCK_SIZE); }, [](void* Ptr) { FTaskAllocator::Get().Free(Ptr, BLOCK_SIZE); });
+
+	FTaskAllocatorStats Stats = FTaskAllocator::Get().GetStats();
+	for (const FTaskAllocatorStats::FSizeClass& SizeClass : Stats.SizeClasses)
+	{
+		if (SizeClass.NumSlabs != 0)
+		{
+			std::cout << "block size " << SizeClass.BlockSize << ": " << SizeClass.NumSlabs << " slabs, " << SizeClass.NumBlocksInUse << "/"
+				<< SizeClass.NumBlocks << " blocks in use" << std::endl;
+		}
+	}
+	std::cout << Stats.NumFallbackAllocations << " of " << Stats.NumAllocations << " allocations fell back to the system allocator" << std::endl;
+}
+
+// ParallelFor vs one task per MinBatchSize chunk (launched up front and waited on one by one), on a memory-bound kernel
+// (a = b + c over a buffer much larger than the caches) and a compute-bound one
+void BenchmarkParallelFor()
+{
+	const static int32_t NUM_STREAM_ELEMENTS = 1 << 24;
+	const static int32_t NUM_COMPUTE_ELEMENTS = 1 << 16;
+	const static int32_t MIN_BATCH_SIZE = 1024;
+
+	std::vector<float> A(NUM_STREAM_ELEMENTS), B(NUM_STREAM_ELEMENTS, 1.0f), C(NUM_STREAM_ELEMENTS, 2.0f);
+	std::vector<float> Out(NUM_COMPUTE_ELEMENTS);
+	auto Stream = [&A, &B, &C](int32_t Index) { A[Index] = B[Index] + C[Index]; };
+	auto Compute = [&Out](int32_t Index) {
+		float Value = float(Index);
+		for (int i = 0; i < 200; ++i)
+		{
+			Value = std::sqrt(Value * 1.0001f + 1.0f);
+		}
+		Out[Index] = Value;
+	};
+
+	auto OneTaskPerChunk = [](int32_t Num, auto& Body, int32_t BatchSize)
+	{
+		std::vector<FTaskHandle> Tasks;
+		for (int32_t Begin = 0; Begin < Num; Begin += BatchSize)
+		{
+			Tasks.push_back(Launch("Chunk", [&Body, Begin, Num, BatchSize] {
+				for (int32_t Index = Begin; Index < std::min(Begin + BatchSize, Num); Index += 1)
+				{
+					Body(Index);
+				}
+			}));
+		}
+		for (FTaskHandle& Task : Tasks)
+		{
+			Task.Wait();
+		}
+	};
+
+	auto Measure = [](auto&& Func)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < 8; ++i)
+		{
+			Func();
+		}
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() / 8;
+	};
+
+	for (uint32_t NumWorkers : { 1u, 2u, 4u, 8u })
+	{
+		FScheduler::Get().StartWorkers(NumWorkers);
+		int64_t StreamParallelFor = Measure([&] { ParallelFor(NUM_STREAM_ELEMENTS, Stream, MIN_BATCH_SIZE); });
+		int64_t StreamChunks = Measure([&] { OneTaskPerChunk(NUM_STREAM_ELEMENTS, Stream, MIN_BATCH_SIZE); });
+		int64_t ComputeParallelFor = Measure([&] { ParallelFor(NUM_COMPUTE_ELEMENTS, Compute, MIN_BATCH_SIZE / 16); });
+		int64_t ComputeChunks = Measure([&] { OneTaskPerChunk(NUM_COMPUTE_ELEMENTS, Compute, MIN_BATCH_SIZE / 16); });
+		FScheduler::Get().StopWorkers();
+
+		std::cout << "workers: " << NumWorkers << " memory-bound: ParallelFor " << StreamParallelFor << " us, per chunk " << StreamChunks
+			<< " us; compute-bound: ParallelFor " << ComputeParallelFor << " us, per chunk " << ComputeChunks << " us" << std::endl;
+	}
+}
+
+// ParallelReduce (float sum), ParallelInclusiveScan (float prefix sum) and ParallelSort (uint32_t keys) vs their std counterparts
+// over input sizes from 1K to 100M elements. the 100M runs need about 1.2 GB
+void BenchmarkParallelAlgorithms()
+{
+	const static int64_t MAX_NUM = 100'000'000;
+
+	std::mt19937 Random(42);
+	std::vector<float> Values(MAX_NUM);
+	std::vector<float> Scanned(MAX_NUM);
+	std::vector<uint32_t> Keys(MAX_NUM);
+	for (int64_t Index = 0; Index < MAX_NUM; Index += 1)
+	{
+		Values[Index] = float(Random() % 100) / 100.0f;
+		Keys[Index] = Random();
+	}
+	std::vector<uint32_t> ToSort(MAX_NUM);
+	// reductions are summed up and printed so the compiler can't drop them
+	double ReduceSink = 0.0;
+
+	auto Measure = [](int64_t Num, auto&& Func)
+	{
+		// repeat small inputs so every measurement covers at least ~100M elements
+		int64_t NumRepeats = std::max<int64_t>(MAX_NUM / Num / 10, 1);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int64_t Repeat = 0; Repeat < NumRepeats; Repeat += 1)
+		{
+			Func();
+		}
+		return double(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count()) / NumRepeats / 1000.0;
+	};
+
+	for (int64_t Num = 1000; Num <= MAX_NUM; Num *= 10)
+	{
+		double StdReduce = Measure(Num, [&] { ReduceSink += std::accumulate(Values.begin(), Values.begin() + Num, 0.0f); });
+		double StdScan = Measure(Num, [&] { std::partial_sum(Values.begin(), Values.begin() + Num, Scanned.begin()); });
+		double StdSort = Measure(Num, [&] { std::copy(Keys.begin(), Keys.begin() + Num, ToSort.begin()); std::sort(ToSort.begin(), ToSort.begin() + Num); });
+		std::cout << "N=" << Num << " std: reduce " << StdReduce << " us, scan " << StdScan << " us, sort " << StdSort << " us" << std::endl;
+
+		for (uint32_t NumWorkers : { 1u, 2u, 4u, 8u })
+		{
+			FScheduler::Get().StartWorkers(NumWorkers);
+			double Reduce = Measure(Num, [&] { ReduceSink += ParallelReduce(Values.data(), Num, 0.0f); });
+			double Scan = Measure(Num, [&] { ParallelInclusiveScan(Values.data(), Scanned.data(), Num); });
+			double Sort = Measure(Num, [&] { std::copy(Keys.begin(), Keys.begin() + Num, ToSort.begin()); ParallelSort(ToSort.data(), Num); });
+			FScheduler::Get().StopWorkers();
+			std::cout << "N=" << Num << " workers " << NumWorkers << ": reduce " << Reduce << " us, scan " << Scan << " us, sort " << Sort << " us" << std::endl;
+		}
+	}
+	std::cout << "(sum of all reductions: " << ReduceSink << ")" << std::endl;
+}
+
+int main()
+{
+	FScheduler::Get().StartWorkers(2);// std::thread::hardware_concurrency());
+
+	TestWorkerWakeUp();
+	TestBlockingWait();
+	
+	//TestQueue<FOverflowQueue<int>>();
+	TestQueue<FLockFreeQueue<int>>();
+	TestQueue<FBoundedQueue<int>>();
+	TestLockFreeQueueReclamation();
+	//BenchmarkQueue<FOverflowQueue<int>>("OverflowQueue");
+	//BenchmarkQueue<FLockFreeQueue<int>>("LockFreeQueue");
+	//BenchmarkQueue<FBoundedQueue<int>>("BoundedQueue");
+
+	FScheduler::Get().StopWorkers();
+
+	TestRetraction();
+	TestContinuations();
+	TestTrace();
+	TestTaskGraphAnalysis();
+	TestBackgroundWorkers();
+	TestAffinity();
+	TestDynamicWorkers();
+	TestTaskList();
+	TestHelpWhileWaiting();
+	TestSchedulerMetrics();
+	TestTaskAllocator();
+	TestTaskDelegate();
+	TestTaskResult();
+	TestCancellation();
+	TestParallelFor();
+	TestParallelAlgorithms();
+	TestGlobalQueue(EGlobalQueueType::Intrusive);
+	TestGlobalQueue(EGlobalQueueType::Locked);
+	TestGlobalQueue(EGlobalQueueType::Bounded);
+	TestLaunchBatch(EGlobalQueueType::Intrusive);
+	TestLaunchBatch(EGlobalQueueType::Locked);
+	TestLaunchBatch(EGlobalQueueType::Bounded);
+
+	//BenchmarkScheduler("GlobalQueue", false);
+	//BenchmarkScheduler("WorkStealing", true);
+	//BenchmarkScheduler("LockedGlobalQueue", false, EGlobalQueueType::Locked);
+	//BenchmarkScheduler("BoundedGlobalQueue", false, EGlobalQueueType::Bounded);
+	//BenchmarkSchedulerMetrics();
+	//BenchmarkTaskLayout();
+	//BenchmarkPriorityLatency();
+	//BenchmarkWaitLatency();
+	//BenchmarkHelpWhileWaiting();
+	//BenchmarkContinuations();
+	//BenchmarkLaunchBatch();
+	//BenchmarkCancellation();
+	//BenchmarkTaskEdges();
+	//BenchmarkTaskAllocator();
+	//BenchmarkParallelFor();
+	//BenchmarkParallelAlgorithms();
 }
\ No newline at end of file
@@ -0,0 +1,200 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "ParallelFor.h"
+
+namespace ParallelAlgorithms_Impl
+{
+	// inputs are processed in chunks that fit into the L1 data cache
+	constexpr int64_t ChunkSizeBytes = 32 * 1024;
+	// sorted runs are sized for L2, merges are split into output blocks of the same size
+	constexpr int64_t SortRunSizeBytes = 256 * 1024;
+
+	template<typename T>
+	constexpr int64_t GetChunkSize()
+	{
+		return std::max<int64_t>(ChunkSizeBytes / int64_t(sizeof(T)), 1);
+	}
+
+	inline int32_t GetNumChunks(int64_t Num, int64_t ChunkSize)
+	{
+		return int32_t((Num + ChunkSize - 1) / ChunkSize);
+	}
+
+	// several independent accumulators break the dependency chain so the compiler can keep them in one vector register
+	template<typename T, typename OpType>
+	T ReduceChunk(const T* Data, int64_t Num, const T& Identity, OpType& Op)
+	{
+		constexpr int32_t NumLanes = std::is_arithmetic_v<T> ? 8 : 1;
+		T Lanes[NumLanes];
+		for (int32_t Lane = 0; Lane < NumLanes; Lane += 1)
+		{
+			Lanes[Lane] = Identity;
+		}
+
+		int64_t Index = 0;
+		for (; Index + NumLanes <= Num; Index += NumLanes)
+		{
+			for (int32_t Lane = 0; Lane < NumLanes; Lane += 1)
+			{
+				Lanes[Lane] = Op(Lanes[Lane], Data[Index + Lane]);
+			}
+		}
+
+		T Result = Lanes[0];
+		for (int32_t Lane = 1; Lane < NumLanes; Lane += 1)
+		{
+			Result = Op(Result, Lanes[Lane]);
+		}
+		for (; Index < Num; Index += 1)
+		{
+			Result = Op(Result, Data[Index]);
+		}
+		return Result;
+	}
+
+	// number of elements taken from A when the first K elements of the stable merge of A and B are produced
+	template<typename T, typename CompareType>
+	int64_t MergeCoRank(int64_t K, const T* A, int64_t NumA, const T* B, int64_t NumB, CompareType& Compare)
+	{
+		int64_t Low = std::max<int64_t>(0, K - NumB);
+		int64_t High = std::min(K, NumA);
+		while (Low < High)
+		{
+			int64_t IndexA = Low + (High - Low) / 2;
+			int64_t IndexB = K - IndexA;
+			// A[IndexA] doesn't go after B[IndexB - 1] (ties take A first), so more elements of A belong to the prefix
+			if (IndexB > 0 && IndexA < NumA && !Compare(B[IndexB - 1], A[IndexA]))
+			{
+				Low = IndexA + 1;
+			}
+			else
+			{
+				High = IndexA;
+			}
+		}
+		return Low;
+	}
+}
+
+// combines all elements with Op, which must be associative and commutative (elements are combined in a different order than
+// a sequential loop would, so floating point sums can differ slightly from it). the result doesn't depend on the number of workers
+template<typename T, typename OpType = std::plus<>>
+T ParallelReduce(const T* Data, int64_t Num, T Identity, OpType Op = OpType())
+{
+	using namespace ParallelAlgorithms_Impl;
+	const int64_t ChunkSize = GetChunkSize<T>();
+	int32_t NumChunks = GetNumChunks(Num, ChunkSize);
+
+	std::vector<T> Partials(NumChunks, Identity);
+	ParallelFor(NumChunks, [Data, Num, ChunkSize, &Identity, &Op, &Partials](int32_t Chunk) {
+		int64_t Begin = Chunk * ChunkSize;
+		Partials[Chunk] = ReduceChunk(Data + Begin, std::min(ChunkSize, Num - Begin), Identity, Op);
+	});
+
+	return ReduceChunk(Partials.data(), NumChunks, Identity, Op);
+}
+
+// Out[i] = In[0] Op In[1] Op ... Op In[i]. Op must be associative. In and Out may be the same array.
+// the chunks are reduced in parallel, the chunk totals are scanned sequentially and then every chunk is scanned starting from
+// the total of the chunks before it
+template<typename T, typename OpType = std::plus<>>
+void ParallelInclusiveScan(const T* In, T* Out, int64_t Num, OpType Op = OpType())
+{
+	using namespace ParallelAlgorithms_Impl;
+	const int64_t ChunkSize = GetChunkSize<T>();
+	int32_t NumChunks = GetNumChunks(Num, ChunkSize);
+	if (NumChunks == 0)
+	{
+		return;
+	}
+
+	std::vector<T> Totals(NumChunks);
+	ParallelFor(NumChunks - 1, [In, ChunkSize, &Op, &Totals](int32_t Chunk) {
+		// the order of the elements has to be kept, so a single accumulator
+		const T* Data = In + Chunk * ChunkSize;
+		T Total = Data[0];
+		for (int64_t Index = 1; Index < ChunkSize; Index += 1)
+		{
+			Total = Op(Total, Data[Index]);
+		}
+		Totals[Chunk] = Total;
+	});
+
+	for (int32_t Chunk = 1; Chunk < NumChunks - 1; Chunk += 1)
+	{
+		Totals[Chunk] = Op(Totals[Chunk - 1], Totals[Chunk]);
+	}
+
+	ParallelFor(NumChunks, [In, Out, Num, ChunkSize, &Op, &Totals](int32_t Chunk) {
+		int64_t Begin = Chunk * ChunkSize;
+		int64_t End = std::min(Begin + ChunkSize, Num);
+		T Running = Chunk == 0 ? In[Begin] : Op(Totals[Chunk - 1], In[Begin]);
+		Out[Begin] = Running;
+		for (int64_t Index = Begin + 1; Index < End; Index += 1)
+		{
+			Running = Op(Running, In[Index]);
+			Out[Index] = Running;
+		}
+	});
+}
+
+// sorts L2-sized runs in parallel, then merges pairs of runs level by level. every merge is split into independent output blocks
+// (the split points are found by binary search) so all workers take part even in the last levels. needs a temporary buffer of Num
+// elements, T must be default constructible and movable. not stable
+template<typename T, typename CompareType = std::less<>>
+void ParallelSort(T* Data, int64_t Num, CompareType Compare = CompareType())
+{
+	using namespace ParallelAlgorithms_Impl;
+	const int64_t RunSize = std::max<int64_t>(SortRunSizeBytes / int64_t(sizeof(T)), 1);
+	if (Num <= RunSize || FScheduler::Get().GetNumActiveWorkers() == 0)
+	{
+		std::sort(Data, Data + Num, Compare);
+		return;
+	}
+
+	int32_t NumBlocks = GetNumChunks(Num, RunSize);
+	ParallelFor(NumBlocks, [Data, Num, RunSize, &Compare](int32_t Run) {
+		int64_t Begin = Run * RunSize;
+		std::sort(Data + Begin, Data + std::min(Begin + RunSize, Num), Compare);
+	});
+
+	std::unique_ptr<T[]> Buffer(new T[Num]);
+	T* Src = Data;
+	T* Dst = Buffer.get();
+	for (int64_t Width = RunSize; Width < Num; Width *= 2)
+	{
+		// Width is RunSize times a power of two, so output blocks of RunSize never straddle two pairs of runs
+		ParallelFor(NumBlocks, [Src, Dst, Num, RunSize, Width, &Compare](int32_t Block) {
+			int64_t OutBegin = Block * RunSize;
+			int64_t OutEnd = std::min(OutBegin + RunSize, Num);
+			int64_t PairBegin = OutBegin / (2 * Width) * (2 * Width);
+
+			T* A = Src + PairBegin;
+			int64_t NumA = std::min(Width, Num - PairBegin);
+			T* B = A + NumA;
+			int64_t NumB = std::min(Width, Num - PairBegin - NumA);
+
+			int64_t BeginA = MergeCoRank(OutBegin - PairBegin, A, NumA, B, NumB, Compare);
+			int64_t EndA = MergeCoRank(OutEnd - PairBegin, A, NumA, B, NumB, Compare);
+			int64_t BeginB = OutBegin - PairBegin - BeginA;
+			int64_t EndB = OutEnd - PairBegin - EndA;
+			std::merge(std::make_move_iterator(A + BeginA), std::make_move_iterator(A + EndA),
+				std::make_move_iterator(B + BeginB), std::make_move_iterator(B + EndB), Dst + OutBegin, Compare);
+		});
+		std::swap(Src, Dst);
+	}
+
+	if (Src != Data)
+	{
+		ParallelFor(NumBlocks, [Src, Data, Num, RunSize](int32_t Block) {
+			int64_t Begin = Block * RunSize;
+			std::move(Src + Begin, Src + std::min(Begin + RunSize, Num), Data + Begin);
+		});
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <algorithm>
+#include "TaskSystem.h"
+#include "Scheduler.h"
+
+namespace ParallelFor_Impl
+{
+	// runs Body over [Begin, End) in batches of MinBatchSize. before every batch the remaining range is split in half if the calling
+	// thread has nothing queued (i.e. thieves took everything it offered), the upper half becomes a nested task of the current
+	// one. this way the range is only split as far as there are idle workers to take the pieces (lazy binary splitting)
+	template<typename BodyType>
+	void ExecuteRange(BodyType& Body, int32_t Begin, int32_t End, int32_t MinBatchSize, ETaskPriority Priority)
+	{
+		while (End - Begin > MinBatchSize)
+		{
+			if (End - Begin >= 2 * MinBatchSize && !FScheduler::Get().HasQueuedWork(Priority))
+			{
+				int32_t Middle = Begin + (End - Begin) / 2;
+				AddNested(Launch("ParallelFor", [&Body, Middle, End, MinBatchSize, Priority] {
+					ExecuteRange(Body, Middle, End, MinBatchSize, Priority);
+				}, Priority));
+				End = Middle;
+				continue;
+			}
+
+			for (int32_t BatchEnd = Begin + MinBatchSize; Begin != BatchEnd; Begin += 1)
+			{
+				Body(Begin);
+			}
+		}
+
+		for (; Begin != End; Begin += 1)
+		{
+			Body(Begin);
+		}
+	}
+}
+
+// calls Body(Index) for every Index in [0, Num) on the workers and returns when all calls are done. the calling thread takes part:
+// waiting on the root task retracts it and whatever pieces of the range nobody stole yet. MinBatchSize is the smallest range that
+// is still split, choose it so a batch takes at least a few microseconds
+template<typename BodyType>
+void ParallelFor(int32_t Num, BodyType&& Body, int32_t MinBatchSize = 1, ETaskPriority Priority = ETaskPriority::Default)
+{
+	MinBatchSize = std::max(MinBatchSize, 1);
+	if (Num <= MinBatchSize || FScheduler::Get().GetNumActiveWorkers() == 0)
+	{
+		for (int32_t Index = 0; Index < Num; Index += 1)
+		{
+			Body(Index);
+		}
+		return;
+	}
+
+	// Body outlives all the tasks, they capture it by reference
+	FTaskHandle Root = Launch("ParallelFor", [&Body, Num, MinBatchSize, Priority] {
+		ParallelFor_Impl::ExecuteRange(Body, 0, Num, MinBatchSize, Priority);
+	}, Priority);
+	Root.Wait();
+}
@@ -0,0 +1,68 @@
+#include "PerfCounters.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+FPerfCounters::FPerfCounters()
+{
+	for (int& Fd : Fds)
+	{
+		Fd = -1;
+	}
+#if defined(__linux__)
+	for (int Event = 0; Event < int(EEvent::Count); Event += 1)
+	{
+		perf_event_attr Attr;
+		memset(&Attr, 0, sizeof(Attr));
+		Attr.size = sizeof(Attr);
+		switch (EEvent(Event))
+		{
+		case EEvent::Instructions:
+			Attr.type = PERF_TYPE_HARDWARE;
+			Attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+		case EEvent::CacheMisses:
+			Attr.type = PERF_TYPE_HARDWARE;
+			Attr.config = PERF_COUNT_HW_CACHE_MISSES;
+			break;
+		default:
+			Attr.type = PERF_TYPE_HW_CACHE;
+			Attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+		}
+		Attr.inherit = 1;
+		Attr.exclude_kernel = 1;
+		Attr.exclude_hv = 1;
+		Fds[Event] = int(syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0));
+	}
+#endif
+}
+
+FPerfCounters::~FPerfCounters()
+{
+#if defined(__linux__)
+	for (int Fd : Fds)
+	{
+		if (Fd >= 0)
+		{
+			close(Fd);
+		}
+	}
+#endif
+}
+
+uint64_t FPerfCounters::Read(EEvent Event) const
+{
+	uint64_t Value = 0;
+#if defined(__linux__)
+	if (Fds[int(Event)] >= 0 && read(Fds[int(Event)], &Value, sizeof(Value)) != sizeof(Value))
+	{
+		Value = 0;
+	}
+#endif
+	return Value;
+}
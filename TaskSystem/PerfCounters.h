@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+
+// hardware event counters for benchmarks. counts the creating thread and the threads it starts while the counters exist, e.g. the
+// workers of a scheduler started afterwards: their counts are added when they exit. linux perf events only, unavailable elsewhere,
+// without a PMU (most VMs) or if perf_event_paranoid forbids it
+class FPerfCounters
+{
+public:
+	enum class EEvent
+	{
+		Instructions,
+		// last level cache misses
+		CacheMisses,
+		L1DataReadMisses,
+		Count
+	};
+
+	// starts counting
+	FPerfCounters();
+	~FPerfCounters();
+
+	FPerfCounters(const FPerfCounters&) = delete;
+	FPerfCounters& operator=(const FPerfCounters&) = delete;
+
+	bool IsAvailable(EEvent Event) const
+	{
+		return Fds[int(Event)] >= 0;
+	}
+
+	// 0 if unavailable
+	uint64_t Read(EEvent Event) const;
+
+private:
+	int Fds[int(EEvent::Count)];
+};
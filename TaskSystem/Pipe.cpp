@@ -1,4 +1,5 @@
 #include "Pipe.h"
+#include "Trace.h"
 
 bool FPipe::WaitUntilEmpty(std::chrono::system_clock::duration InTimeout)
 {
@@ -54,6 +55,7 @@ FTask* FPipe::PushIntoPipe(FTask& Task)
 		return nullptr;
 	}
 
+	TASK_TRACE_EDGE(Pipe, &Task, LastTask_Local);
 	return LastTask_Local;
 }
 
@@ -104,12 +106,14 @@ thread_local std::vector<const FPipe*> FPipeCallStack::CallStack;
 
 void FPipe::ExecutionStarted()
 {
+	TASK_TRACE(PipeBegin, this, DebugName);
 	FPipeCallStack::Push(*this);
 }
 
 void FPipe::ExecutionFinished()
 {
 	FPipeCallStack::Pop(*this);
+	TASK_TRACE(PipeEnd, this, DebugName);
 }
 
 bool FPipe::IsInContext() const
@@ -22,34 +22,36 @@ public:
 	bool WaitUntilEmpty(std::chrono::system_clock::duration Timeout = std::chrono::system_clock::duration::max());
 
 	template<typename TaskBodyType>
-	FTaskHandle Launch(
+	TTask<TTaskResult<TaskBodyType>> Launch(
 		const char* InDebugName,
 		TaskBodyType&& TaskBody,
+		ETaskPriority InPriority = ETaskPriority::Default,
 		EExtendedTaskPriority InExtendedTaskPriority = EExtendedTaskPriority::None
 		)
 	{
 		
-		TExecutableTask<TaskBodyType>* Task = new TExecutableTask(InDebugName, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
+		FTask* Task = new TExecutableTask<std::decay_t<TaskBodyType>>(InDebugName, InPriority, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
 		TaskCount.fetch_add(1, std::memory_order_acq_rel);
 		Task->SetPipe(*this);
 		Task->TryLaunch();
-		return FTaskHandle(Task);
+		return TTask<TTaskResult<TaskBodyType>>(Task);
 	}
 
-	template<typename TaskBodyType, typename PrerequisitesCollectionType>
-	FTaskHandle Launch(
+	template<typename TaskBodyType, typename PrerequisitesCollectionType, decltype(std::declval<PrerequisitesCollectionType>().Pimpl)* = nullptr>
+	TTask<TTaskResult<TaskBodyType>> Launch(
 		const char* InDebugName,
 		TaskBodyType&& TaskBody,
 		PrerequisitesCollectionType&& Prerequisites,
+		ETaskPriority InPriority = ETaskPriority::Default,
 		EExtendedTaskPriority InExtendedTaskPriority = EExtendedTaskPriority::None
 	)
 	{
-		TExecutableTask<TaskBodyType>* Task = new TExecutableTask(InDebugName, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
+		FTask* Task = new TExecutableTask<std::decay_t<TaskBodyType>>(InDebugName, InPriority, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
 		TaskCount.fetch_add(1, std::memory_order_acq_rel);
 		Task->AddPrerequisites(Prerequisites);
 		Task->SetPipe(*this);
 		Task->TryLaunch();
-		return FTaskHandle(Task);
+		return TTask<TTaskResult<TaskBodyType>>(Task);
 	}
 
 	// checks if pipe's task is being executed by the current thread. Allows to check if accessing a resource protected by a pipe
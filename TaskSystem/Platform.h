@@ -0,0 +1,14 @@
+#pragma once
+
+// the unit cores transfer and invalidate: data written by different threads goes on different lines. picked for the target
+// architecture, -DPLATFORM_CACHE_LINE_SIZE=N overrides it. apple silicon and several arm64 server cores have 128 byte lines (or
+// fetch 64 byte lines in pairs), so do POWER cores. FCpuTopology::GetCacheLineSize reports what the machine actually has
+#ifndef PLATFORM_CACHE_LINE_SIZE
+#if defined(__aarch64__) || defined(_M_ARM64) || defined(__powerpc64__)
+#define PLATFORM_CACHE_LINE_SIZE	128
+#else
+#define PLATFORM_CACHE_LINE_SIZE	64
+#endif
+#endif
+
+static_assert(PLATFORM_CACHE_LINE_SIZE >= 64 && (PLATFORM_CACHE_LINE_SIZE & (PLATFORM_CACHE_LINE_SIZE - 1)) == 0, "PLATFORM_CACHE_LINE_SIZE must be a power of two, at least 64");
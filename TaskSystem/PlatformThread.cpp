@@ -0,0 +1,100 @@
+#include "PlatformThread.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+bool FPlatformThread::SetCurrentThreadPriority(EThreadPriority Priority)
+{
+#if defined(_WIN32)
+	int WindowsPriority = THREAD_PRIORITY_NORMAL;
+	switch (Priority)
+	{
+	case EThreadPriority::BelowNormal: WindowsPriority = THREAD_PRIORITY_BELOW_NORMAL; break;
+	case EThreadPriority::Idle: WindowsPriority = THREAD_PRIORITY_IDLE; break;
+	default: break;
+	}
+	return SetThreadPriority(GetCurrentThread(), WindowsPriority) != 0;
+#elif defined(__linux__)
+	if (Priority == EThreadPriority::Idle)
+	{
+		sched_param Param{};
+		Param.sched_priority = 0;
+		return pthread_setschedparam(pthread_self(), SCHED_IDLE, &Param) == 0;
+	}
+
+	// on linux the nice value is per thread (it applies to the tid, not the whole process)
+	const int BelowNormalNiceValue = 10;
+	int NiceValue = Priority == EThreadPriority::BelowNormal ? BelowNormalNiceValue : 0;
+	return setpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)), NiceValue) == 0;
+#else
+	return Priority == EThreadPriority::Normal;
+#endif
+}
+
+bool FPlatformThread::SetCurrentThreadAffinity(uint32_t Cpu)
+{
+#if defined(_WIN32)
+	if (Cpu >= sizeof(DWORD_PTR) * 8)
+	{
+		return false; // processor groups are not handled
+	}
+	return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << Cpu) != 0;
+#elif defined(__linux__)
+	cpu_set_t CpuSet;
+	CPU_ZERO(&CpuSet);
+	CPU_SET(Cpu, &CpuSet);
+	return pthread_setaffinity_np(pthread_self(), sizeof(CpuSet), &CpuSet) == 0;
+#else
+	return false;
+#endif
+}
+
+bool FPlatformThread::SetCurrentThreadPreferredNode(uint32_t Node)
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+	// MPOL_PREFERRED from <numaif.h>, spelled out to not depend on libnuma headers
+	const int MPOL_PREFERRED_MODE = 1;
+	const uint32_t BitsPerWord = sizeof(unsigned long) * 8;
+	unsigned long NodeMask[4] = {};
+	if (Node >= BitsPerWord * 4)
+	{
+		return false;
+	}
+	NodeMask[Node / BitsPerWord] = 1ul << (Node % BitsPerWord);
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED_MODE, NodeMask, (unsigned long)(BitsPerWord * 4)) == 0;
+#else
+	return false;
+#endif
+}
+
+std::chrono::nanoseconds FPlatformThread::GetCurrentThreadCpuTime()
+{
+#if defined(_WIN32)
+	FILETIME CreationTime, ExitTime, KernelTime, UserTime;
+	if (!GetThreadTimes(GetCurrentThread(), &CreationTime, &ExitTime, &KernelTime, &UserTime))
+	{
+		return std::chrono::nanoseconds(0);
+	}
+	auto ToTicks = [](const FILETIME& Time) { return (uint64_t(Time.dwHighDateTime) << 32) | Time.dwLowDateTime; };
+	// 100ns ticks
+	return std::chrono::nanoseconds((ToTicks(KernelTime) + ToTicks(UserTime)) * 100);
+#elif defined(__linux__)
+	timespec Time;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &Time) != 0)
+	{
+		return std::chrono::nanoseconds(0);
+	}
+	return std::chrono::seconds(Time.tv_sec) + std::chrono::nanoseconds(Time.tv_nsec);
+#else
+	return std::chrono::nanoseconds(0);
+#endif
+}
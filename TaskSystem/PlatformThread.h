@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+#include <chrono>
+
+enum class EThreadPriority
+{
+	Normal,
+	// lower nice value / THREAD_PRIORITY_BELOW_NORMAL, still gets a fair share of an otherwise idle core
+	BelowNormal,
+	// SCHED_IDLE / THREAD_PRIORITY_IDLE, only runs when nothing else wants the core
+	Idle
+};
+
+class FPlatformThread
+{
+public:
+	// applies to the calling thread, returns false if the OS refused
+	static bool SetCurrentThreadPriority(EThreadPriority Priority);
+
+	// pins the calling thread to a single logical cpu
+	static bool SetCurrentThreadAffinity(uint32_t Cpu);
+
+	// makes memory first touched by the calling thread come from the given NUMA node. a no-op where the OS has no such policy
+	static bool SetCurrentThreadPreferredNode(uint32_t Node);
+
+	// cpu time consumed by the calling thread so far, user and kernel. zero where the OS doesn't track it
+	static std::chrono::nanoseconds GetCurrentThreadCpuTime();
+};
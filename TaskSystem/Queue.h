@@ -1,22 +1,40 @@
 #pragma once
+#include <cstdint>
+#include <algorithm>
 #include <deque>
 #include <mutex>
 #include <atomic>
 #include <iostream>
+#include <new>
+#include "Platform.h"
+#include "TaskAllocator.h"
+#include "HazardPointers.h"
 template<typename T>
 class FOverflowQueue
 {
 public:
 	void enqueue(T* Item);
+	// under one lock, dequeued in array order
+	void enqueue(T* const* Items, size_t Num);
+	// Num items linked from Oldest to Newest through their NextInQueue member, under one lock
+	void enqueueLinked(T* Oldest, T* Newest, size_t Num);
 
 	T* dequeue();
 
 	bool isEmpty();
 
+	// approximate, for load sampling
+	size_t size() const
+	{
+		return NumItems.load(std::memory_order_relaxed);
+	}
+
 	void debug() {}
 private:
 	std::mutex Mtx;
 	std::deque<T*> Items;
+	// lets consumers skip the lock when the queue is empty, the scheduler polls several of these per dequeue
+	std::atomic<size_t> NumItems{ 0 };
 };
 
 template<typename T>
@@ -24,26 +42,311 @@ inline void FOverflowQueue<T>::enqueue(T* item)
 {
 	std::lock_guard guard(Mtx);
 	Items.push_back(item);
+	NumItems.store(Items.size(), std::memory_order_relaxed);
+}
+
+template<typename T>
+inline void FOverflowQueue<T>::enqueue(T* const* items, size_t num)
+{
+	std::lock_guard guard(Mtx);
+	Items.insert(Items.end(), items, items + num);
+	NumItems.store(Items.size(), std::memory_order_relaxed);
+}
+
+template<typename T>
+inline void FOverflowQueue<T>::enqueueLinked(T* Oldest, T* /*Newest*/, size_t Num)
+{
+	std::lock_guard guard(Mtx);
+	for (T* Item = Oldest; Num != 0; Num -= 1)
+	{
+		Items.push_back(Item);
+		Item = Item->NextInQueue;
+	}
+	NumItems.store(Items.size(), std::memory_order_relaxed);
 }
 
 template<typename T>
 inline T* FOverflowQueue<T>::dequeue()
 {
+	if (NumItems.load(std::memory_order_relaxed) == 0)
+		return nullptr;
 	std::lock_guard guard(Mtx);
 	if (Items.size() == 0)
 		return nullptr;
 	T* item = Items.front();
 	Items.pop_front();
+	NumItems.store(Items.size(), std::memory_order_relaxed);
 	return item;
 }
 
 template<typename T>
 bool FOverflowQueue<T>::isEmpty()
 {
-	std::lock_guard guard(Mtx);
-	return Items.size() == 0;
+	return NumItems.load(std::memory_order_relaxed) == 0;
 }
 
+// intrusive MPMC queue, items are linked through their own NextInQueue member so queueing allocates nothing and touches only the
+// item and the queue. producers push onto a lock-free stack with one CAS. consumers take turns on a mutex: the one that finds the
+// FIFO list empty detaches the whole stack with one exchange and reverses it into the list. an item can be in one queue at a time
+template<typename T>
+class FIntrusiveQueue
+{
+public:
+	void enqueue(T* Item)
+	{
+		// counted first so the queue never looks empty while it holds an item
+		NumItems.fetch_add(1, std::memory_order_relaxed);
+		Item->NextInQueue = Inbox.load(std::memory_order_relaxed);
+		while (!Inbox.compare_exchange_weak(Item->NextInQueue, Item, std::memory_order_release, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	// pushes all items with one CAS, they are dequeued in array order
+	void enqueue(T* const* Items, size_t Num)
+	{
+		if (Num == 0)
+			return;
+		// the stack holds the newest item first, so the segment is linked from the last item down to the first one
+		for (size_t Index = Num - 1; Index != 0; Index -= 1)
+		{
+			Items[Index]->NextInQueue = Items[Index - 1];
+		}
+		PushSegment(Items[Num - 1], Items[0], Num);
+	}
+
+	// pushes Num items linked from Oldest to Newest through their NextInQueue member with one CAS
+	void enqueueLinked(T* Oldest, T* Newest, size_t Num)
+	{
+		// the stack holds the newest item first, the segment is relinked the other way round
+		T* Prev = nullptr;
+		for (T* Item = Oldest; Prev != Newest;)
+		{
+			T* Next = Item->NextInQueue;
+			Item->NextInQueue = Prev;
+			Prev = Item;
+			Item = Next;
+		}
+		PushSegment(Newest, Oldest, Num);
+	}
+
+	T* dequeue()
+	{
+		if (NumItems.load(std::memory_order_relaxed) == 0)
+			return nullptr;
+		std::lock_guard guard(Mtx);
+		T* Item = Fifo;
+		if (Item == nullptr)
+		{
+			// the stack holds the newest item first
+			T* Stack = Inbox.exchange(nullptr, std::memory_order_acquire);
+			while (Stack != nullptr)
+			{
+				T* Next = Stack->NextInQueue;
+				Stack->NextInQueue = Item;
+				Item = Stack;
+				Stack = Next;
+			}
+			if (Item == nullptr)
+				return nullptr;
+		}
+		Fifo = Item->NextInQueue;
+		Item->NextInQueue = nullptr;
+		NumItems.fetch_sub(1, std::memory_order_relaxed);
+		return Item;
+	}
+
+	bool isEmpty()
+	{
+		return NumItems.load(std::memory_order_relaxed) == 0;
+	}
+
+	// approximate, for load sampling
+	size_t size() const
+	{
+		return NumItems.load(std::memory_order_relaxed);
+	}
+
+	void debug() {}
+private:
+	// Num items linked from Newest down to Oldest
+	void PushSegment(T* Newest, T* Oldest, size_t Num)
+	{
+		NumItems.fetch_add(Num, std::memory_order_relaxed);
+		Oldest->NextInQueue = Inbox.load(std::memory_order_relaxed);
+		while (!Inbox.compare_exchange_weak(Oldest->NextInQueue, Newest, std::memory_order_release, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	// written by producers
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<T*> Inbox{ nullptr };
+	std::atomic<size_t> NumItems{ 0 };
+	// consumers only
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::mutex Mtx;
+	T* Fifo = nullptr;
+};
+
+// Vyukov's bounded MPMC queue: a ring of cells that carry a sequence number each, producers and consumers claim a position with
+// one CAS on their own counter and the cell's sequence tells whether it's ready to be written or read. there's no shared lock
+// and producers don't contend with consumers. when the ring is full items go to an unbounded FOverflowQueue, consumers drain
+// that one first since its items are older than most of the ring
+template<typename T, uint32_t Capacity = 1024>
+class FBoundedQueue
+{
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	static constexpr uint64_t Mask = Capacity - 1;
+
+	struct FCell
+	{
+		// == position: free for the producer of that position, == position + 1: holds its item
+		std::atomic<uint64_t> Sequence;
+		T* Item;
+	};
+
+public:
+	FBoundedQueue()
+	{
+		for (uint64_t Index = 0; Index < Capacity; Index += 1)
+		{
+			Cells[Index].Sequence.store(Index, std::memory_order_relaxed);
+		}
+	}
+
+	void enqueue(T* Item)
+	{
+		if (!TryEnqueue(Item))
+		{
+			Overflow.enqueue(Item);
+		}
+	}
+
+	// what doesn't fit into the ring goes to the overflow under one lock
+	void enqueue(T* const* Items, size_t Num)
+	{
+		size_t Index = 0;
+		while (Index != Num && TryEnqueue(Items[Index]))
+		{
+			Index += 1;
+		}
+		if (Index != Num)
+		{
+			Overflow.enqueue(Items + Index, Num - Index);
+		}
+	}
+
+	// Num items linked from Oldest to Newest through their NextInQueue member. a CAS per item, what doesn't fit into the ring
+	// goes to the overflow under one lock
+	void enqueueLinked(T* Oldest, T* Newest, size_t Num)
+	{
+		T* Item = Oldest;
+		while (Num != 0)
+		{
+			// read before the item is published, a consumer may run it right away
+			T* Next = Item->NextInQueue;
+			if (!TryEnqueue(Item))
+			{
+				Overflow.enqueueLinked(Item, Newest, Num);
+				return;
+			}
+			Item = Next;
+			Num -= 1;
+		}
+	}
+
+	T* dequeue()
+	{
+		if (T* Item = Overflow.dequeue())
+		{
+			return Item;
+		}
+		return TryDequeue();
+	}
+
+	bool isEmpty()
+	{
+		return EnqueuePos.load(std::memory_order_relaxed) == DequeuePos.load(std::memory_order_relaxed) && Overflow.isEmpty();
+	}
+
+	// approximate, for load sampling
+	size_t size() const
+	{
+		// loaded in this order the difference can't go negative
+		uint64_t Dequeued = DequeuePos.load(std::memory_order_relaxed);
+		uint64_t Enqueued = EnqueuePos.load(std::memory_order_relaxed);
+		return size_t(Enqueued - std::min(Dequeued, Enqueued)) + Overflow.size();
+	}
+
+	void debug() {}
+
+private:
+	bool TryEnqueue(T* Item)
+	{
+		uint64_t Pos = EnqueuePos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			FCell& Cell = Cells[Pos & Mask];
+			int64_t Diff = int64_t(Cell.Sequence.load(std::memory_order_acquire) - Pos);
+			if (Diff == 0)
+			{
+				if (EnqueuePos.compare_exchange_weak(Pos, Pos + 1, std::memory_order_relaxed))
+				{
+					Cell.Item = Item;
+					Cell.Sequence.store(Pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (Diff < 0)
+			{
+				// the cell still holds the item from one lap ago
+				return false;
+			}
+			else
+			{
+				// another producer took this position
+				Pos = EnqueuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	T* TryDequeue()
+	{
+		uint64_t Pos = DequeuePos.load(std::memory_order_relaxed);
+		while (true)
+		{
+			FCell& Cell = Cells[Pos & Mask];
+			int64_t Diff = int64_t(Cell.Sequence.load(std::memory_order_acquire) - (Pos + 1));
+			if (Diff == 0)
+			{
+				if (DequeuePos.compare_exchange_weak(Pos, Pos + 1, std::memory_order_relaxed))
+				{
+					T* Item = Cell.Item;
+					// frees the cell for the producer one lap ahead
+					Cell.Sequence.store(Pos + Capacity, std::memory_order_release);
+					return Item;
+				}
+			}
+			else if (Diff < 0)
+			{
+				// empty, or the producer of this position hasn't written its item yet
+				return nullptr;
+			}
+			else
+			{
+				Pos = DequeuePos.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint64_t> EnqueuePos{ 0 };
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<uint64_t> DequeuePos{ 0 };
+	alignas(PLATFORM_CACHE_LINE_SIZE) FCell Cells[Capacity];
+	alignas(PLATFORM_CACHE_LINE_SIZE) FOverflowQueue<T> Overflow;
+};
+
+// Michael-Scott queue: a linked list with a dummy head node, producers link new nodes after the tail with one CAS and consumers
+// advance the head with another, either side helps a lagging tail along. unlinked nodes are reclaimed through hazard pointers and
+// all nodes come from FTaskAllocator, so under sustained load they are recycled through the per-thread freelists
 template<typename T>
 class FLockFreeQueue
 {
@@ -52,91 +355,231 @@ class FLockFreeQueue
 		std::atomic<Node*> Next{ nullptr };
 	};
 
+	// hazard pointer slots
+	static constexpr uint32_t HeadSlot = 0;
+	static constexpr uint32_t NextSlot = 1;
+	static constexpr uint32_t TailSlot = 0;
+
 public:
 	FLockFreeQueue() {
-		Tail = Head = new Node();
+		Tail = Head = AllocateNode(nullptr);
+	}
+
+	~FLockFreeQueue()
+	{
+		// nobody else may use the queue anymore
+		Node* P = Head.load(std::memory_order_relaxed);
+		while (P != nullptr)
+		{
+			Node* Next = P->Next.load(std::memory_order_relaxed);
+			FreeNode(P);
+			P = Next;
+		}
 	}
 
 	void enqueue(T* Item)
 	{
-		Node* NewNode = new Node();
-		NewNode->Value = Item;
-		Node* Empty = nullptr;
+		Node* NewNode = AllocateNode(Item);
+		FHazardPointers& HazardPointers = FHazardPointers::Get();
 
 		while (true)
 		{
-			Node* Tail_Local = Tail.load();
-			Node* TailNext_Local = Tail_Local->Next.load();
-
-			if (Tail_Local == Tail.load())
+			Node* Tail_Local = HazardPointers.Protect(TailSlot, Tail);
+			Node* TailNext_Local = Tail_Local->Next.load(std::memory_order_acquire);
+			if (Tail_Local != Tail.load(std::memory_order_acquire))
 			{
-				if (TailNext_Local == nullptr)
-				{
-					if (Tail_Local->Next.compare_exchange_strong(TailNext_Local, NewNode))
-					{
-						Tail.compare_exchange_strong(Tail_Local, NewNode);
-						return;
-					}
-				}
-				else
-				{
+				continue;
+			}
 
-				}
-				
+			if (TailNext_Local != nullptr)
+			{
+				// another producer linked a node but didn't swing the tail yet
+				Tail.compare_exchange_weak(Tail_Local, TailNext_Local, std::memory_order_release, std::memory_order_relaxed);
+				continue;
 			}
 
-			
+			if (Tail_Local->Next.compare_exchange_weak(TailNext_Local, NewNode, std::memory_order_release, std::memory_order_relaxed))
+			{
+				// can fail if somebody helped already
+				Tail.compare_exchange_strong(Tail_Local, NewNode, std::memory_order_release, std::memory_order_relaxed);
+				break;
+			}
 		}
+		HazardPointers.Clear(TailSlot);
 	}
 
 	T* dequeue()
 	{
-		Node* Head_Local = Head.load();
+		FHazardPointers& HazardPointers = FHazardPointers::Get();
+		T* Value = nullptr;
+
 		while (true)
 		{
-			//Node* Head_Local = Head.load();
-			Node* HeadNext_Local = Head_Local->Next.load();
-			Node* TailLocal = Tail.load();
-			if (Head_Local = Head.load())
+			Node* Head_Local = HazardPointers.Protect(HeadSlot, Head);
+			Node* Tail_Local = Tail.load(std::memory_order_acquire);
+			Node* HeadNext_Local = HazardPointers.Protect(NextSlot, Head_Local->Next);
+			// the head didn't move, so HeadNext_Local was still linked when it got protected
+			if (Head_Local != Head.load(std::memory_order_acquire))
 			{
-				if (Head_Local == TailLocal)
-				{
-					return nullptr;
-				}
-				else
-				{
-					T* Value = HeadNext_Local->Value;
-					if (Head.compare_exchange_strong(Head_Local, HeadNext_Local))
-					{
-						//delete Head_Local;
-						return Value;
-					}
-				}
+				continue;
+			}
 
+			if (HeadNext_Local == nullptr)
+			{
+				break;
+			}
+
+			if (Head_Local == Tail_Local)
+			{
+				// don't let the head overtake a lagging tail, the tail would point at a reclaimed node
+				Tail.compare_exchange_weak(Tail_Local, HeadNext_Local, std::memory_order_release, std::memory_order_relaxed);
+				continue;
+			}
+
+			// read before the CAS, afterwards another consumer may unlink and reclaim HeadNext_Local as the new dummy
+			T* Value_Local = HeadNext_Local->Value;
+			if (Head.compare_exchange_weak(Head_Local, HeadNext_Local, std::memory_order_acq_rel, std::memory_order_relaxed))
+			{
+				Value = Value_Local;
+				// HeadNext_Local is the new dummy node, the old one is unlinked
+				HazardPointers.Retire(Head_Local, &ReclaimNode);
+				break;
 			}
 		}
-		
-		return nullptr;
+
+		HazardPointers.Clear(HeadSlot);
+		HazardPointers.Clear(NextSlot);
+		return Value;
 	}
 
 	bool isEmpty()
 	{
-		return Head == Tail;
+		FHazardPointers& HazardPointers = FHazardPointers::Get();
+		Node* Head_Local = HazardPointers.Protect(HeadSlot, Head);
+		bool bEmpty = Head_Local->Next.load(std::memory_order_acquire) == nullptr;
+		HazardPointers.Clear(HeadSlot);
+		return bEmpty;
 	}
 
+	// not thread safe
 	void debug() {
-		Node* P = Head.load()->Next;
 		int i = 0;
-		while (P != Tail)
+		for (Node* P = Head.load()->Next; P != nullptr; P = P->Next.load())
 		{
-			if (P->Next == nullptr)
-				P = P;
-			P = P->Next.load();
 			i += 1;
 		}
 		std::cout << "i: " << i << std::endl;
 	}
 private:
-	std::atomic<Node*> Head;
-	std::atomic<Node*> Tail;
+	static Node* AllocateNode(T* Value)
+	{
+		Node* NewNode = new (FTaskAllocator::Get().Allocate(sizeof(Node))) Node();
+		NewNode->Value = Value;
+		return NewNode;
+	}
+
+	static void FreeNode(Node* P)
+	{
+		P->~Node();
+		FTaskAllocator::Get().Free(P, sizeof(Node));
+	}
+
+	static void ReclaimNode(void* P)
+	{
+		FreeNode(static_cast<Node*>(P));
+	}
+
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<Node*> Head;
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<Node*> Tail;
+};
+
+// Chase-Lev work-stealing deque with a fixed capacity. the owning worker pushes and pops at the bottom (LIFO, keeps caches hot),
+// other workers steal from the top (FIFO). the buffer never grows so nothing has to be reclaimed, push fails when it's full and the
+// caller is expected to overflow into a shared queue
+template<typename T, uint32_t Capacity = 1024>
+class FWorkStealingQueue
+{
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+	static constexpr int64_t Mask = Capacity - 1;
+
+public:
+	// owner thread only
+	bool push(T* Item)
+	{
+		int64_t Bottom_Local = Bottom.load(std::memory_order_relaxed);
+		int64_t Top_Local = Top.load(std::memory_order_acquire);
+		if (Bottom_Local - Top_Local >= int64_t(Capacity))
+		{
+			return false;
+		}
+
+		Items[Bottom_Local & Mask].store(Item, std::memory_order_relaxed);
+		// publishes the item (and the task it points to) to thieves that acquire Bottom
+		Bottom.store(Bottom_Local + 1, std::memory_order_release);
+		return true;
+	}
+
+	// owner thread only
+	T* pop()
+	{
+		int64_t Bottom_Local = Bottom.load(std::memory_order_relaxed) - 1;
+		Bottom.store(Bottom_Local, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t Top_Local = Top.load(std::memory_order_relaxed);
+
+		if (Top_Local > Bottom_Local)
+		{
+			// empty
+			Bottom.store(Bottom_Local + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		T* Item = Items[Bottom_Local & Mask].load(std::memory_order_relaxed);
+		if (Top_Local == Bottom_Local)
+		{
+			// the last item, race against thieves for it
+			if (!Top.compare_exchange_strong(Top_Local, Top_Local + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				Item = nullptr;
+			}
+			Bottom.store(Bottom_Local + 1, std::memory_order_relaxed);
+		}
+		return Item;
+	}
+
+	// any thread. can return nullptr on a lost race even if the queue is not empty
+	T* steal()
+	{
+		int64_t Top_Local = Top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t Bottom_Local = Bottom.load(std::memory_order_acquire);
+		if (Top_Local >= Bottom_Local)
+		{
+			return nullptr;
+		}
+
+		T* Item = Items[Top_Local & Mask].load(std::memory_order_relaxed);
+		if (!Top.compare_exchange_strong(Top_Local, Top_Local + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return nullptr;
+		}
+		return Item;
+	}
+
+	bool isEmpty() const
+	{
+		return Bottom.load(std::memory_order_relaxed) <= Top.load(std::memory_order_relaxed);
+	}
+
+	// approximate, for load sampling
+	size_t size() const
+	{
+		int64_t Num = Bottom.load(std::memory_order_relaxed) - Top.load(std::memory_order_relaxed);
+		return Num > 0 ? size_t(Num) : 0;
+	}
+
+private:
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<int64_t> Top{ 0 };
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<int64_t> Bottom{ 0 };
+	alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic<T*> Items[Capacity];
 };
\ No newline at end of file
@@ -24,7 +24,7 @@ public:
 		Reference = Copy.Reference;
 		if (Reference)
 		{
-			Reference->AddPtr();
+			Reference->AddRef();
 		}
 	}
 
@@ -1,19 +1,23 @@
 #include "Scheduler.h"
 #include "TaskSystem.h"
+#include "Trace.h"
+#include <bit>
 
 thread_local FSchedulerTls* FSchedulerTls::ActiveScheduler = nullptr;
+thread_local FSchedulerTls::FLocalQueueType* FSchedulerTls::LocalQueue = nullptr;
+thread_local bool FSchedulerTls::bBackgroundWorker = false;
+thread_local uint32_t FSchedulerTls::WorkerIndex = 0;
+thread_local uint32_t FSchedulerTls::HelpDepth = 0;
+thread_local uint32_t FSchedulerTls::NumLaunches = 0;
+
+static int64_t GetTimeNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 FScheduler::~FScheduler()
 {
-	for (int32_t Index = 0; Index < WorkerThreads.size(); Index += 1)
-	{
-		std::thread& t = WorkerThreads[Index];
-	
-		if (t.joinable()) {
-			t.join();    // ȴ߳̽
-		}
-	}
-	
+	StopWorkers();
 }
 
 bool FScheduler::TryLaunch(FLowLevelTask* Task, bool bWakeUpWorker)
@@ -26,71 +30,685 @@ bool FScheduler::TryLaunch(FLowLevelTask* Task, bool bWakeUpWorker)
 	return false;
 }
 
-void FScheduler::StartWorkers(uint32_t NumWorkers)
+uint32_t FScheduler::TryLaunchBatch(FLowLevelTask* First)
+{
+	// the list is split into one segment per priority, relinked through NextInQueue from the oldest task to the newest one.
+	// launch order is kept within a priority and nothing is allocated
+	FLowLevelTask* Oldest[int(ETaskPriority::Count)] = {};
+	FLowLevelTask* Newest[int(ETaskPriority::Count)] = {};
+	uint32_t NumPrepared[int(ETaskPriority::Count)] = {};
+	uint32_t NumLaunched = 0;
+	int64_t LaunchTimeNs = 0;
+	for (FLowLevelTask* Task = First; Task != nullptr;)
+	{
+		FLowLevelTask* Next = Task->NextInQueue;
+		Task->NextInQueue = nullptr;
+		if (Task->TryPrepareLaunch())
+		{
+			int32_t Priority = int32_t(Task->GetPriority());
+			if (Newest[Priority] != nullptr)
+			{
+				Newest[Priority]->NextInQueue = Task;
+			}
+			else
+			{
+				Oldest[Priority] = Task;
+			}
+			Newest[Priority] = Task;
+			NumPrepared[Priority] += 1;
+			NumLaunched += 1;
+			if (ShouldTimeLaunch())
+			{
+				LaunchTimeNs = LaunchTimeNs != 0 ? LaunchTimeNs : GetTimeNs();
+				Task->LaunchTimeNs = LaunchTimeNs;
+			}
+		}
+		Task = Next;
+	}
+
+	for (int32_t Priority = 0; Priority < int32_t(ETaskPriority::Count); Priority += 1)
+	{
+		if (NumPrepared[Priority] == 0)
+		{
+			continue;
+		}
+
+		if (NumActiveWorkers.load(std::memory_order_acquire) > 0)
+		{
+			// the global queue, not the caller's deque: idle workers take the tasks from there without stealing them one by one
+			// from a single victim
+			EnqueueGlobalLinked(Priority, Oldest[Priority], Newest[Priority], NumPrepared[Priority]);
+			WakeUpWorkers(Priority, NumPrepared[Priority]);
+		}
+		else
+		{
+			// the link is read before a task is executed and possibly deleted
+			FLowLevelTask* Task = Oldest[Priority];
+			for (uint32_t Count = NumPrepared[Priority]; Count != 0; Count -= 1)
+			{
+				FLowLevelTask* Next = Task->NextInQueue;
+				Task->NextInQueue = nullptr;
+				ExecuteTaskChain(Task);
+				Task = Next;
+			}
+		}
+	}
+	return NumLaunched;
+}
+
+void FScheduler::StartWorkers(uint32_t NumForegroundWorkers, uint32_t NumBackgroundWorkers)
 {
-	NumActiveWorkers.store(NumWorkers, std::memory_order_relaxed);
+	FSchedulerConfig LocalConfig;
+	LocalConfig.NumForegroundWorkers = NumForegroundWorkers;
+	LocalConfig.NumBackgroundWorkers = NumBackgroundWorkers;
+	StartWorkers(LocalConfig);
+}
+
+void FScheduler::StartWorkers(const FSchedulerConfig& InConfig)
+{
+	assert(WorkerThreads.empty()); // StopWorkers must be called before restarting with a different config
+	Config = InConfig;
+	MetricsSampleMask = Config.MetricsSampleInterval != 0 ? std::bit_ceil(Config.MetricsSampleInterval) - 1 : ~0u;
+
+	if (IsDynamicPool())
+	{
+		Config.MinForegroundWorkers = std::max(Config.MinForegroundWorkers, 1u);
+		Config.MaxForegroundWorkers = std::max(Config.MaxForegroundWorkers, Config.MinForegroundWorkers);
+		Config.NumForegroundWorkers = std::clamp(Config.NumForegroundWorkers, Config.MinForegroundWorkers, Config.MaxForegroundWorkers);
+	}
+	NumForegroundSlots = IsDynamicPool() ? Config.MaxForegroundWorkers : Config.NumForegroundWorkers;
+
+	uint32_t NumWorkers = NumForegroundSlots + Config.NumBackgroundWorkers;
+	const FCpuTopology& Topology = FCpuTopology::Get();
+	std::vector<uint32_t> WorkerCpus = Topology.AssignCpus(Config.AffinityPolicy, NumWorkers, Config.AffinityCpus);
 
+	Workers.clear();
 	for (uint32_t Index = 0; Index < NumWorkers; Index += 1)
 	{
-		std::thread t([this]() {
-			WorkerMain();
+		Workers.push_back(std::make_unique<FWorker>());
+		FWorker& Worker = *Workers.back();
+		Worker.bBackground = Index >= NumForegroundSlots;
+		if (Index < WorkerCpus.size())
+		{
+			Worker.Cpu = int32_t(WorkerCpus[Index]);
+			const FCpuTopology::FCpu* Cpu = Topology.FindCpu(WorkerCpus[Index]);
+			Worker.Node = Cpu != nullptr ? Cpu->Node : 0;
+		}
+	}
+
+	for (uint32_t Index = 0; Index < NumWorkers; Index += 1)
+	{
+		FWorker& Worker = *Workers[Index];
+		for (bool bSameNode : { true, false })
+		{
+			for (uint32_t Offset = 1; Offset < NumWorkers; Offset += 1)
+			{
+				// start after the worker itself so thieves spread over the pool instead of all hammering worker 0
+				uint32_t Peer = (Index + Offset) % NumWorkers;
+				if ((Workers[Peer]->Node == Worker.Node) == bSameNode)
+				{
+					Worker.StealOrder.push_back(Peer);
+				}
+			}
+		}
+	}
+	LastForegroundProgress.store(0, std::memory_order_relaxed);
+	LastForegroundProgressTimeNs.store(GetTimeNs(), std::memory_order_relaxed);
+
+	NumActiveForegroundWorkers.store(Config.NumForegroundWorkers, std::memory_order_relaxed);
+	NumActiveWorkers.store(Config.NumForegroundWorkers + Config.NumBackgroundWorkers, std::memory_order_release);
+
+	WorkerThreads.resize(NumWorkers);
+	for (uint32_t Index = 0; Index < NumWorkers; Index += 1)
+	{
+		if (Index < Config.NumForegroundWorkers || Index >= NumForegroundSlots)
+		{
+			StartWorkerThread(Index);
+		}
+	}
+
+	if (IsDynamicPool())
+	{
+		ScalingThread = std::thread([this]() {
+			ScalingMain();
 		});
-		WorkerThreads.push_back(std::move(t));
 	}
 }
 
+void FScheduler::StartWorkerThread(uint32_t WorkerIndex)
+{
+	std::thread& t = WorkerThreads[WorkerIndex];
+	if (t.joinable())
+	{
+		t.join(); // a retired worker that used this slot before
+	}
+	Workers[WorkerIndex]->bActive.store(true, std::memory_order_relaxed);
+	t = std::thread([this, WorkerIndex]() {
+		WorkerMain(WorkerIndex);
+	});
+}
+
 void FScheduler::StopWorkers()
 {
-	uint32_t OldActiveWorkers = NumActiveWorkers.load(std::memory_order_relaxed);
-	if (OldActiveWorkers != 0 && NumActiveWorkers.compare_exchange_strong(OldActiveWorkers, 0, std::memory_order_relaxed))
+	NumActiveWorkers.store(0, std::memory_order_relaxed);
+	if (ScalingThread.joinable())
+	{
+		// no new workers can appear after this
+		ScalingThread.join();
+	}
+	ForegroundWorkerEvent.NotifyAll();
+	BackgroundWorkerEvent.NotifyAll();
+
+	for (int32_t Index = 0; Index < WorkerThreads.size(); Index += 1)
+	{
+		std::thread& t = WorkerThreads[Index];
+	
+		if (t.joinable()) {
+			t.join();    // ȴ߳̽
+		}
+	}
+	WorkerThreads.clear();
+
+	// workers drain their own deques before exiting, anything that raced into the global queue during shutdown is executed here.
+	// the same goes for foreground tasks stuck in a background worker's deque and vice versa
+	for (int32_t Priority = 0; Priority < int32_t(ETaskPriority::Count); Priority += 1)
+	{
+		while (FLowLevelTask* Task = DequeueGlobal(Priority))
+		{
+			ExecuteTaskChain(Task);
+		}
+		for (std::unique_ptr<FWorker>& Worker : Workers)
+		{
+			while (FLowLevelTask* Task = Worker->LocalQueue.Queues[Priority].steal())
+			{
+				ExecuteTaskChain(Task);
+			}
+		}
+	}
+
+	// the counters outlive the pool
+	for (std::unique_ptr<FWorker>& Worker : Workers)
+	{
+		ExternalCounters.Add(Worker->Counters);
+	}
+	Workers.clear();
+}
+
+FSchedulerWaitStats FScheduler::GetWaitStats() const
+{
+	FSchedulerWaitStats Stats;
+	Stats.NumWakeUps = NumWakeUps.load(std::memory_order_relaxed);
+	Stats.NumSpuriousWakeUps = NumSpuriousWakeUps.load(std::memory_order_relaxed);
+	Stats.ParkedTime = std::chrono::nanoseconds(ParkedTimeNs.load(std::memory_order_relaxed));
+	return Stats;
+}
+
+void FSchedulerCounters::Add(const FSchedulerCounters& Other)
+{
+	NumExecuted += Other.NumExecuted;
+	NumLocalDequeues += Other.NumLocalDequeues;
+	NumGlobalDequeues += Other.NumGlobalDequeues;
+	NumSteals += Other.NumSteals;
+	NumContinuations += Other.NumContinuations;
+	NumHelped += Other.NumHelped;
+	NumRetractions += Other.NumRetractions;
+	NumInlineExecutions += Other.NumInlineExecutions;
+}
+
+void FScheduler::FAtomicCounters::Load(FSchedulerCounters& Counters) const
+{
+	Counters.NumExecuted = NumExecuted.load(std::memory_order_relaxed);
+	Counters.NumLocalDequeues = NumLocalDequeues.load(std::memory_order_relaxed);
+	Counters.NumGlobalDequeues = NumGlobalDequeues.load(std::memory_order_relaxed);
+	Counters.NumSteals = NumSteals.load(std::memory_order_relaxed);
+	Counters.NumContinuations = NumContinuations.load(std::memory_order_relaxed);
+	Counters.NumHelped = NumHelped.load(std::memory_order_relaxed);
+	Counters.NumRetractions = NumRetractions.load(std::memory_order_relaxed);
+	Counters.NumInlineExecutions = NumInlineExecutions.load(std::memory_order_relaxed);
+}
+
+void FScheduler::FAtomicCounters::Add(const FAtomicCounters& Other)
+{
+	FSchedulerCounters Counters;
+	Other.Load(Counters);
+	NumExecuted.fetch_add(Counters.NumExecuted, std::memory_order_relaxed);
+	NumLocalDequeues.fetch_add(Counters.NumLocalDequeues, std::memory_order_relaxed);
+	NumGlobalDequeues.fetch_add(Counters.NumGlobalDequeues, std::memory_order_relaxed);
+	NumSteals.fetch_add(Counters.NumSteals, std::memory_order_relaxed);
+	NumContinuations.fetch_add(Counters.NumContinuations, std::memory_order_relaxed);
+	NumHelped.fetch_add(Counters.NumHelped, std::memory_order_relaxed);
+	NumRetractions.fetch_add(Counters.NumRetractions, std::memory_order_relaxed);
+	NumInlineExecutions.fetch_add(Counters.NumInlineExecutions, std::memory_order_relaxed);
+	QueueWaitTime.Merge(Other.QueueWaitTime);
+	RunTime.Merge(Other.RunTime);
+}
+
+FSchedulerMetrics FScheduler::GetMetrics()
+{
+	FSchedulerMetrics Metrics;
+	for (int32_t Priority = 0; Priority < int32_t(ETaskPriority::Count); Priority += 1)
 	{
+		Metrics.QueueDepth[Priority] = uint32_t(GetGlobalQueueSize(Priority));
+	}
 
+	for (std::unique_ptr<FWorker>& Worker : Workers)
+	{
+		FSchedulerWorkerMetrics& WorkerMetrics = Metrics.Workers.emplace_back();
+		WorkerMetrics.bBackground = Worker->bBackground;
+		WorkerMetrics.bActive = Worker->bActive.load(std::memory_order_relaxed);
+		for (int32_t Priority = 0; Priority < int32_t(ETaskPriority::Count); Priority += 1)
+		{
+			uint32_t Depth = uint32_t(Worker->LocalQueue.Queues[Priority].size());
+			WorkerMetrics.QueueDepth += Depth;
+			Metrics.QueueDepth[Priority] += Depth;
+		}
+		Worker->Counters.Load(WorkerMetrics.Counters);
+		Worker->Counters.QueueWaitTime.MergeInto(Metrics.QueueWaitTime);
+		Worker->Counters.RunTime.MergeInto(Metrics.RunTime);
+		Metrics.Total.Add(WorkerMetrics.Counters);
 	}
+
+	ExternalCounters.Load(Metrics.External);
+	ExternalCounters.QueueWaitTime.MergeInto(Metrics.QueueWaitTime);
+	ExternalCounters.RunTime.MergeInto(Metrics.RunTime);
+	Metrics.Total.Add(Metrics.External);
+
+	Metrics.Wait = GetWaitStats();
+	return Metrics;
+}
+
+void FScheduler::RecordRetraction()
+{
+	bool bShared;
+	// bound first, the argument order is unspecified and bShared is only set by the call
+	FAtomicCounters& Counters = GetThreadCounters(bShared);
+	IncrementCounter(Counters.NumRetractions, 1, bShared);
 }
 
+void FScheduler::RecordHelp()
+{
+	bool bShared;
+	FAtomicCounters& Counters = GetThreadCounters(bShared);
+	IncrementCounter(Counters.NumHelped, 1, bShared);
+}
+
+void FScheduler::RecordInlineExecution()
+{
+	bool bShared;
+	FAtomicCounters& Counters = GetThreadCounters(bShared);
+	IncrementCounter(Counters.NumInlineExecutions, 1, bShared);
+}
 
-void FScheduler::WorkerMain()
+void FScheduler::WorkerMain(uint32_t WorkerIndex)
 {
+	FWorker& Worker = *Workers[WorkerIndex];
 	FSchedulerTls::ActiveScheduler = this;
+	FSchedulerTls::LocalQueue = Config.bUseLocalQueues ? &Worker.LocalQueue : nullptr;
+	FSchedulerTls::bBackgroundWorker = Worker.bBackground;
+	FSchedulerTls::WorkerIndex = WorkerIndex;
+	TASK_TRACE_THREAD_NAME((Worker.bBackground ? "Background Worker " : "Foreground Worker ") + std::to_string(WorkerIndex));
+	if (Worker.Cpu >= 0)
+	{
+		FPlatformThread::SetCurrentThreadAffinity(uint32_t(Worker.Cpu));
+		if (FCpuTopology::Get().GetNumNodes() > 1)
+		{
+			// task memory allocated by this worker comes from its own node, and the blocks it frees are reused there
+			FPlatformThread::SetCurrentThreadPreferredNode(Worker.Node);
+			FTaskAllocator::SetThreadNode(Worker.Node);
+		}
+	}
+	if (Worker.bBackground)
+	{
+		FPlatformThread::SetCurrentThreadPriority(Config.BackgroundThreadPriority);
+	}
+	FEventCount& WorkerEvent = Worker.bBackground ? BackgroundWorkerEvent : ForegroundWorkerEvent;
+
+	// spin a little before parking, work often arrives right after the queues ran dry
+	const uint32_t MaxSpinCount = 64;
+	uint32_t SpinCount = 0;
 	bool bPreparingWait = false;
+	bool bWokenUp = false;
+	bool bIdleTimedOut = false;
+	FEventCountToken WaitToken;
 	while (true)
 	{
-		bool bExecutedSomething = false;
-		while (TryExecuteTaskFrom(&OverflowQueue))
+		if (FLowLevelTask* Task = FindWork(WorkerIndex))
 		{
-			bPreparingWait = false;
-			bExecutedSomething = true;
+			if (bPreparingWait)
+			{
+				WorkerEvent.CancelWait();
+				bPreparingWait = false;
+			}
+			bWokenUp = false;
+			bIdleTimedOut = false;
+			SpinCount = 0;
+			ExecuteTaskChain(Task);
+			continue;
 		}
-		if (NumActiveWorkers.load(std::memory_order_relaxed) == 0)
+
+		if (bWokenUp)
 		{
+			NumSpuriousWakeUps.fetch_add(1, std::memory_order_relaxed);
+			bWokenUp = false;
+		}
+
+		if (NumActiveWorkers.load(std::memory_order_relaxed) == 0 || (bIdleTimedOut && !bPreparingWait && TryRetireWorker(Worker)))
+		{
+			if (bPreparingWait)
+			{
+				WorkerEvent.CancelWait();
+			}
 			break;
 		}
 
+		if (!bPreparingWait)
+		{
+			if (SpinCount < MaxSpinCount)
+			{
+				SpinCount += 1;
+				std::this_thread::yield();
+				continue;
+			}
+
+			// register as a waiter and check the queues once more, a launch that races with us either sees the waiter or we see the task
+			WaitToken = WorkerEvent.PrepareWait();
+			bPreparingWait = true;
+			continue;
+		}
+
+		// a background worker parked while foreground work is pending has to come back to check whether it got starved,
+		// a foreground worker of a dynamic pool above its minimum size comes back to retire
+		FTimeout ParkTimeout = FTimeout::Never();
+		bool bMayRetire = !Worker.bBackground && IsDynamicPool() && NumActiveForegroundWorkers.load(std::memory_order_relaxed) > Config.MinForegroundWorkers;
+		if (Worker.bBackground && HasForegroundWork())
+		{
+			ParkTimeout = FTimeout(Config.ForegroundStarvationTimeout);
+		}
+		else if (bMayRetire)
+		{
+			ParkTimeout = FTimeout(Config.WorkerIdleTimeout);
+		}
+
+		int64_t ParkStartNs = GetTimeNs();
+		bool bNotified = WorkerEvent.Wait(WaitToken, ParkTimeout);
+		ParkedTimeNs.fetch_add(GetTimeNs() - ParkStartNs, std::memory_order_relaxed);
+		if (bNotified)
+		{
+			NumWakeUps.fetch_add(1, std::memory_order_relaxed);
+			bWokenUp = true;
+		}
+		else
+		{
+			// re-check the queues once more before retiring
+			bIdleTimedOut = bMayRetire;
+		}
+
+		bPreparingWait = false;
+		SpinCount = 0;
 	}
 
+	FSchedulerTls::bBackgroundWorker = false;
+	FSchedulerTls::LocalQueue = nullptr;
 	FSchedulerTls::ActiveScheduler = nullptr;
 }
 
-bool FScheduler::TryExecuteTaskFrom(FOverflowQueue<FLowLevelTask>* Queue)
+bool FScheduler::TryRetireWorker(FWorker& Worker)
 {
-	bool AnyExecuted = false;
-	FLowLevelTask* Task = Queue->dequeue();
-	while (Task)
+	uint32_t LocalNumForeground = NumActiveForegroundWorkers.load(std::memory_order_relaxed);
+	do
 	{
-		AnyExecuted = true;
+		if (LocalNumForeground <= Config.MinForegroundWorkers)
+		{
+			return false;
+		}
+	} while (!NumActiveForegroundWorkers.compare_exchange_weak(LocalNumForeground, LocalNumForeground - 1, std::memory_order_relaxed));
 
-		// Executing a task can return a continuation.
-		if ((Task = ExecuteTask(Task)) != nullptr)
+	// NumActiveWorkers == 0 means the scheduler is stopping, it must stay zero
+	uint32_t LocalNumActive = NumActiveWorkers.load(std::memory_order_relaxed);
+	while (LocalNumActive != 0 && !NumActiveWorkers.compare_exchange_weak(LocalNumActive, LocalNumActive - 1, std::memory_order_relaxed))
+	{
+	}
+
+	Worker.bActive.store(false, std::memory_order_relaxed);
+	return true;
+}
+
+bool FScheduler::TryAddForegroundWorker()
+{
+	if (NumActiveForegroundWorkers.load(std::memory_order_relaxed) >= Config.MaxForegroundWorkers)
+	{
+		return false;
+	}
+
+	for (uint32_t Index = 0; Index < NumForegroundSlots; Index += 1)
+	{
+		if (Workers[Index]->bActive.load(std::memory_order_relaxed))
+		{
+			continue;
+		}
+
+		uint32_t LocalNumActive = NumActiveWorkers.load(std::memory_order_relaxed);
+		do
+		{
+			if (LocalNumActive == 0)
+			{
+				return false; // stopping
+			}
+		} while (!NumActiveWorkers.compare_exchange_weak(LocalNumActive, LocalNumActive + 1, std::memory_order_relaxed));
+		NumActiveForegroundWorkers.fetch_add(1, std::memory_order_relaxed);
+
+		StartWorkerThread(Index);
+		return true;
+	}
+	return false;
+}
+
+uint32_t FScheduler::GetForegroundQueueDepth()
+{
+	size_t Depth = 0;
+	for (int32_t Priority = 0; Priority < int32_t(ETaskPriority::ForegroundCount); Priority += 1)
+	{
+		Depth += GetGlobalQueueSize(Priority);
+		for (uint32_t Index = 0; Index < NumForegroundSlots; Index += 1)
+		{
+			Depth += Workers[Index]->LocalQueue.Queues[Priority].size();
+		}
+	}
+	return uint32_t(Depth);
+}
+
+void FScheduler::ScalingMain()
+{
+	const std::chrono::microseconds SampleInterval{ 500 };
+	int64_t BackedUpSinceNs = -1;
+	int64_t LastGrowNs = 0;
+	while (NumActiveWorkers.load(std::memory_order_relaxed) != 0)
+	{
+		std::this_thread::sleep_for(SampleInterval);
+
+		// queued foreground work while no foreground worker is parked means tasks are waiting for a worker
+		uint32_t Depth = GetForegroundQueueDepth();
+		bool bBackedUp = Depth != 0 && ForegroundWorkerEvent.GetNumWaiters() == 0;
+		int64_t NowNs = GetTimeNs();
+		if (!bBackedUp)
+		{
+			BackedUpSinceNs = -1;
+			continue;
+		}
+		if (BackedUpSinceNs < 0)
+		{
+			BackedUpSinceNs = NowNs;
+		}
+
+		std::chrono::nanoseconds Threshold = Depth >= Config.ScaleUpQueueDepth ? std::chrono::nanoseconds(Config.ScaleUpDelay) : std::chrono::nanoseconds(Config.ScaleUpWaitTime);
+		if (NowNs - BackedUpSinceNs >= Threshold.count() && NowNs - LastGrowNs >= std::chrono::nanoseconds(Config.ScaleUpDelay).count())
+		{
+			if (TryAddForegroundWorker())
+			{
+				LastGrowNs = NowNs;
+				BackedUpSinceNs = -1;
+			}
+		}
+	}
+}
+
+bool FScheduler::IsPermitted(bool bBackground, int32_t Priority, bool bForegroundStarved) const
+{
+	if (IsBackgroundPriority(Priority))
+	{
+		return bBackground || Config.NumBackgroundWorkers == 0;
+	}
+	return !bBackground || bForegroundStarved;
+}
+
+bool FScheduler::HasQueuedWork(ETaskPriority Priority)
+{
+	if (FSchedulerTls::ActiveScheduler == this && FSchedulerTls::LocalQueue != nullptr)
+	{
+		return !FSchedulerTls::LocalQueue->Queues[int32_t(Priority)].isEmpty();
+	}
+	return !IsGlobalQueueEmpty(int32_t(Priority));
+}
+
+bool FScheduler::HasForegroundWork()
+{
+	for (int32_t Priority = 0; Priority < int32_t(ETaskPriority::ForegroundCount); Priority += 1)
+	{
+		if (!IsGlobalQueueEmpty(Priority))
+		{
+			return true;
+		}
+		if (Config.bUseLocalQueues)
+		{
+			for (std::unique_ptr<FWorker>& Worker : Workers)
+			{
+				if (!Worker->LocalQueue.Queues[Priority].isEmpty())
+				{
+					return true;
+				}
+			}
+		}
+	}
+	return false;
+}
+
+bool FScheduler::IsForegroundStarved()
+{
+	uint64_t Progress = 0;
+	for (std::unique_ptr<FWorker>& Worker : Workers)
+	{
+		Progress += Worker->NumDequeues.load(std::memory_order_relaxed);
+	}
+
+	int64_t NowNs = GetTimeNs();
+	uint64_t LastProgress = LastForegroundProgress.load(std::memory_order_relaxed);
+	if (Progress != LastProgress || !HasForegroundWork())
+	{
+		// foreground workers are keeping up
+		LastForegroundProgress.store(Progress, std::memory_order_relaxed);
+		LastForegroundProgressTimeNs.store(NowNs, std::memory_order_relaxed);
+		return false;
+	}
+
+	return NowNs - LastForegroundProgressTimeNs.load(std::memory_order_relaxed) >= std::chrono::nanoseconds(Config.ForegroundStarvationTimeout).count();
+}
+
+FLowLevelTask* FScheduler::FindWork(uint32_t WorkerIndex)
+{
+	FWorker& Worker = *Workers[WorkerIndex];
+	bool bForegroundStarved = Worker.bBackground && IsForegroundStarved();
+
+	// a higher priority is exhausted everywhere (own deque, global queue, peers) before looking at a lower one,
+	// so queued background work never delays latency-critical tasks
+	for (int32_t Priority = 0; Priority < int32_t(ETaskPriority::Count); Priority += 1)
+	{
+		if (!IsPermitted(Worker.bBackground, Priority, bForegroundStarved))
+		{
+			continue;
+		}
+
+		FLowLevelTask* Task = nullptr;
+		std::atomic<uint64_t>* Counter = &Worker.Counters.NumLocalDequeues;
+		if (FSchedulerTls::LocalQueue != nullptr)
 		{
-			assert(Task->TryPrepareLaunch());
+			Task = FSchedulerTls::LocalQueue->Queues[Priority].pop();
 		}
 
+		if (Task == nullptr)
+		{
+			Task = DequeueGlobal(Priority);
+			Counter = &Worker.Counters.NumGlobalDequeues;
+		}
+
+		for (size_t Peer = 0; Task == nullptr && Config.bUseLocalQueues && Peer < Worker.StealOrder.size(); Peer += 1)
+		{
+			Task = Workers[Worker.StealOrder[Peer]]->LocalQueue.Queues[Priority].steal();
+			Counter = &Worker.Counters.NumSteals;
+		}
+
+		if (Task != nullptr)
+		{
+			IncrementCounter(*Counter, 1, false);
+			if (!Worker.bBackground)
+			{
+				Worker.NumDequeues.store(Worker.NumDequeues.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			}
+			return Task;
+		}
+	}
+	return nullptr;
+}
+
+bool FScheduler::CanContinueWith(ETaskPriority Priority) const
+{
+	// only workers execute continuations, ExecuteTaskChain takes care of them
+	return Config.bUseContinuations && FSchedulerTls::ActiveScheduler == this && IsPermitted(FSchedulerTls::bBackgroundWorker, int32_t(Priority), false);
+}
+
+bool FScheduler::CanHelpWhileWaiting(ETaskPriority& OutLowestPriority) const
+{
+	if (FSchedulerTls::ActiveScheduler != this || Config.WaitHelpPolicy == EWaitHelpPolicy::None || FSchedulerTls::HelpDepth >= Config.MaxHelpDepth)
+	{
+		return false;
+	}
+
+	// priorities are ordered from the highest to the lowest
+	OutLowestPriority = ETaskPriority(int32_t(ETaskPriority::Count) - 1);
+	FLowLevelTask* ActiveTask = FLowLevelTask::GetActiveTask();
+	if (Config.WaitHelpPolicy == EWaitHelpPolicy::EqualOrHigherPriority && ActiveTask != nullptr)
+	{
+		OutLowestPriority = ActiveTask->GetPriority();
+	}
+	return true;
+}
+
+void FScheduler::ExecuteTaskChain(FLowLevelTask* Task)
+{
+	bool bShared;
+	FAtomicCounters& Counters = GetThreadCounters(bShared);
+	while (Task)
+	{
+		// Executing a task can return a continuation.
+		if ((Task = ExecuteTask(Task, Counters, bShared)) != nullptr)
+		{
+			bool bPrepared = Task->TryPrepareLaunch();
+			assert(bPrepared);
+			IncrementCounter(Counters.NumContinuations, 1, bShared);
+		}
 	}
-	return AnyExecuted;
 }
 
-FLowLevelTask* FScheduler::ExecuteTask(FLowLevelTask* InTask)
+FLowLevelTask* FScheduler::ExecuteTask(FLowLevelTask* InTask, FAtomicCounters& Counters, bool bShared)
 {
+	// the launch was timed, the task can be freed by its execution so the time is taken first
+	int64_t StartNs = 0;
+	if (InTask->LaunchTimeNs != 0)
+	{
+		StartNs = GetTimeNs();
+		Counters.QueueWaitTime.Add(uint64_t(std::max<int64_t>(StartNs - InTask->LaunchTimeNs, 0)), bShared);
+		InTask->LaunchTimeNs = 0;
+	}
+
 	FLowLevelTask* ParentTask = FLowLevelTask::ActiveTask;
 	FLowLevelTask::ActiveTask = InTask;
 	FLowLevelTask* OutTask;
@@ -98,24 +716,60 @@ FLowLevelTask* FScheduler::ExecuteTask(FLowLevelTask* InTask)
 	OutTask = InTask->ExecuteTask();
 
 	FLowLevelTask::ActiveTask = ParentTask;
+
+	if (StartNs != 0)
+	{
+		Counters.RunTime.Add(uint64_t(GetTimeNs() - StartNs), bShared);
+	}
+	IncrementCounter(Counters.NumExecuted, 1, bShared);
 	return OutTask;
 }
 
+void FScheduler::WakeUpWorker(int32_t Priority)
+{
+	WakeUpWorkers(Priority, 1);
+}
+
+void FScheduler::WakeUpWorkers(int32_t Priority, uint32_t Count)
+{
+	if (IsBackgroundPriority(Priority) && Config.NumBackgroundWorkers != 0)
+	{
+		BackgroundWorkerEvent.Notify(Count);
+	}
+	else if (ForegroundWorkerEvent.Notify(Count) < Count && !IsBackgroundPriority(Priority) && Config.NumBackgroundWorkers != 0)
+	{
+		// not enough idle foreground workers, a background worker will start watching for starvation
+		BackgroundWorkerEvent.NotifyOne();
+	}
+}
+
 void FScheduler::LaunchInternal(FLowLevelTask* Task, bool bWakeUpWorker)
 {
-	if (NumActiveWorkers.load(std::memory_order_acquire) > 0)
+	if (ShouldTimeLaunch())
 	{
-		OverflowQueue.enqueue(Task);
+		Task->LaunchTimeNs = GetTimeNs();
 	}
-	else
+
+	if (NumActiveWorkers.load(std::memory_order_acquire) > 0)
 	{
-		FLowLevelTask* TaskPtr = Task;
-		while (TaskPtr)
+		// only the worker that owns the local queue may push into it, launches from outside the pool go to the global queue.
+		// so do tasks the calling worker isn't allowed to run, its deque would be the last place other workers look
+		int32_t Priority = int32_t(Task->GetPriority());
+		bool bCallerCanExecute = FSchedulerTls::ActiveScheduler == this && IsPermitted(FSchedulerTls::bBackgroundWorker, Priority, false);
+		if (!bCallerCanExecute || FSchedulerTls::LocalQueue == nullptr || !FSchedulerTls::LocalQueue->Queues[Priority].push(Task))
 		{
-			if ((TaskPtr = ExecuteTask(TaskPtr)) != nullptr)
-			{
-				assert(TaskPtr->TryPrepareLaunch());
-			}
+			EnqueueGlobal(Priority, Task);
+		}
+
+		// a worker that launches without asking for a wake-up picks the task up itself once it's done with the current one,
+		// nobody would do that for a launch from outside the pool
+		if (bWakeUpWorker || !bCallerCanExecute)
+		{
+			WakeUpWorker(Priority);
 		}
 	}
-}
\ No newline at end of file
+	else
+	{
+		ExecuteTaskChain(Task);
+	}
+}
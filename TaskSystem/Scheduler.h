@@ -3,15 +3,166 @@
 #include <atomic>
 #include <vector>
 #include <thread>
+#include <memory>
+#include <chrono>
 #include "Queue.h"
+#include "Event.h"
+#include "Histogram.h"
+#include "PlatformThread.h"
+#include "Topology.h"
+#include "TaskSystem.h"
 
-class FLowLevelTask;
-class FLowLevelTask;
+enum class EGlobalQueueType
+{
+	// tasks linked through FLowLevelTask::NextInQueue, lock-free pushes (FIntrusiveQueue). doesn't allocate
+	Intrusive,
+	// mutex protected deque
+	Locked,
+	// lock-free bounded ring (FBoundedQueue) that overflows into a locked deque when full
+	Bounded
+};
+
+// what a worker blocked in FTask::Wait helps with besides retracting the awaited task and its prerequisites: the nested tasks of
+// the tasks in the awaited graph that were started elsewhere. the awaited task can't complete before them, so a helped task that
+// waits for a task further up the worker's stack closes a cycle that was there anyway. unrelated queued work isn't touched
+enum class EWaitHelpPolicy
+{
+	// the worker only retracts what wasn't started yet and otherwise waits
+	None,
+	// it helps with tasks of the priority of the task it's executing or a higher one, so helping doesn't delay the waiting task
+	// behind less important work
+	EqualOrHigherPriority,
+	AnyPriority
+};
 
 class FSchedulerTls
 {
 public:
+	// one deque per priority
+	struct FLocalQueueType
+	{
+		FWorkStealingQueue<FLowLevelTask> Queues[int(ETaskPriority::Count)];
+	};
+
+	static bool IsWorkerThread()
+	{
+		return ActiveScheduler != nullptr;
+	}
+
+	static bool IsBackgroundWorker()
+	{
+		return bBackgroundWorker;
+	}
+
 	static thread_local FSchedulerTls* ActiveScheduler;
+	// the deque owned by the current worker thread, nullptr for threads outside of the pool or when local queues are disabled
+	static thread_local FLocalQueueType* LocalQueue;
+	static thread_local bool bBackgroundWorker;
+	static thread_local uint32_t WorkerIndex;
+	// how many tasks the worker is executing while waiting in FTask::Wait, nested
+	static thread_local uint32_t HelpDepth;
+	// launches by this thread, picks the ones that are timed for FSchedulerMetrics
+	static thread_local uint32_t NumLaunches;
+};
+
+struct FSchedulerConfig
+{
+	// foreground workers run High and Normal tasks, background workers run the Background* priorities.
+	// without background workers the foreground ones run everything
+	uint32_t NumForegroundWorkers = 0;
+	uint32_t NumBackgroundWorkers = 0;
+	EThreadPriority BackgroundThreadPriority = EThreadPriority::BelowNormal;
+	// background workers help with foreground work only when no foreground worker dequeued anything for this long while
+	// foreground work was pending
+	std::chrono::microseconds ForegroundStarvationTimeout{ 5000 };
+	// tasks launched from inside a worker go to its own deque and idle workers steal from peers. when disabled every launch
+	// and dequeue goes through the global queue
+	bool bUseLocalQueues = true;
+	// implementation of the global queues, which take launches from outside the pool and tasks that don't fit into a worker's deque
+	EGlobalQueueType GlobalQueueType = EGlobalQueueType::Intrusive;
+	// what a worker does while it waits for a task that runs elsewhere, see EWaitHelpPolicy
+	EWaitHelpPolicy WaitHelpPolicy = EWaitHelpPolicy::EqualOrHigherPriority;
+	// a helped task that waits helps again, every level adds a task's frames to the stack. beyond this depth the worker just waits
+	uint32_t MaxHelpDepth = 8;
+	// a worker that completes a task runs one of the subsequents it unlocked right away instead of scheduling it, so a chain of
+	// tasks stays on one worker with hot caches. the other unlocked subsequents are scheduled as usual
+	bool bUseContinuations = true;
+	// one in this many launches (rounded up to a power of two) is timed for the queue wait and run time histograms of
+	// FSchedulerMetrics, 0 disables the timing. counters are always on
+	uint32_t MetricsSampleInterval = 64;
+	// pins workers to cpus, foreground workers first. with pinned workers each NUMA node is a stealing domain: idle workers
+	// steal from peers on their own node before crossing to another one
+	EAffinityPolicy AffinityPolicy = EAffinityPolicy::None;
+	// used by EAffinityPolicy::Explicit, wraps around if there are more workers than cpus
+	std::vector<uint32_t> AffinityCpus;
+
+	// dynamic scaling of the foreground pool, MaxForegroundWorkers == 0 keeps the pool fixed. the pool starts with NumForegroundWorkers,
+	// grows one worker at a time up to MaxForegroundWorkers while foreground work stays queued with no idle worker around and shrinks
+	// back to MinForegroundWorkers by retiring workers that stayed parked for WorkerIdleTimeout
+	uint32_t MinForegroundWorkers = 1;
+	uint32_t MaxForegroundWorkers = 0;
+	// grow after ScaleUpDelay if at least ScaleUpQueueDepth foreground tasks are queued, after ScaleUpWaitTime for any queued task.
+	// ScaleUpDelay is also the minimum time between two grow steps
+	uint32_t ScaleUpQueueDepth = 32;
+	std::chrono::microseconds ScaleUpDelay{ 1000 };
+	std::chrono::microseconds ScaleUpWaitTime{ 5000 };
+	std::chrono::milliseconds WorkerIdleTimeout{ 10000 };
+};
+
+struct FSchedulerWaitStats
+{
+	// times a parked worker was woken up by a notification
+	uint64_t NumWakeUps = 0;
+	// wake-ups after which the worker found nothing to execute
+	uint64_t NumSpuriousWakeUps = 0;
+	// total time spent parked, summed over all workers
+	std::chrono::nanoseconds ParkedTime{ 0 };
+};
+
+struct FSchedulerCounters
+{
+	// tasks executed by the scheduler: dequeued ones, continuations and launches executed right away for lack of workers
+	uint64_t NumExecuted = 0;
+	// where the dequeued tasks came from
+	uint64_t NumLocalDequeues = 0;
+	uint64_t NumGlobalDequeues = 0;
+	uint64_t NumSteals = 0;
+	// tasks executed as the continuation of the previous one, see FSchedulerConfig::bUseContinuations
+	uint64_t NumContinuations = 0;
+	// tasks a worker helped with while waiting in FTask::Wait, see EWaitHelpPolicy
+	uint64_t NumHelped = 0;
+	// tasks FTask::Wait executed on the waiting thread by retracting them
+	uint64_t NumRetractions = 0;
+	// EExtendedTaskPriority::Inline tasks, executed by the thread that unlocked them
+	uint64_t NumInlineExecutions = 0;
+
+	void Add(const FSchedulerCounters& Other);
+};
+
+struct FSchedulerWorkerMetrics
+{
+	bool bBackground = false;
+	// slots of a dynamic pool come and go
+	bool bActive = false;
+	// tasks in the worker's deques
+	uint32_t QueueDepth = 0;
+	FSchedulerCounters Counters;
+};
+
+// a snapshot of the scheduler, counters are totals since the process started
+struct FSchedulerMetrics
+{
+	std::vector<FSchedulerWorkerMetrics> Workers;
+	// threads outside the pool and the workers of earlier StartWorkers calls
+	FSchedulerCounters External;
+	// the workers and External
+	FSchedulerCounters Total;
+	// tasks in the global queue and the deques per priority
+	uint32_t QueueDepth[int(ETaskPriority::Count)] = {};
+	FSchedulerWaitStats Wait;
+	// sampled, see FSchedulerConfig::MetricsSampleInterval: time from the launch to the start of the execution, and the execution
+	FLatencyHistogram QueueWaitTime;
+	FLatencyHistogram RunTime;
 };
 
 class FScheduler : public FSchedulerTls
@@ -26,22 +177,218 @@ public:
 	~FScheduler();
 
 	bool TryLaunch(FLowLevelTask* Task, bool bWakeUpWorker);
+	// launches the tasks linked through NextInQueue from First on (the last link is nullptr) with one global queue operation per
+	// priority instead of one per task, and wakes as many workers as there are tasks or idle workers, whichever is less. returns
+	// how many tasks were launched (a task can be launched only once). with EGlobalQueueType::Intrusive a priority's tasks are
+	// published with a single CAS, Locked takes the lock once and Bounded claims a ring cell per task
+	uint32_t TryLaunchBatch(FLowLevelTask* First);
 
-	void StartWorkers(uint32_t NumWorkers);
+	void StartWorkers(uint32_t NumForegroundWorkers, uint32_t NumBackgroundWorkers = 0);
+	void StartWorkers(const FSchedulerConfig& InConfig);
 	void StopWorkers();
+
+	FSchedulerWaitStats GetWaitStats() const;
+	// lock-free, cheap enough to be scraped every second. not to be called concurrently with StartWorkers or StopWorkers
+	FSchedulerMetrics GetMetrics();
+
+	// called by FTask for the tasks it executes without the scheduler
+	void RecordRetraction();
+	void RecordHelp();
+	void RecordInlineExecution();
+
+	uint32_t GetNumActiveWorkers() const
+	{
+		return NumActiveWorkers.load(std::memory_order_relaxed);
+	}
+
+	uint32_t GetNumActiveForegroundWorkers() const
+	{
+		return NumActiveForegroundWorkers.load(std::memory_order_relaxed);
+	}
+
+	// whether tasks of the given priority launched by the calling thread are still waiting to be picked up: the worker's own deque
+	// on a worker thread, the global queue elsewhere. lets data-parallel algorithms split work only when there are idle thieves
+	bool HasQueuedWork(ETaskPriority Priority);
+
+	// called by FTask::Wait: whether the calling thread is a worker that may help following Config.WaitHelpPolicy, and the lowest
+	// priority it may help with. false outside of the pool or once MaxHelpDepth is reached
+	bool CanHelpWhileWaiting(ETaskPriority& OutLowestPriority) const;
+
+	// whether the calling thread may run a task of this priority as a continuation of the one it just executed instead of
+	// scheduling it, see FSchedulerConfig::bUseContinuations
+	bool CanContinueWith(ETaskPriority Priority) const;
 private:
-	FLowLevelTask* ExecuteTask(FLowLevelTask* InTask);
+	// FSchedulerCounters of one worker, written by the worker only
+	struct FAtomicCounters
+	{
+		std::atomic<uint64_t> NumExecuted{ 0 };
+		std::atomic<uint64_t> NumLocalDequeues{ 0 };
+		std::atomic<uint64_t> NumGlobalDequeues{ 0 };
+		std::atomic<uint64_t> NumSteals{ 0 };
+		std::atomic<uint64_t> NumContinuations{ 0 };
+		std::atomic<uint64_t> NumHelped{ 0 };
+		std::atomic<uint64_t> NumRetractions{ 0 };
+		std::atomic<uint64_t> NumInlineExecutions{ 0 };
+		FAtomicLatencyHistogram QueueWaitTime;
+		FAtomicLatencyHistogram RunTime;
+
+		void Load(FSchedulerCounters& Counters) const;
+		void Add(const FAtomicCounters& Other);
+	};
+
+	struct FWorker
+	{
+		FLocalQueueType LocalQueue;
+		bool bBackground = false;
+		// inactive slots of a dynamic pool have no thread, their deques stay empty
+		std::atomic<bool> bActive{ false };
+		// -1 if not pinned
+		int32_t Cpu = -1;
+		uint32_t Node = 0;
+		// peers on the same NUMA node first, then the rest
+		std::vector<uint32_t> StealOrder;
+		// bumped by foreground workers on every dequeue, background workers watch it to detect starved foreground work
+		alignas(PLATFORM_CACHE_LINE_SIZE) std::atomic_uint64_t NumDequeues{ 0 };
+		alignas(PLATFORM_CACHE_LINE_SIZE) FAtomicCounters Counters;
+	};
+
+	static bool IsBackgroundPriority(int32_t Priority)
+	{
+		return Priority >= int32_t(ETaskPriority::ForegroundCount);
+	}
+
+	// the calling worker's counters, or the shared ones of the threads outside the pool
+	FAtomicCounters& GetThreadCounters(bool& bOutShared)
+	{
+		bOutShared = FSchedulerTls::ActiveScheduler != this;
+		return bOutShared ? ExternalCounters : Workers[FSchedulerTls::WorkerIndex]->Counters;
+	}
+
+	FLowLevelTask* ExecuteTask(FLowLevelTask* InTask, FAtomicCounters& Counters, bool bShared);
+
+	// whether the calling thread's next launch is timed, see FSchedulerConfig::MetricsSampleInterval
+	bool ShouldTimeLaunch()
+	{
+		return MetricsSampleMask != ~0u && (FSchedulerTls::NumLaunches++ & MetricsSampleMask) == 0;
+	}
 
 	void LaunchInternal(FLowLevelTask* Task, bool bWakeUpWorker);
 
-	bool TryExecuteTaskFrom(FOverflowQueue<FLowLevelTask>* Queue);
+	// executes the task and any continuations it returns
+	void ExecuteTaskChain(FLowLevelTask* Task);
+
+	// for every permitted priority: local queue first, then the global queue, then steal from the other workers
+	FLowLevelTask* FindWork(uint32_t WorkerIndex);
+
+	// whether the calling worker may execute tasks of the given priority
+	bool IsPermitted(bool bBackground, int32_t Priority, bool bForegroundStarved) const;
+
+	// true if foreground work is pending and no foreground worker made progress for ForegroundStarvationTimeout
+	bool IsForegroundStarved();
+	bool HasForegroundWork();
+
+	void WorkerMain(uint32_t WorkerIndex);
+
+	void StartWorkerThread(uint32_t WorkerIndex);
+
+	bool IsDynamicPool() const
+	{
+		return Config.MaxForegroundWorkers != 0;
+	}
+
+	// samples the foreground queues and grows the pool while they stay backed up
+	void ScalingMain();
+	bool TryAddForegroundWorker();
+	// gives up the worker's slot unless the pool is already at its minimum size
+	bool TryRetireWorker(FWorker& Worker);
+	uint32_t GetForegroundQueueDepth();
+
+	// wakes a worker of the pool that serves the given priority
+	void WakeUpWorker(int32_t Priority);
+	void WakeUpWorkers(int32_t Priority, uint32_t Count);
+
+	// the global queue of the given priority, of the type picked by Config.GlobalQueueType
+	template<typename FuncType>
+	decltype(auto) VisitGlobalQueue(int32_t Priority, FuncType&& Func)
+	{
+		switch (Config.GlobalQueueType)
+		{
+		case EGlobalQueueType::Locked:
+			return Func(GlobalQueues[Priority].Locked);
+		case EGlobalQueueType::Bounded:
+			return Func(GlobalQueues[Priority].Bounded);
+		default:
+			return Func(GlobalQueues[Priority].Intrusive);
+		}
+	}
+
+	void EnqueueGlobal(int32_t Priority, FLowLevelTask* Task)
+	{
+		VisitGlobalQueue(Priority, [Task](auto& Queue) { Queue.enqueue(Task); });
+	}
 
-	void WorkerMain();
+	void EnqueueGlobal(int32_t Priority, FLowLevelTask* const* Tasks, size_t Num)
+	{
+		VisitGlobalQueue(Priority, [Tasks, Num](auto& Queue) { Queue.enqueue(Tasks, Num); });
+	}
+
+	// Num tasks linked from Oldest to Newest through NextInQueue
+	void EnqueueGlobalLinked(int32_t Priority, FLowLevelTask* Oldest, FLowLevelTask* Newest, size_t Num)
+	{
+		VisitGlobalQueue(Priority, [Oldest, Newest, Num](auto& Queue) { Queue.enqueueLinked(Oldest, Newest, Num); });
+	}
+
+	FLowLevelTask* DequeueGlobal(int32_t Priority)
+	{
+		return VisitGlobalQueue(Priority, [](auto& Queue) { return Queue.dequeue(); });
+	}
+
+	bool IsGlobalQueueEmpty(int32_t Priority)
+	{
+		return VisitGlobalQueue(Priority, [](auto& Queue) { return Queue.isEmpty(); });
+	}
+
+	size_t GetGlobalQueueSize(int32_t Priority)
+	{
+		return VisitGlobalQueue(Priority, [](auto& Queue) { return Queue.size(); });
+	}
 private:
+	FSchedulerConfig Config;
+
 	// Worker߳
 	std::atomic_uint NumActiveWorkers{ 0 };
+	std::atomic_uint NumActiveForegroundWorkers{ 0 };
+
+	// foreground workers use slots [0, NumForegroundSlots), background workers the rest
+	uint32_t NumForegroundSlots = 0;
 
 	std::vector<std::thread> WorkerThreads;
+	std::thread ScalingThread;
+
+	std::vector<std::unique_ptr<FWorker>> Workers;
+
+	// idle workers park here, launches notify them
+	FEventCount ForegroundWorkerEvent;
+	FEventCount BackgroundWorkerEvent;
 
-	FOverflowQueue<FLowLevelTask> OverflowQueue;
-};
\ No newline at end of file
+	// foreground progress as last seen by a background worker
+	std::atomic_uint64_t LastForegroundProgress{ 0 };
+	std::atomic_int64_t LastForegroundProgressTimeNs{ 0 };
+
+	std::atomic_uint64_t NumWakeUps{ 0 };
+	std::atomic_uint64_t NumSpuriousWakeUps{ 0 };
+	std::atomic_int64_t ParkedTimeNs{ 0 };
+
+	// Config.MetricsSampleInterval - 1 after rounding, ~0u if timing is disabled
+	uint32_t MetricsSampleMask = 63;
+	FAtomicCounters ExternalCounters;
+
+	// Config only changes while no worker runs, so only one of these is used at a time
+	struct FGlobalQueue
+	{
+		FIntrusiveQueue<FLowLevelTask> Intrusive;
+		FOverflowQueue<FLowLevelTask> Locked;
+		FBoundedQueue<FLowLevelTask> Bounded;
+	};
+	FGlobalQueue GlobalQueues[int(ETaskPriority::Count)];
+};
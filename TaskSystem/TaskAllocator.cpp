@@ -0,0 +1,250 @@
+#include "TaskAllocator.h"
+#include "Topology.h"
+#include <new>
+#include <cassert>
+#include <algorithm>
+
+struct FTaskAllocator::FThreadCache
+{
+	struct FFreeList
+	{
+		FFreeBlock* Head = nullptr;
+		uint32_t Num = 0;
+	};
+
+	FThreadCache()
+	{
+		FTaskAllocator::Get().RegisterThreadCache(*this);
+	}
+
+	~FThreadCache()
+	{
+		FTaskAllocator& Allocator = FTaskAllocator::Get();
+		for (uint32_t SizeClass = 0; SizeClass < NumSizeClasses; SizeClass += 1)
+		{
+			// partial batches are fine, consumers don't rely on the batch size
+			while (FreeLists[SizeClass].Head != nullptr)
+			{
+				Allocator.PushBatch(Node, SizeClass, TakeBatch(SizeClass));
+			}
+		}
+		Allocator.UnregisterThreadCache(*this);
+	}
+
+	// detaches up to BatchSize blocks from the freelist
+	FFreeBlock* TakeBatch(uint32_t SizeClass)
+	{
+		FFreeList& List = FreeLists[SizeClass];
+		FFreeBlock* Head = List.Head;
+		FFreeBlock* Tail = Head;
+		uint32_t Num = 1;
+		while (Num < BatchSize && Tail->Next != nullptr)
+		{
+			Tail = Tail->Next;
+			Num += 1;
+		}
+		List.Head = Tail->Next;
+		List.Num -= Num;
+		Tail->Next = nullptr;
+		return Head;
+	}
+
+	// written by the owning thread only, read by GetStats
+	static void Increment(std::atomic_int64_t& Counter)
+	{
+		Counter.store(Counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	FFreeList FreeLists[NumSizeClasses];
+	uint32_t Node = 0;
+
+	// allocations minus frees done by this thread, can be negative when tasks are freed by other threads than they were allocated on
+	std::atomic_int64_t NumInUse[NumSizeClasses] = {};
+	std::atomic_int64_t NumAllocations{ 0 };
+	std::atomic_int64_t NumFallbackAllocations{ 0 };
+};
+
+FTaskAllocator& FTaskAllocator::Get()
+{
+	// never destroyed: threads that outlive static destruction (workers of a scheduler that wasn't stopped) still free into it
+	static FTaskAllocator* Allocator = new FTaskAllocator();
+	return *Allocator;
+}
+
+FTaskAllocator::FThreadCache& FTaskAllocator::GetThreadCache()
+{
+	static thread_local FThreadCache Cache;
+	return Cache;
+}
+
+FTaskAllocator::FTaskAllocator()
+	: NumNodes(std::max(FCpuTopology::Get().GetNumNodes(), 1u))
+	, CentralFreeLists(new FCentralFreeList[size_t(NumNodes) * NumSizeClasses])
+{
+}
+
+void FTaskAllocator::SetThreadNode(uint32_t Node)
+{
+	GetThreadCache().Node = std::min(Node, Get().NumNodes - 1);
+}
+
+void* FTaskAllocator::Allocate(size_t Size)
+{
+	FThreadCache& Cache = GetThreadCache();
+	FThreadCache::Increment(Cache.NumAllocations);
+	if (Size > MaxBlockSize)
+	{
+		FThreadCache::Increment(Cache.NumFallbackAllocations);
+		return ::operator new(Size, std::align_val_t(PLATFORM_CACHE_LINE_SIZE));
+	}
+
+	uint32_t SizeClass = GetSizeClass(Size);
+	FThreadCache::FFreeList& List = Cache.FreeLists[SizeClass];
+	if (List.Head == nullptr)
+	{
+		List.Head = PopBatch(Cache.Node, SizeClass);
+		List.Num = 0;
+		for (FFreeBlock* Block = List.Head; Block != nullptr; Block = Block->Next)
+		{
+			List.Num += 1;
+		}
+	}
+
+	FFreeBlock* Block = List.Head;
+	List.Head = Block->Next;
+	List.Num -= 1;
+	FThreadCache::Increment(Cache.NumInUse[SizeClass]);
+	return Block;
+}
+
+void FTaskAllocator::Free(void* Ptr, size_t Size)
+{
+	if (Size > MaxBlockSize)
+	{
+		::operator delete(Ptr, std::align_val_t(PLATFORM_CACHE_LINE_SIZE));
+		return;
+	}
+
+	FThreadCache& Cache = GetThreadCache();
+	uint32_t SizeClass = GetSizeClass(Size);
+	FThreadCache::FFreeList& List = Cache.FreeLists[SizeClass];
+	FFreeBlock* Block = static_cast<FFreeBlock*>(Ptr);
+	Block->Next = List.Head;
+	List.Head = Block;
+	List.Num += 1;
+	Cache.NumInUse[SizeClass].store(Cache.NumInUse[SizeClass].load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+
+	// keep one batch around for the next allocations, hand the rest back
+	if (List.Num >= 2 * BatchSize)
+	{
+		PushBatch(Cache.Node, SizeClass, Cache.TakeBatch(SizeClass));
+	}
+}
+
+FTaskAllocator::FFreeBlock* FTaskAllocator::PopBatch(uint32_t Node, uint32_t SizeClass)
+{
+	// another node's batches aren't taken even if this node's list is empty, a new slab keeps the node's blocks local
+	FCentralFreeList& Central = GetCentralFreeList(Node, SizeClass);
+	while (true)
+	{
+		{
+			std::lock_guard guard(Central.Mtx);
+			if (FBatch* Batch = Central.Batches)
+			{
+				Central.Batches = Batch->NextBatch;
+				return &Batch->Head;
+			}
+		}
+		AllocateSlab(Node, SizeClass);
+	}
+}
+
+void FTaskAllocator::PushBatch(uint32_t Node, uint32_t SizeClass, FFreeBlock* Head)
+{
+	// the batch header lives in the first block, right after its link
+	static_assert(sizeof(FBatch) <= PLATFORM_CACHE_LINE_SIZE, "batch header must fit into the smallest block");
+	FBatch* Batch = reinterpret_cast<FBatch*>(Head);
+	FCentralFreeList& Central = GetCentralFreeList(Node, SizeClass);
+	std::lock_guard guard(Central.Mtx);
+	Batch->NextBatch = Central.Batches;
+	Central.Batches = Batch;
+}
+
+void FTaskAllocator::AllocateSlab(uint32_t Node, uint32_t SizeClass)
+{
+	uint32_t BlockSize = (SizeClass + 1) * PLATFORM_CACHE_LINE_SIZE;
+	uint32_t NumBlocks = SlabSize / BlockSize;
+	// linking the blocks below touches the slab's pages first, from the calling thread of that node
+	char* Slab = static_cast<char*>(::operator new(SlabSize, std::align_val_t(PLATFORM_CACHE_LINE_SIZE)));
+	GetCentralFreeList(Node, SizeClass).NumSlabs.fetch_add(1, std::memory_order_relaxed);
+
+	for (uint32_t First = 0; First < NumBlocks; First += BatchSize)
+	{
+		uint32_t Last = std::min(First + BatchSize, NumBlocks) - 1;
+		for (uint32_t Index = First; Index <= Last; Index += 1)
+		{
+			FFreeBlock* Block = reinterpret_cast<FFreeBlock*>(Slab + size_t(Index) * BlockSize);
+			Block->Next = Index == Last ? nullptr : reinterpret_cast<FFreeBlock*>(Slab + size_t(Index + 1) * BlockSize);
+		}
+		PushBatch(Node, SizeClass, reinterpret_cast<FFreeBlock*>(Slab + size_t(First) * BlockSize));
+	}
+}
+
+void FTaskAllocator::RegisterThreadCache(FThreadCache& Cache)
+{
+	std::lock_guard guard(ThreadCachesMtx);
+	ThreadCaches.push_back(&Cache);
+}
+
+void FTaskAllocator::UnregisterThreadCache(FThreadCache& Cache)
+{
+	std::lock_guard guard(ThreadCachesMtx);
+	for (uint32_t SizeClass = 0; SizeClass < NumSizeClasses; SizeClass += 1)
+	{
+		RetiredNumInUse[SizeClass] += Cache.NumInUse[SizeClass].load(std::memory_order_relaxed);
+	}
+	RetiredNumAllocations += Cache.NumAllocations.load(std::memory_order_relaxed);
+	RetiredNumFallbackAllocations += Cache.NumFallbackAllocations.load(std::memory_order_relaxed);
+	ThreadCaches.erase(std::find(ThreadCaches.begin(), ThreadCaches.end(), &Cache));
+}
+
+FTaskAllocatorStats FTaskAllocator::GetStats()
+{
+	FTaskAllocatorStats Stats;
+	std::lock_guard guard(ThreadCachesMtx);
+
+	int64_t NumInUse[NumSizeClasses];
+	int64_t NumAllocations = int64_t(RetiredNumAllocations);
+	int64_t NumFallbackAllocations = int64_t(RetiredNumFallbackAllocations);
+	for (uint32_t SizeClass = 0; SizeClass < NumSizeClasses; SizeClass += 1)
+	{
+		NumInUse[SizeClass] = RetiredNumInUse[SizeClass];
+	}
+	for (FThreadCache* Cache : ThreadCaches)
+	{
+		for (uint32_t SizeClass = 0; SizeClass < NumSizeClasses; SizeClass += 1)
+		{
+			NumInUse[SizeClass] += Cache->NumInUse[SizeClass].load(std::memory_order_relaxed);
+		}
+		NumAllocations += Cache->NumAllocations.load(std::memory_order_relaxed);
+		NumFallbackAllocations += Cache->NumFallbackAllocations.load(std::memory_order_relaxed);
+	}
+
+	for (uint32_t SizeClass = 0; SizeClass < NumSizeClasses; SizeClass += 1)
+	{
+		FTaskAllocatorStats::FSizeClass& SizeClassStats = Stats.SizeClasses.emplace_back();
+		SizeClassStats.BlockSize = (SizeClass + 1) * PLATFORM_CACHE_LINE_SIZE;
+		for (uint32_t Node = 0; Node < NumNodes; Node += 1)
+		{
+			uint64_t NumSlabs = GetCentralFreeList(Node, SizeClass).NumSlabs.load(std::memory_order_relaxed);
+			SizeClassStats.NumSlabsPerNode.push_back(NumSlabs);
+			SizeClassStats.NumSlabs += NumSlabs;
+		}
+		SizeClassStats.NumBlocks = SizeClassStats.NumSlabs * (SlabSize / SizeClassStats.BlockSize);
+		// the counters are sampled without stopping the threads, clamp the transient skew
+		SizeClassStats.NumBlocksInUse = uint64_t(std::max<int64_t>(NumInUse[SizeClass], 0));
+	}
+	Stats.NumAllocations = uint64_t(NumAllocations);
+	Stats.NumFallbackAllocations = uint64_t(NumFallbackAllocations);
+	return Stats;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Platform.h"
+
+struct FTaskAllocatorStats
+{
+	struct FSizeClass
+	{
+		uint32_t BlockSize = 0;
+		uint64_t NumSlabs = 0;
+		// NumSlabs by the NUMA node they were carved for
+		std::vector<uint64_t> NumSlabsPerNode;
+		// blocks carved from the slabs of this size class
+		uint64_t NumBlocks = 0;
+		// blocks currently handed out, NumBlocksInUse / NumBlocks is the slab occupancy
+		uint64_t NumBlocksInUse = 0;
+	};
+
+	std::vector<FSizeClass> SizeClasses;
+	uint64_t NumAllocations = 0;
+	// allocations too big for the largest size class, served by the system allocator
+	uint64_t NumFallbackAllocations = 0;
+};
+
+// allocator for task objects. blocks are carved from cache-line-aligned slabs, one set of slabs per size class (multiples of
+// the cache line size). every thread allocates from and frees into its own freelists without synchronization, a freelist that
+// grows too long (typically on the thread that completes tasks launched by another one) returns a batch of blocks to the central
+// freelist of its size class, a thread that runs dry takes a whole batch from there. slabs are never returned to the system.
+// there is a central freelist per NUMA node and size class, a thread only exchanges batches with the lists of its own node (see
+// SetThreadNode) and carves new slabs for them itself, so with first-touch placement they come from that node's memory
+class FTaskAllocator
+{
+public:
+	static constexpr uint32_t NumSizeClasses = 16;
+	static constexpr uint32_t MaxBlockSize = NumSizeClasses * PLATFORM_CACHE_LINE_SIZE;
+	static constexpr uint32_t SlabSize = 64 * 1024;
+	static constexpr uint32_t BatchSize = 32;
+
+	static FTaskAllocator& Get();
+
+	void* Allocate(size_t Size);
+	// Size must be the size passed to Allocate
+	void Free(void* Ptr, size_t Size);
+
+	// the node whose central freelists the calling thread uses, 0 until set. nodes the topology doesn't know fall back to the last one
+	static void SetThreadNode(uint32_t Node);
+
+	FTaskAllocatorStats GetStats();
+
+private:
+	struct FFreeBlock
+	{
+		FFreeBlock* Next;
+	};
+
+	// a list of up to BatchSize blocks, the batches are linked through their first block
+	struct FBatch
+	{
+		FFreeBlock Head;
+		FBatch* NextBatch;
+	};
+
+	struct FThreadCache;
+
+	static uint32_t GetSizeClass(size_t Size)
+	{
+		return uint32_t((Size + PLATFORM_CACHE_LINE_SIZE - 1) / PLATFORM_CACHE_LINE_SIZE) - 1;
+	}
+
+	static FThreadCache& GetThreadCache();
+
+	FTaskAllocator();
+
+	FFreeBlock* PopBatch(uint32_t Node, uint32_t SizeClass);
+	void PushBatch(uint32_t Node, uint32_t SizeClass, FFreeBlock* Head);
+	void AllocateSlab(uint32_t Node, uint32_t SizeClass);
+
+	void RegisterThreadCache(FThreadCache& Cache);
+	void UnregisterThreadCache(FThreadCache& Cache);
+
+	struct alignas(PLATFORM_CACHE_LINE_SIZE) FCentralFreeList
+	{
+		std::mutex Mtx;
+		FBatch* Batches = nullptr;
+		std::atomic_uint64_t NumSlabs{ 0 };
+	};
+
+	FCentralFreeList& GetCentralFreeList(uint32_t Node, uint32_t SizeClass)
+	{
+		return CentralFreeLists[Node * NumSizeClasses + SizeClass];
+	}
+
+	// NumSizeClasses lists per node, taken from FCpuTopology
+	uint32_t NumNodes;
+	std::unique_ptr<FCentralFreeList[]> CentralFreeLists;
+
+	std::mutex ThreadCachesMtx;
+	std::vector<FThreadCache*> ThreadCaches;
+	// counters of the thread caches that are gone
+	int64_t RetiredNumInUse[NumSizeClasses] = {};
+	uint64_t RetiredNumAllocations = 0;
+	uint64_t RetiredNumFallbackAllocations = 0;
+};
@@ -0,0 +1,334 @@
+#include "TaskGraphAnalysis.h"
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <unordered_map>
+
+namespace
+{
+	// every node is two vertices: its start and its completion
+	uint32_t StartVertex(uint32_t Node) { return Node * 2; }
+	uint32_t CompletionVertex(uint32_t Node) { return Node * 2 + 1; }
+
+	const char* GetName(const char* Name)
+	{
+		return Name != nullptr ? Name : "<unnamed>";
+	}
+
+	double ToMs(int64_t Ns)
+	{
+		return double(Ns) / 1000000.0;
+	}
+}
+
+FTaskGraphAnalysis FTaskGraphAnalysis::FromCapture()
+{
+	return FTaskGraphAnalysis(FTaskTrace::GetCaptureEvents());
+}
+
+FTaskGraphAnalysis::FTaskGraphAnalysis(const std::vector<std::vector<FTraceEvent>>& ThreadEvents)
+{
+	BuildNodes(ThreadEvents);
+	std::vector<FEdge> Edges;
+	ResolveEdges(ThreadEvents, Edges);
+	Compute(Edges);
+}
+
+void FTaskGraphAnalysis::BuildNodes(const std::vector<std::vector<FTraceEvent>>& ThreadEvents)
+{
+	for (const std::vector<FTraceEvent>& Events : ThreadEvents)
+	{
+		// executions nest on a thread: inline tasks, tasks retracted or helped with while waiting
+		std::vector<const FTraceEvent*> Stack;
+		for (const FTraceEvent& Event : Events)
+		{
+			if (Event.Type == ETraceEventType::ExecuteBegin)
+			{
+				Stack.push_back(&Event);
+			}
+			else if (Event.Type == ETraceEventType::ExecuteEnd)
+			{
+				// an end without a begin started before the capture or its begin was overwritten
+				if (!Stack.empty() && Stack.back()->Id == Event.Id)
+				{
+					FNode Node;
+					Node.Id = Event.Id;
+					Node.Name = Stack.back()->Name;
+					Node.BeginNs = Stack.back()->TimeNs;
+					Node.EndNs = Event.TimeNs;
+					Nodes.push_back(Node);
+					Stack.pop_back();
+				}
+			}
+		}
+	}
+}
+
+void FTaskGraphAnalysis::ResolveEdges(const std::vector<std::vector<FTraceEvent>>& ThreadEvents, std::vector<FEdge>& OutEdges)
+{
+	// task memory is recycled, an address stands for different tasks over a capture. the executions of an address ordered by
+	// time, the edge's timestamp and the references a task holds on its prerequisites pick the right one
+	std::unordered_map<const void*, std::vector<uint32_t>> Executions;
+	for (uint32_t Index = 0; Index != Nodes.size(); ++Index)
+	{
+		Executions[Nodes[Index].Id].push_back(Index);
+	}
+	for (auto& [Id, Indices] : Executions)
+	{
+		std::sort(Indices.begin(), Indices.end(), [this](uint32_t A, uint32_t B) { return Nodes[A].BeginNs < Nodes[B].BeginNs; });
+	}
+
+	auto FindExecutions = [&Executions](const void* Id) -> const std::vector<uint32_t>*
+	{
+		auto It = Executions.find(Id);
+		return It != Executions.end() ? &It->second : nullptr;
+	};
+	constexpr uint32_t None = ~0u;
+	// the first execution that satisfies Pred, executions of an address don't overlap
+	auto FindFirst = [this](const std::vector<uint32_t>& Indices, auto&& Pred)
+	{
+		auto It = std::find_if(Indices.begin(), Indices.end(), [this, &Pred](uint32_t Index) { return Pred(Nodes[Index]); });
+		return It != Indices.end() ? *It : None;
+	};
+	auto FindLast = [this](const std::vector<uint32_t>& Indices, auto&& Pred)
+	{
+		auto It = std::find_if(Indices.rbegin(), Indices.rend(), [this, &Pred](uint32_t Index) { return Pred(Nodes[Index]); });
+		return It != Indices.rend() ? *It : None;
+	};
+
+	for (const std::vector<FTraceEvent>& Events : ThreadEvents)
+	{
+		for (const FTraceEvent& Event : Events)
+		{
+			if (Event.Type != ETraceEventType::PrerequisiteEdge && Event.Type != ETraceEventType::NestedEdge && Event.Type != ETraceEventType::PipeEdge)
+			{
+				continue;
+			}
+			NumEdges += 1;
+
+			const std::vector<uint32_t>* TaskExecutions = FindExecutions(Event.Id);
+			const std::vector<uint32_t>* OtherExecutions = FindExecutions(Event.OtherId);
+			uint32_t Task = None;
+			uint32_t Other = None;
+			if (TaskExecutions != nullptr && OtherExecutions != nullptr)
+			{
+				int64_t TimeNs = Event.TimeNs;
+				if (Event.Type == ETraceEventType::NestedEdge)
+				{
+					// the parent adds its nested task while it executes. the nested task isn't completed yet, it either still has
+					// to finish its execution or waits for nested tasks of its own
+					Task = FindFirst(*TaskExecutions, [TimeNs](const FNode& Node) { return Node.EndNs >= TimeNs; });
+					Other = FindFirst(*OtherExecutions, [TimeNs](const FNode& Node) { return Node.EndNs >= TimeNs; });
+					if (Other == None)
+					{
+						Other = OtherExecutions->back();
+					}
+				}
+				else
+				{
+					// the subsequent is held back while its prerequisites are added, it executes after the edge is recorded. its
+					// prerequisite is referenced until then, so it's the last execution of its address before the subsequent
+					Task = FindFirst(*TaskExecutions, [TimeNs](const FNode& Node) { return Node.BeginNs >= TimeNs; });
+					if (Task != None)
+					{
+						int64_t BeginNs = Nodes[Task].BeginNs;
+						Other = FindLast(*OtherExecutions, [BeginNs](const FNode& Node) { return Node.EndNs <= BeginNs; });
+					}
+				}
+			}
+
+			if (Task == None || Other == None || Task == Other)
+			{
+				NumUnresolvedEdges += 1;
+			}
+			else if (Event.Type == ETraceEventType::NestedEdge)
+			{
+				// the parent completes after its nested task, which can't start before the parent
+				OutEdges.push_back({ CompletionVertex(Other), CompletionVertex(Task), 0 });
+				OutEdges.push_back({ StartVertex(Task), StartVertex(Other), 0 });
+			}
+			else
+			{
+				OutEdges.push_back({ CompletionVertex(Other), StartVertex(Task), 0 });
+			}
+		}
+	}
+}
+
+void FTaskGraphAnalysis::Compute(const std::vector<FEdge>& Edges)
+{
+	uint32_t NumVertices = uint32_t(Nodes.size() * 2);
+	std::vector<std::vector<FEdge>> Outgoing(NumVertices);
+	std::vector<std::vector<FEdge>> Incoming(NumVertices);
+	auto AddEdge = [&](const FEdge& Edge)
+	{
+		Outgoing[Edge.From].push_back(Edge);
+		Incoming[Edge.To].push_back(Edge);
+	};
+	for (uint32_t Index = 0; Index != Nodes.size(); ++Index)
+	{
+		AddEdge({ StartVertex(Index), CompletionVertex(Index), Nodes[Index].GetDurationNs() });
+		WorkNs += Nodes[Index].GetDurationNs();
+	}
+	for (const FEdge& Edge : Edges)
+	{
+		AddEdge(Edge);
+	}
+
+	// topological order. an edge resolved to the wrong execution can close a cycle, its vertices are left out
+	std::vector<uint32_t> Order;
+	Order.reserve(NumVertices);
+	std::vector<uint32_t> NumPending(NumVertices);
+	for (uint32_t Vertex = 0; Vertex != NumVertices; ++Vertex)
+	{
+		NumPending[Vertex] = uint32_t(Incoming[Vertex].size());
+		if (NumPending[Vertex] == 0)
+		{
+			Order.push_back(Vertex);
+		}
+	}
+	for (size_t Index = 0; Index != Order.size(); ++Index)
+	{
+		for (const FEdge& Edge : Outgoing[Order[Index]])
+		{
+			if (--NumPending[Edge.To] == 0)
+			{
+				Order.push_back(Edge.To);
+			}
+		}
+	}
+
+	// earliest time of every vertex, the span is the latest completion
+	std::vector<int64_t> Earliest(NumVertices, 0);
+	for (uint32_t Vertex : Order)
+	{
+		for (const FEdge& Edge : Outgoing[Vertex])
+		{
+			Earliest[Edge.To] = std::max(Earliest[Edge.To], Earliest[Vertex] + Edge.WeightNs);
+		}
+	}
+	uint32_t Last = ~0u;
+	for (uint32_t Vertex : Order)
+	{
+		if (Last == ~0u || Earliest[Vertex] > Earliest[Last])
+		{
+			Last = Vertex;
+		}
+	}
+	SpanNs = Last != ~0u ? Earliest[Last] : 0;
+
+	// latest time every vertex can be reached without delaying the span
+	std::vector<int64_t> Latest(NumVertices, SpanNs);
+	for (auto It = Order.rbegin(); It != Order.rend(); ++It)
+	{
+		for (const FEdge& Edge : Outgoing[*It])
+		{
+			Latest[*It] = std::min(Latest[*It], Latest[Edge.To] - Edge.WeightNs);
+		}
+	}
+	for (uint32_t Vertex : Order)
+	{
+		if (Vertex % 2 == 0)
+		{
+			FNode& Node = Nodes[Vertex / 2];
+			Node.EarliestStartNs = Earliest[Vertex];
+			Node.SlackNs = Latest[Vertex] - Earliest[Vertex];
+		}
+	}
+
+	// walk back from the last completion through the predecessors that determined each vertex's earliest time
+	for (uint32_t Vertex = Last; Vertex != ~0u;)
+	{
+		uint32_t Prev = ~0u;
+		for (const FEdge& Edge : Incoming[Vertex])
+		{
+			if (Earliest[Edge.From] + Edge.WeightNs == Earliest[Vertex] && NumPending[Edge.From] == 0)
+			{
+				Prev = Edge.From;
+				break;
+			}
+		}
+		// the own execution first, the edge from a nested task is a tie at most
+		if (Vertex == CompletionVertex(Vertex / 2) && Prev == StartVertex(Vertex / 2))
+		{
+			Nodes[Vertex / 2].bOnCriticalPath = true;
+			CriticalPath.push_back(Vertex / 2);
+		}
+		Vertex = Prev;
+	}
+	std::reverse(CriticalPath.begin(), CriticalPath.end());
+}
+
+std::vector<FTaskGraphAnalysis::FNameStats> FTaskGraphAnalysis::GetNameStats() const
+{
+	std::map<std::string, FNameStats> StatsByName;
+	for (const FNode& Node : Nodes)
+	{
+		FNameStats& Stats = StatsByName[GetName(Node.Name)];
+		Stats.MinSlackNs = Stats.Count == 0 ? Node.SlackNs : std::min(Stats.MinSlackNs, Node.SlackNs);
+		Stats.Count += 1;
+		Stats.TotalNs += Node.GetDurationNs();
+		if (Node.bOnCriticalPath)
+		{
+			Stats.NumOnCriticalPath += 1;
+			Stats.CriticalPathNs += Node.GetDurationNs();
+		}
+	}
+
+	std::vector<FNameStats> Result;
+	Result.reserve(StatsByName.size());
+	for (auto& [Name, Stats] : StatsByName)
+	{
+		Stats.Name = Name;
+		Result.push_back(std::move(Stats));
+	}
+	std::stable_sort(Result.begin(), Result.end(), [](const FNameStats& A, const FNameStats& B)
+	{
+		return A.CriticalPathNs != B.CriticalPathNs ? A.CriticalPathNs > B.CriticalPathNs : A.TotalNs > B.TotalNs;
+	});
+	return Result;
+}
+
+void FTaskGraphAnalysis::WriteReport(std::ostream& Stream, uint32_t MaxNames/* = 20*/) const
+{
+	std::ios_base::fmtflags PrevFlags = Stream.flags();
+	std::streamsize PrevPrecision = Stream.precision();
+	Stream << std::fixed << std::setprecision(3);
+
+	Stream << Nodes.size() << " executions, " << NumEdges << " edges (" << NumUnresolvedEdges << " unresolved)\n";
+	Stream << "work " << ToMs(WorkNs) << " ms, span " << ToMs(SpanNs) << " ms, parallelism " << std::setprecision(2) << GetParallelism()
+		<< std::setprecision(3) << "\n";
+
+	Stream << "critical path:\n";
+	for (size_t Index = 0; Index != CriticalPath.size();)
+	{
+		// a run of tasks with the same name is one line, e.g. a pipe that serializes the path
+		std::string Name = GetName(Nodes[CriticalPath[Index]].Name);
+		size_t Count = 0;
+		int64_t DurationNs = 0;
+		for (; Index != CriticalPath.size() && Name == GetName(Nodes[CriticalPath[Index]].Name); ++Index, ++Count)
+		{
+			DurationNs += Nodes[CriticalPath[Index]].GetDurationNs();
+		}
+		Stream << "  " << std::left << std::setw(32) << Name << std::right << std::setw(12) << ToMs(DurationNs) << " ms";
+		if (Count > 1)
+		{
+			Stream << "  (x" << Count << ")";
+		}
+		Stream << "\n";
+	}
+
+	Stream << "  " << std::left << std::setw(32) << "name" << std::right << std::setw(8) << "count" << std::setw(12) << "total ms"
+		<< std::setw(12) << "mean ms" << std::setw(14) << "min slack ms" << std::setw(10) << "on path" << std::setw(12) << "path ms" << "\n";
+	std::vector<FNameStats> Stats = GetNameStats();
+	for (size_t Index = 0; Index != Stats.size() && Index != MaxNames; ++Index)
+	{
+		const FNameStats& Entry = Stats[Index];
+		Stream << "  " << std::left << std::setw(32) << Entry.Name << std::right << std::setw(8) << Entry.Count << std::setw(12)
+			<< ToMs(Entry.TotalNs) << std::setw(12) << ToMs(Entry.TotalNs / Entry.Count) << std::setw(14) << ToMs(Entry.MinSlackNs)
+			<< std::setw(10) << Entry.NumOnCriticalPath << std::setw(12) << ToMs(Entry.CriticalPathNs) << "\n";
+	}
+
+	Stream.flags(PrevFlags);
+	Stream.precision(PrevPrecision);
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Trace.h"
+
+// critical path analysis of a trace capture. the executions recorded by FTaskTrace are the nodes, the edges recorded by
+// AddPrerequisite, AddNested and FPipe the dependencies between them. a task's duration is its execution time, everything else
+// (queueing, waking up workers) is left out: the span is how long the graph would take with as many workers as it can use,
+// work / span is how many workers it can keep busy at best
+class FTaskGraphAnalysis
+{
+public:
+	struct FNode
+	{
+		const void* Id = nullptr;
+		const char* Name = nullptr;
+		int64_t BeginNs = 0;
+		int64_t EndNs = 0;
+		// relative to the start of the graph
+		int64_t EarliestStartNs = 0;
+		// how much later the node could start without making the graph longer
+		int64_t SlackNs = 0;
+		bool bOnCriticalPath = false;
+
+		int64_t GetDurationNs() const
+		{
+			return EndNs - BeginNs;
+		}
+	};
+
+	// executions that share a debug name
+	struct FNameStats
+	{
+		std::string Name;
+		uint32_t Count = 0;
+		int64_t TotalNs = 0;
+		int64_t MinSlackNs = 0;
+		uint32_t NumOnCriticalPath = 0;
+		int64_t CriticalPathNs = 0;
+	};
+
+	// analyzes the last capture, call it after FTaskTrace::Stop
+	static FTaskGraphAnalysis FromCapture();
+
+	explicit FTaskGraphAnalysis(const std::vector<std::vector<FTraceEvent>>& ThreadEvents);
+
+	const std::vector<FNode>& GetNodes() const { return Nodes; }
+	// indices into GetNodes, in execution order
+	const std::vector<uint32_t>& GetCriticalPath() const { return CriticalPath; }
+
+	int64_t GetWorkNs() const { return WorkNs; }
+	int64_t GetSpanNs() const { return SpanNs; }
+	double GetParallelism() const { return SpanNs != 0 ? double(WorkNs) / double(SpanNs) : 0.0; }
+
+	uint32_t GetNumEdges() const { return NumEdges; }
+	// edges whose ends weren't executed during the capture (or were overwritten in the trace buffer)
+	uint32_t GetNumUnresolvedEdges() const { return NumUnresolvedEdges; }
+
+	// sorted by time on the critical path, then by total time
+	std::vector<FNameStats> GetNameStats() const;
+
+	// summary, the critical path with runs of the same name collapsed and the MaxNames names that matter most
+	void WriteReport(std::ostream& Stream, uint32_t MaxNames = 20) const;
+
+private:
+	struct FEdge
+	{
+		uint32_t From;
+		uint32_t To;
+		int64_t WeightNs;
+	};
+
+	void BuildNodes(const std::vector<std::vector<FTraceEvent>>& ThreadEvents);
+	void ResolveEdges(const std::vector<std::vector<FTraceEvent>>& ThreadEvents, std::vector<FEdge>& OutEdges);
+	void Compute(const std::vector<FEdge>& Edges);
+
+	std::vector<FNode> Nodes;
+	std::vector<uint32_t> CriticalPath;
+	int64_t WorkNs = 0;
+	int64_t SpanNs = 0;
+	uint32_t NumEdges = 0;
+	uint32_t NumUnresolvedEdges = 0;
+};
@@ -1,18 +1,55 @@
 ﻿#include "TaskSystem.h"
 #include "Scheduler.h"
 #include "Pipe.h"
+#include "Event.h"
+#include "Trace.h"
+
+#include <optional>
+#include <unordered_set>
+#include <vector>
 
 thread_local FLowLevelTask* FLowLevelTask::ActiveTask = nullptr;
 thread_local FTask* FTask::CurrentTask = nullptr;
+thread_local FLaunchBatch* FLaunchBatch::Current = nullptr;
+thread_local const FCancellationToken* FCancellationTokenScope::CurrentToken = nullptr;
+std::atomic<FTaskDelegateSpillCounter*> FTaskDelegateSpillCounter::First{ nullptr };
+
+FTaskDelegateSpillCounter::FTaskDelegateSpillCounter(const char* InDebugName, uint32_t InCallableSize)
+	: DebugName(InDebugName)
+	, CallableSize(InCallableSize)
+{
+	// counters are function-local statics and never go away, so the list only grows
+	Next = First.load(std::memory_order_relaxed);
+	while (!First.compare_exchange_weak(Next, this, std::memory_order_release, std::memory_order_relaxed))
+	{
+	}
+}
+
+std::vector<FTaskDelegateSpillCounter::FEntry> FTaskDelegateSpillCounter::GetAll()
+{
+	std::vector<FEntry> Entries;
+	for (FTaskDelegateSpillCounter* Counter = First.load(std::memory_order_acquire); Counter != nullptr; Counter = Counter->Next)
+	{
+		Entries.push_back({ Counter->DebugName, Counter->CallableSize, Counter->NumSpills.load(std::memory_order_relaxed) });
+	}
+	return Entries;
+}
 
 bool FLowLevelTask::TryCancel()
 {
 	bool bTryLaunchOnCancelSuccess = true;  // 被cancel也要执行
+	// only the state changes, priority and flags are preserved
+	auto WithState = [](uintptr_t InPackedData, ETaskState State)
+	{
+		FPackedData LocalPackedData{ InPackedData };
+		LocalPackedData.State = State;
+		return LocalPackedData.PackedData;
+	};
 	uintptr_t LocalPackedData = PackedData.load(std::memory_order_relaxed);
-	uintptr_t ReadyState = ETaskState::Ready;
-	uintptr_t ScheduledState = ETaskState::Scheduled;
-	bool bWasCanceled = PackedData.compare_exchange_strong(ReadyState, ETaskState::Canceled, std::memory_order_acq_rel)
-		|| PackedData.compare_exchange_strong(ScheduledState, ETaskState::Canceled, std::memory_order_acq_rel);
+	uintptr_t ReadyState = WithState(LocalPackedData, ETaskState::Ready);
+	uintptr_t ScheduledState = WithState(LocalPackedData, ETaskState::Scheduled);
+	bool bWasCanceled = PackedData.compare_exchange_strong(ReadyState, WithState(LocalPackedData, ETaskState::Canceled), std::memory_order_acq_rel)
+		|| PackedData.compare_exchange_strong(ScheduledState, WithState(LocalPackedData, ETaskState::Canceled), std::memory_order_acq_rel);
 
 	if (bWasCanceled && bTryLaunchOnCancelSuccess && TryPrepareLaunch())
 	{
@@ -40,18 +77,39 @@ FLowLevelTask* FLowLevelTask::ExecuteTask()
 	return ContinueTask;
 }
 
-void FTask::Init(const char* DebugName, EExtendedTaskPriority InExtendedTaskPriority)
+void FTask::Init(const char* DebugName, ETaskPriority InPriority, EExtendedTaskPriority InExtendedTaskPriority)
 {
-	LowLevelTask.Init(DebugName, 
+	LowLevelTask.Init(DebugName, InPriority,
 		[
 			this,
 			Deleter = TDeleter<FTask, &FTask::Release>{ this } // 用来释放scheduler的引用，这样FTask才能正确析构
 		]() {
-		TryExecuteTask();
+		FLowLevelTask* Continuation = nullptr;
+		TryExecuteTask(&Continuation);
+		return Continuation;
 	});
 	ExtendedTaskPriority = InExtendedTaskPriority;
 }
 
+FLaunchBatch::FLaunchBatch()
+	: bOutermost(Current == nullptr)
+{
+	if (bOutermost)
+	{
+		Current = this;
+	}
+}
+
+FLaunchBatch::~FLaunchBatch()
+{
+	if (bOutermost)
+	{
+		// launching can execute tasks on this thread (if there are no workers), what they launch isn't part of the batch
+		Current = nullptr;
+		FScheduler::Get().TryLaunchBatch(Oldest);
+	}
+}
+
 bool FTask::Wait(FTimeout Timeout)
 {
 	if (IsCompleted() || Timeout.IsExpired())
@@ -75,15 +133,62 @@ bool FTask::AddPrerequisite(FTask& Prerequisite)
 
 	Prerequisite.AddRef();
 	Prerequisites.Push(&Prerequisite);
+	TASK_TRACE_EDGE(Prerequisite, this, &Prerequisite);
 	return true;
 }
 
+namespace
+{
+	struct alignas(PLATFORM_CACHE_LINE_SIZE) FTaskWaitSlot
+	{
+		FEventCount Event;
+	};
+
+	// more slots only make it less likely that unrelated waiters wake each other up
+	constexpr uint32_t NumTaskWaitSlotsLog2 = 8;
+	FTaskWaitSlot TaskWaitSlots[1 << NumTaskWaitSlotsLog2];
+}
+
+FEventCount& FTask::GetWaitEvent() const
+{
+	// tasks are cache line aligned, fibonacci hashing spreads the remaining bits
+	uint64_t Hash = (uint64_t(uintptr_t(this)) / PLATFORM_CACHE_LINE_SIZE) * 0x9E3779B97F4A7C15ull;
+	return TaskWaitSlots[Hash >> (64 - NumTaskWaitSlotsLog2)].Event;
+}
+
+void FTask::WakeUpWaiters() const
+{
+	// a single load if nobody waits on this slot
+	GetWaitEvent().NotifyAll();
+}
+
 bool FTask::WaitImpl(FTimeout Timeout)
 {
+	TASK_TRACE_SCOPE(Wait, this, GetDebugName());
+
+	// a waiting worker also helps with what was started elsewhere, see EWaitHelpPolicy
+	std::optional<ETaskPriority> HelpLowestPriority;
+	ETaskPriority LowestPriority;
+	if (FScheduler::Get().CanHelpWhileWaiting(LowestPriority))
+	{
+		HelpLowestPriority = LowestPriority;
+	}
+
 	while (true)
 	{
-		TryRetractAndExecute(Timeout);
+		// executes the task (and what it depends on) on this thread if nobody started it yet
+		bool bExecuted = RetractGraph(Timeout, HelpLowestPriority);
+
+		if (IsCompleted() || Timeout.IsExpired())
+			return IsCompleted();
+
+		// something may have become ready meanwhile, the graph is walked again before blocking
+		if (bExecuted)
+		{
+			continue;
+		}
 
+		// the task is running elsewhere and may be about to complete, a short spin saves the park/wake-up round trip
 		const uint32_t MaxSpinCount = 40;
 		for (uint32_t SpinCount = 0; SpinCount != MaxSpinCount && !IsCompleted() && !Timeout.IsExpired(); ++SpinCount)
 		{
@@ -93,6 +198,28 @@ bool FTask::WaitImpl(FTimeout Timeout)
 		if (IsCompleted() || Timeout.IsExpired())
 			return IsCompleted();
 
+		// park until Close notifies. completion is re-checked after registering as a waiter so a Close in between isn't missed.
+		// a worker comes back regularly: the task or what it depends on can get queued meanwhile, and if every worker is blocked
+		// in a wait nobody else would pick that up
+		const std::chrono::milliseconds WorkerParkInterval{ 1 };
+		FTimeout ParkTimeout = Timeout;
+		if (FSchedulerTls::IsWorkerThread() && Timeout.GetRemainingTime() > WorkerParkInterval)
+		{
+			ParkTimeout = FTimeout(WorkerParkInterval);
+		}
+
+		FEventCount& Event = GetWaitEvent();
+		FEventCountToken Token = Event.PrepareWait();
+		if (IsCompleted())
+		{
+			Event.CancelWait();
+			return true;
+		}
+		Event.Wait(Token, ParkTimeout);
+
+		if (IsCompleted() || Timeout.IsExpired())
+			return IsCompleted();
+		// woken up for another task sharing the slot, or a worker's park interval is over
 	}
 }
 
@@ -103,6 +230,7 @@ void FTask::AddNested(FTask& Nested)
 	{
 		Nested.AddRef();
 		Prerequisites.Push(&Nested);
+		TASK_TRACE_EDGE(Nested, this, &Nested);
 	}
 	else
 	{
@@ -112,95 +240,240 @@ void FTask::AddNested(FTask& Nested)
 
 void FTask::Wait()
 {
-	WaitImpl(FTimeout::Never());
+	if (!IsCompleted())
+	{
+		WaitImpl(FTimeout::Never());
+	}
 }
 
-bool FTask::TryRetractAndExecute(FTimeout Timeout, uint32_t RecursionDepth/* = 0*/)
+namespace
 {
-	if (IsCompleted() || Timeout.IsExpired())
+	// a stack that keeps its first NumInlineItems items in place and only allocates beyond that. a retracted task can wait and
+	// retract in turn, so the buffers can't be shared by the calls on a thread
+	template<typename T, uint32_t NumInlineItems>
+	class TInlineStack
 	{
-		return IsCompleted();
-	}
+	public:
+		bool IsEmpty() const
+		{
+			return Num == 0;
+		}
 
-	if (!IsAwaitable())
+		uint32_t GetNum() const
+		{
+			return Num;
+		}
+
+		T& Top()
+		{
+			return Num <= NumInlineItems ? InlineItems[Num - 1] : Overflow.back();
+		}
+
+		// invalidates references to overflowed items only
+		void Push(const T& Item)
+		{
+			if (Num < NumInlineItems)
+			{
+				InlineItems[Num] = Item;
+			}
+			else
+			{
+				Overflow.push_back(Item);
+			}
+			Num += 1;
+		}
+
+		void Pop()
+		{
+			if (Num > NumInlineItems)
+			{
+				Overflow.pop_back();
+			}
+			Num -= 1;
+		}
+
+		template<typename FuncType>
+		void ForEach(FuncType&& Func)
+		{
+			for (uint32_t Index = 0; Index < Num; Index += 1)
+			{
+				Func(Index < NumInlineItems ? InlineItems[Index] : Overflow[Index - NumInlineItems]);
+			}
+		}
+
+	private:
+		T InlineItems[NumInlineItems];
+		uint32_t Num = 0;
+		std::vector<T> Overflow;
+	};
+}
+
+bool FTask::TryRetractAndExecute(FTimeout Timeout)
+{
+	RetractGraph(Timeout, std::nullopt);
+
+	// the task can still be "not completed" if a nested task is running elsewhere or is in the process of completing it, so the
+	// caller still has to wait for completion
+	return IsCompleted();
+}
+
+bool FTask::RetractGraph(FTimeout Timeout, std::optional<ETaskPriority> HelpLowestPriority)
+{
+	if (IsCompleted() || Timeout.IsExpired())
 	{
-		assert(0);  // dead lock
 		return false;
 	}
 
-	// avoid stack overflow. is not expected in a real-life cases but happens in stress tests
-	if (RecursionDepth == 200)
+	// the task is executing further up this thread's stack. inside a helped task (see EWaitHelpPolicy) that's a cycle in the
+	// awaited graph the caller blocks on, the same as it would on any other thread
+	if (!IsAwaitable())
 	{
+		assert(FSchedulerTls::HelpDepth != 0);  // dead lock
 		return false;
 	}
-	++RecursionDepth;
 
-	// returns false if the task has passed "pre-scheduling" state: all (if any) prerequisites are completed
-	auto IsLockedByPrerequisites = [this]
+	enum class EStep
 	{
-		uint32_t LocalNumLocks = NumLocks.load(std::memory_order_relaxed); // the order doesn't matter as this "happens before" task execution
-		return LocalNumLocks != 0 && LocalNumLocks < ExecutionFlag;
+		Prerequisites,	// retract what the task waits for before it can be executed
+		Execute,
+		Nested,			// the task was executed here, retract the nested tasks it launched
+		Done,
 	};
 
-	if (IsLockedByPrerequisites())
+	struct FFrame
 	{
-		// try to unlock the task. even if (some or all) prerequisites retraction fails we still proceed to try helping with other prerequisites or this task execution
+		FTask* Task;
+		EStep Step;
+		// reached through a task that was started elsewhere
+		bool bHelped;
+	};
+
+	// Wait calls this in its loop, the common short walk doesn't touch the heap
+	static constexpr uint32_t NumInlineFrames = 16;
+	// a task reachable through several paths is attempted again, which fails harmlessly. a graph with many shared prerequisites
+	// could be walked an exponential number of times though, past this many pushes every task is visited once
+	static constexpr uint32_t NumPushesBeforeVisited = 32;
+
+	// every task on the stack is kept alive by a reference of its own, the edges it was reached through can get popped meanwhile
+	TInlineStack<FFrame, NumInlineFrames> Stack;
+	std::optional<std::unordered_set<FTask*>> Visited;
+	uint32_t NumPushes = 0;
+	bool bExecuted = false;
 
-		// prerequisites are "consumed" here even if their retraction fails. this means that once prerequisite retraction failed, it won't be performed again. 
-		// this can be potentially improved by using a different container for prerequisites
-		for (FTask* Prerequisite : Prerequisites.PopAll())
+	auto Push = [&Stack, &Visited, &NumPushes](FTask* Task, bool bHelped)
+	{
+		NumPushes += 1;
+		if (!Visited.has_value() && NumPushes > NumPushesBeforeVisited)
 		{
-			// ignore if retraction failed, as this thread still can try to help with other prerequisites instead of being blocked in waiting
-			Prerequisite->TryRetractAndExecute(Timeout, RecursionDepth);
-			Prerequisite->Release();
+			// what was popped already may be attempted once more
+			Visited.emplace();
+			Stack.ForEach([&Visited](FFrame& Frame) { Visited->insert(Frame.Task); });
 		}
-	}
+		if (Visited.has_value() && !Visited->insert(Task).second)
+		{
+			return;
+		}
+		Task->AddRef();
+		Stack.Push({ Task, EStep::Prerequisites, bHelped });
+	};
 
-	if (Timeout.IsExpired())
+	auto PushPrerequisites = [&Push](FTask& Task, bool bHelped)
 	{
-		return IsCompleted();
-	}
+		// if they can't be visited right now the task's execution is attempted anyway, and fails harmlessly
+		Task.Prerequisites.Visit([&Push, bHelped](FTask* Prerequisite)
+		{
+			if (!Prerequisite->IsCompleted())
+			{
+				Push(Prerequisite, bHelped);
+			}
+		});
+	};
 
+	Push(this, false);
+	while (!Stack.IsEmpty() && !Timeout.IsExpired())
 	{
-		// next we try to execute the task, despite we haven't verified that the task is unlocked. trying to obtain execution permission will fail in this case
-
-		if (!TryExecuteTask())
+		// the step is advanced before pushing anything, pushing invalidates the reference
+		FFrame& Frame = Stack.Top();
+		FTask* Task = Frame.Task;
+		bool bHelped = Frame.bHelped;
+		if (Frame.Step == EStep::Done || Task->IsCompleted())
 		{
-			return false; // still locked by prerequisites, or another thread managed to set execution flag first, or we're inside this task execution
-			// we could try to help with nested tasks execution (the task execution could already spawned a couple of nested tasks sitting in the queue). 
-			// it's unclear how important this is, but this would definitely lead to more complicated impl. we can revisit this once we see such instances in profiler captures
+			Stack.Pop();
+			Task->Release();
+			continue;
 		}
-	}
 
-	// the task was launched so the scheduler will handle the internal reference held by low-level task
+		switch (Frame.Step)
+		{
+		case EStep::Prerequisites:
+			// prerequisites are done first, even if some of them fail the task gets its try: they may complete elsewhere meanwhile
+			Frame.Step = EStep::Execute;
+			if (Task->IsLockedByPrerequisites())
+			{
+				PushPrerequisites(*Task, bHelped);
+			}
+			break;
 
-	// retract nested tasks, if any
-	{
-		// keep trying retracting all nested tasks even if some of them fail, so the current worker can contribute instead of being blocked
-		bool bSucceeded = true;
-		// prerequisites are "consumed" here even if their retraction fails. this means that once prerequisite retraction failed, it won't be performed again. 
-		// this can be potentially improved by using a different container for prerequisites
-		for (FTask* Prerequisite : Prerequisites.PopAll())
+		case EStep::Execute:
 		{
-			if (!Prerequisite->TryRetractAndExecute(Timeout, RecursionDepth))
+			// fails if the task is still locked by prerequisites, or another thread managed to set execution flag first, or we're
+			// inside this task execution
+			if (bHelped)
+			{
+				FSchedulerTls::HelpDepth += 1;
+			}
+			bool bTaskExecuted = Task->TryExecuteTask();
+			if (bHelped)
+			{
+				FSchedulerTls::HelpDepth -= 1;
+			}
+
+			Frame.Step = bTaskExecuted ? EStep::Nested : EStep::Done;
+			if (bTaskExecuted)
 			{
-				bSucceeded = false;
+				bExecuted = true;
+				if (bHelped)
+				{
+					FScheduler::Get().RecordHelp();
+				}
+				else
+				{
+					FScheduler::Get().RecordRetraction();
+				}
 			}
-			Prerequisite->Release();
+			else if (HelpLowestPriority.has_value() && !Task->IsLockedByPrerequisites() && !Task->IsCompleted())
+			{
+				// started elsewhere. the task can't complete before its nested tasks, so they can't wait for anything up this
+				// thread's stack without that being a cycle anyway
+				Task->Prerequisites.Visit([&Push, &HelpLowestPriority](FTask* Nested)
+				{
+					if (!Nested->IsCompleted() && Nested->GetPriority() <= *HelpLowestPriority)
+					{
+						Push(Nested, true);
+					}
+				});
+			}
+			break;
 		}
 
-		if (!bSucceeded)
-		{
-			return false;
+		case EStep::Nested:
+			// prerequisites were popped when the execution started, what's there now are nested tasks
+			Frame.Step = EStep::Done;
+			PushPrerequisites(*Task, bHelped);
+			break;
+
+		default:
+			assert(false);
 		}
 	}
 
-	// at this point the task is executed and has no pending nested tasks, but still can be "not completed" (nested tasks can be 
-	// in the process of completing it (setting the flag) concurrently), so the caller still has to wait for completion
-	return true;
+	// timed out
+	Stack.ForEach([](FFrame& Frame) { Frame.Task->Release(); });
+
+	return bExecuted;
 }
 
-bool FTask::TryUnlock(bool& bWakeUpWorker)
+bool FTask::TryUnlock(bool& bWakeUpWorker, FLowLevelTask** OutContinuation/* = nullptr*/)
 {
 	FPipe* LocalPipe = GetPipe();
 	uint32_t PrevNumLocks = NumLocks.fetch_sub(1, std::memory_order_acq_rel);
@@ -229,10 +502,17 @@ bool FTask::TryUnlock(bool& bWakeUpWorker)
 			}
 		}
 
+		TASK_TRACE(Ready, this, GetDebugName());
+
 		if (ExtendedTaskPriority == EExtendedTaskPriority::TaskEvent)
 		{
 			if (TrySetExecutionFlag())
 			{
+				{
+					// an empty execution, so the event is a node of the task graph
+					TASK_TRACE_SCOPE(Execute, this, GetDebugName());
+				}
+
 				// task events are used as an empty prerequisites/subsequents
 				ReleasePrerequisites();
 				Close();
@@ -244,12 +524,15 @@ bool FTask::TryUnlock(bool& bWakeUpWorker)
 		else if (ExtendedTaskPriority == EExtendedTaskPriority::Inline)
 		{
 			// 直接运行
-			TryExecuteTask();
+			if (TryExecuteTask())
+			{
+				FScheduler::Get().RecordInlineExecution();
+			}
 			ReleaseInternalReference();
 		}
 		else
 		{
-			Schedule(bWakeUpWorker);
+			Schedule(bWakeUpWorker, OutContinuation);
 		}
 		return true;
 	}
@@ -263,8 +546,22 @@ bool FTask::TryUnlock(bool& bWakeUpWorker)
 }
 
 
-void FTask::Schedule(bool& bWakeUpWorker)
+void FTask::Schedule(bool& bWakeUpWorker, FLowLevelTask** OutContinuation)
 {
+	if (OutContinuation != nullptr && FScheduler::Get().CanContinueWith(GetPriority()))
+	{
+		*OutContinuation = &LowLevelTask;
+		// the calling worker is busy with the continuation, the other unlocked subsequents are up to other workers
+		bWakeUpWorker = true;
+		return;
+	}
+
+	if (FLaunchBatch* Batch = FLaunchBatch::GetCurrent())
+	{
+		Batch->Add(&LowLevelTask);
+		return;
+	}
+
 	bWakeUpWorker |= FScheduler::Get().TryLaunch(&LowLevelTask, bWakeUpWorker);
 }
 
@@ -273,7 +570,14 @@ void FTask::ClearPipe()
 	GetPipe()->ClearTask(*this);
 }
 
-bool FTask::TryExecuteTask()
+uint32_t FTask::GetThreadOrdinal()
+{
+	static std::atomic_uint32_t NumThreads{ 0 };
+	static thread_local uint32_t ThreadOrdinal = NumThreads.fetch_add(1, std::memory_order_relaxed) + 1;
+	return ThreadOrdinal;
+}
+
+bool FTask::TryExecuteTask(FLowLevelTask** OutContinuation/* = nullptr*/)
 {
 	if (!TrySetExecutionFlag())
 	{
@@ -286,26 +590,33 @@ bool FTask::TryExecuteTask()
 
 	FTask* PrevTask = ExchangeCurrentTask(this);
 
-	ExecutingThreadId.store(std::this_thread::get_id(), std::memory_order_relaxed);
+	ExecutingThread.store(GetThreadOrdinal(), std::memory_order_relaxed);
 	if (GetPipe() != nullptr)
 	{
 		GetPipe()->ExecutionStarted();
 	}
 
-	ExecuteTask();
+	{
+		TASK_TRACE_SCOPE(Execute, this, GetDebugName());
+		// canceled through a prerequisite, the task's own token is checked by the body
+		if (!IsCanceled())
+		{
+			ExecuteTask();
+		}
+	}
 
 	if (GetPipe() != nullptr)
 	{
 		GetPipe()->ExecutionFinished();
 	}
-	ExecutingThreadId.store(std::thread::id(), std::memory_order_relaxed);
+	ExecutingThread.store(0, std::memory_order_relaxed);
 
 	ExchangeCurrentTask(PrevTask);
 
 	uint32_t LocalNumLocks = NumLocks.fetch_sub(1, std::memory_order_acq_rel) - 1;
 	if (LocalNumLocks == ExecutionFlag)
 	{
-		Close();
+		Close(OutContinuation);
 		Release();
 	}
 	return true;
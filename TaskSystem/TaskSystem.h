@@ -4,23 +4,42 @@
 #include <mutex>
 #include <cassert>
 #include <functional>
+#include <new>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <exception>
 #include "RefCounting.h"
 #include "Timeout.h"
+#include "Platform.h"
+#include "TaskAllocator.h"
 
-#define PLATFORM_CACHE_LINE_SIZE	64
+// size of FLowLevelTask, what's left after the bookkeeping is the inline storage of its delegate. task bodies with bigger
+// captures spill to FTaskAllocator, see FTaskDelegateSpillCounter
+#ifndef LOWLEVEL_TASK_SIZE
 #define LOWLEVEL_TASK_SIZE PLATFORM_CACHE_LINE_SIZE
+#endif
 
 enum ETaskFlags
 {
 
 };
 
-enum ETaskPriority
+// scheduling priority of a task. each priority has its own queues, workers always pick up higher priorities first
+enum class ETaskPriority
 {
-
+	High,
+	Normal,
+	Default = Normal,
+	ForegroundCount,
+	BackgroundHigh = ForegroundCount,
+	BackgroundNormal,
+	BackgroundLow,
+	Count
 };
 // special task priorities for tasks that are never sent to the scheduler
-enum class EExtendedTaskPriority
+enum class EExtendedTaskPriority : uint8_t
 {
 	None,
 	Inline, // a task priority for "inline" task execution - a task is executed "inline" by the thread that unlocked it, w/o scheduling
@@ -39,14 +58,23 @@ enum ETaskState
 
 class FTask;
 class FPipe;
+class FEventCount;
 class FLowLevelTask;
 
 namespace TTaskDelegate_Impl
 {
+	// what an empty delegate returns. calling one is a bug, types that can't be value-initialized stop the program
 	template<typename ReturnType>
 	inline ReturnType MakeDummyValue()
 	{
-		return *(reinterpret_cast<ReturnType*>(uintptr_t(1)));
+		if constexpr (std::is_default_constructible_v<ReturnType>)
+		{
+			return ReturnType{};
+		}
+		else
+		{
+			std::terminate();
+		}
 	}
 
 	template<>
@@ -60,6 +88,8 @@ template<typename = void(), uint32_t = PLATFORM_CACHE_LINE_SIZE>
 class TTaskDelegate;
 
 
+// a type-erased callable stored inline in TotalSize bytes. callables that don't fit (or need a bigger alignment) are moved to
+// a block from FTaskAllocator and only the pointer is stored inline
 template<uint32_t TotalSize, typename ReturnType, typename... ParamTypes>
 class TTaskDelegate<ReturnType(ParamTypes...), TotalSize>
 {
@@ -87,6 +117,14 @@ class TTaskDelegate<ReturnType(ParamTypes...), TotalSize>
 		};
 	};
 
+public:
+	static constexpr uint32_t InlineStorageSize = TotalSize - sizeof(TTaskDelegateBase);
+	static_assert(TotalSize > sizeof(TTaskDelegateBase) + sizeof(void*), "the inline storage must at least hold the pointer to a heap allocated callable");
+
+	template<typename TCallableType>
+	static constexpr bool IsInline = sizeof(TCallableType) <= InlineStorageSize && alignof(TCallableType) <= alignof(TTaskDelegateBase);
+
+private:
 	struct TTaskDelegateDummy final : TTaskDelegateBase
 	{
 		void Move(TTaskDelegateBase&, void*, void*, uint32_t) override
@@ -108,38 +146,82 @@ class TTaskDelegate<ReturnType(ParamTypes...), TotalSize>
 		}
 
 	};
-	template<typename TCallableType>
+
+	// passed when a heap allocated callable changes hands, only the pointer moves
+	struct FTakeOwnership
+	{
+	};
+
+	template<typename TCallableType, bool bHeapAllocated = false>
 	struct TTaskDelegateImpl : public TTaskDelegateBase
 	{
+		static_assert(!bHeapAllocated || alignof(TCallableType) <= PLATFORM_CACHE_LINE_SIZE, "FTaskAllocator blocks are aligned to the cache line size");
+
 		template<typename CallableT>
 		TTaskDelegateImpl(CallableT&& Callable, void* InlineData)
 		{
-			new (InlineData) TCallableType(std::forward<CallableT>(Callable));
+			if constexpr (bHeapAllocated)
+			{
+				void* Memory = FTaskAllocator::Get().Allocate(sizeof(TCallableType));
+				*reinterpret_cast<TCallableType**>(InlineData) = new (Memory) TCallableType(std::forward<CallableT>(Callable));
+			}
+			else
+			{
+				new (InlineData) TCallableType(std::forward<CallableT>(Callable));
+			}
+		}
+
+		TTaskDelegateImpl(FTakeOwnership, TCallableType* HeapCallable, void* InlineData)
+		{
+			static_assert(bHeapAllocated);
+			*reinterpret_cast<TCallableType**>(InlineData) = HeapCallable;
+		}
+
+		static TCallableType* GetCallable(void* InlineData)
+		{
+			if constexpr (bHeapAllocated)
+			{
+				return *reinterpret_cast<TCallableType**>(InlineData);
+			}
+			else
+			{
+				return reinterpret_cast<TCallableType*>(InlineData);
+			}
 		}
 
 		void Destroy(void* InlineData) override
 		{
-			TCallableType* LocalPtr = reinterpret_cast<TCallableType*>(InlineData);
+			TCallableType* LocalPtr = GetCallable(InlineData);
 			LocalPtr->~TCallableType();
+			if constexpr (bHeapAllocated)
+			{
+				FTaskAllocator::Get().Free(LocalPtr, sizeof(TCallableType));
+			}
 		}
 
 		inline void Move(TTaskDelegateBase& DstWrapper, void* DstData, void* SrcData, uint32_t DestInlineSize) override
 		{
-			TCallableType* SrcPtr = reinterpret_cast<TCallableType*>(SrcData);
-			if ((sizeof(TCallableType) <= DestInlineSize) && (uintptr_t(DstData) % alignof(TCallableType)) == 0)
+			TCallableType* SrcPtr = GetCallable(SrcData);
+			if constexpr (bHeapAllocated)
+			{
+				new (&DstWrapper) TTaskDelegateImpl<TCallableType, true>(FTakeOwnership{}, SrcPtr, DstData);
+			}
+			else if ((sizeof(TCallableType) <= DestInlineSize) && (uintptr_t(DstData) % alignof(TCallableType)) == 0)
 			{
 				new (&DstWrapper) TTaskDelegateImpl<TCallableType>(std::move(*SrcPtr), DstData);
+				SrcPtr->~TCallableType();
+			}
+			else
+			{
+				new (&DstWrapper) TTaskDelegateImpl<TCallableType, true>(std::move(*SrcPtr), DstData);
+				SrcPtr->~TCallableType();
 			}
-			//else
-			//{
-			//	new (&DstWrapper) TTaskDelegateImpl<TCallableType, true>(MoveTemp(*SrcPtr), DstData);
-			//}
 			new (this) TTaskDelegateDummy();
 		}
 
 		ReturnType Call(void* InlineData, ParamTypes... Params) const override
 		{
-			TCallableType* LocalPtr = reinterpret_cast<TCallableType*>(InlineData);
+			TCallableType* LocalPtr = GetCallable(InlineData);
 			return (*LocalPtr)(Params...);
 		}
 
@@ -167,10 +249,7 @@ public:
 	TTaskDelegate(CallableT&& Callable)
 	{
 		using TCallableType = std::decay_t<CallableT>;
-		if constexpr ((sizeof(TCallableType) <= InlineStorageSize) && ((uintptr_t(InlineStorageSize) % alignof(TCallableType)) == 0))
-		{
-			new (&CallableWrapper) TTaskDelegateImpl<TCallableType>(std::forward<CallableT>(Callable), InlineStorage);
-		}
+		new (&CallableWrapper) TTaskDelegateImpl<TCallableType, !IsInline<TCallableType>>(std::forward<CallableT>(Callable), InlineStorage);
 	}
 	
 	template<typename CallableT>
@@ -178,14 +257,7 @@ public:
 	{
 		using TCallableType = std::decay_t<CallableT>;
 		GetWrapper()->Destroy(InlineStorage);
-		if constexpr ((sizeof(TCallableType) <= InlineStorageSize) && ((uintptr_t(InlineStorageSize) % alignof(TCallableType)) == 0))
-		{
-			new (&CallableWrapper) TTaskDelegateImpl<TCallableType>(std::forward<CallableT>(Callable), InlineStorage);
-		}
-		//else
-		//{
-		//	new (&CallableWrapper) TTaskDelegateImpl<TCallableType, true>(Forward<CallableT>(Callable), InlineStorage);
-		//}
+		new (&CallableWrapper) TTaskDelegateImpl<TCallableType, !IsInline<TCallableType>>(std::forward<CallableT>(Callable), InlineStorage);
 		return *this;
 	}
 
@@ -200,22 +272,53 @@ public:
 		return GetWrapper()->CallAndMove(Destination, InlineStorage, TTaskDelegate<ReturnType(ParamTypes...), DestTotalSize>::InlineStorageSize, Params...);
 	}
 
+	// the wrapper is placement-new'ed over CallableWrapper, launder so the compiler can't devirtualize calls to the base class
 	TTaskDelegateBase* GetWrapper()
 	{
-		return static_cast<TTaskDelegateBase*>(&CallableWrapper);
+		return std::launder(static_cast<TTaskDelegateBase*>(&CallableWrapper));
 	}
 
 	const TTaskDelegateBase* GetWrapper() const
 	{
-		return static_cast<const TTaskDelegateBase*>(&CallableWrapper);
+		return std::launder(static_cast<const TTaskDelegateBase*>(&CallableWrapper));
 	}
 
 	TTaskDelegateBase CallableWrapper;
-	static constexpr uint32_t InlineStorageSize = TotalSize - sizeof(TTaskDelegateBase);
 	mutable char InlineStorage[InlineStorageSize];
 };
 
-using FTaskDelegate = TTaskDelegate<FLowLevelTask* (), LOWLEVEL_TASK_SIZE - sizeof(uintptr_t) - sizeof(void*)>;
+// counts task bodies that went to the heap: delegates of raw FLowLevelTask users that didn't fit into its inline storage, and
+// Launch bodies that make their TExecutableTask too big for the slab allocator (FTaskAllocator::MaxBlockSize). there is one
+// counter per call site (per callable type), named after the debug name of the first task that used it
+class FTaskDelegateSpillCounter
+{
+public:
+	struct FEntry
+	{
+		const char* DebugName;
+		uint32_t CallableSize;
+		uint64_t NumSpills;
+	};
+
+	FTaskDelegateSpillCounter(const char* InDebugName, uint32_t InCallableSize);
+
+	void Increment()
+	{
+		NumSpills.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	static std::vector<FEntry> GetAll();
+
+private:
+	const char* DebugName;
+	uint32_t CallableSize;
+	std::atomic_uint64_t NumSpills{ 0 };
+	FTaskDelegateSpillCounter* Next = nullptr;
+
+	static std::atomic<FTaskDelegateSpillCounter*> First;
+};
+
+using FTaskDelegate = TTaskDelegate<FLowLevelTask* (), LOWLEVEL_TASK_SIZE - sizeof(uintptr_t) - sizeof(void*) - sizeof(int64_t)>;
 
 class FLowLevelTask
 {
@@ -233,15 +336,45 @@ public:
 	}
 
 	template<typename Runnable>
-	void Init(const char* InDebugName, Runnable&& InRunnable)
+	void Init(const char* InDebugName, ETaskPriority InPriority, Runnable&& InRunnable)
 	{
-		Delegate = [LocalRunnable = std::forward<Runnable>(InRunnable)]() mutable -> FLowLevelTask* {
-			LocalRunnable();
-			return nullptr;
+		// a runnable can return the continuation, the task to execute next on the same thread
+		auto Callable = [LocalRunnable = std::forward<Runnable>(InRunnable)]() mutable -> FLowLevelTask* {
+			if constexpr (std::is_same_v<decltype(LocalRunnable()), FLowLevelTask*>)
+			{
+				return LocalRunnable();
+			}
+			else
+			{
+				LocalRunnable();
+				return nullptr;
+			}
 		};
+		if constexpr (!FTaskDelegate::IsInline<decltype(Callable)>)
+		{
+			static FTaskDelegateSpillCounter SpillCounter(InDebugName, sizeof(Callable));
+			SpillCounter.Increment();
+		}
+		Delegate = std::move(Callable);
+
+		FPackedData LocalPackedData{ 0 };
+		LocalPackedData.State = ETaskState::Ready;
+		LocalPackedData.DebugName = uintptr_t(InDebugName);
+		assert(uintptr_t(LocalPackedData.DebugName) == uintptr_t(InDebugName));
+		LocalPackedData.Priority = uintptr_t(InPriority);
+		PackedData.store(LocalPackedData.PackedData, std::memory_order_release);
+	}
 
-		DebugName = InDebugName;
-		PackedData.store(ETaskState::Ready, std::memory_order_release);
+	ETaskPriority GetPriority() const
+	{
+		FPackedData LocalPackedData{ PackedData.load(std::memory_order_relaxed) };
+		return ETaskPriority(LocalPackedData.Priority);
+	}
+
+	const char* GetDebugName() const
+	{
+		FPackedData LocalPackedData{ PackedData.load(std::memory_order_relaxed) };
+		return reinterpret_cast<const char*>(uintptr_t(LocalPackedData.DebugName));
 	}
 
 	bool TryPrepareLaunch()
@@ -263,11 +396,27 @@ private:
 			uintptr_t Flags : 2;
 		};
 	};
-
-	const char* DebugName = nullptr;
+	static_assert(uintptr_t(ETaskPriority::Count) <= 8, "ETaskPriority must fit into FPackedData::Priority");
+
+	template<typename>
+	friend class FIntrusiveQueue;
+	// for batches linked through NextInQueue, see FScheduler::TryLaunchBatch
+	template<typename>
+	friend class FOverflowQueue;
+	template<typename, uint32_t>
+	friend class FBoundedQueue;
+	friend class FScheduler;
+	friend class FLaunchBatch;
+
+	// link of the intrusive scheduler queues, only valid while the task is queued in one
+	FLowLevelTask* NextInQueue = nullptr;
 	FTaskDelegate Delegate;
+	// set by the scheduler for the launches it times, see FSchedulerConfig::MetricsSampleInterval
+	int64_t LaunchTimeNs = 0;
+	// the debug name is packed in as well (user space addresses fit into 53 bits), which leaves room for NextInQueue
 	std::atomic<uintptr_t> PackedData;
 };
+static_assert(sizeof(FLowLevelTask) <= LOWLEVEL_TASK_SIZE, "FLowLevelTask must fit into LOWLEVEL_TASK_SIZE");
 
 template<typename Type, void (Type::*DeleteFunction)()>
 class TDeleter
@@ -287,31 +436,235 @@ public:
 	}
 };
 
+// append-only lock-free list of task pointers used for task dependencies. the first NumInlineItems live inside the list so the
+// common case of a few edges doesn't allocate, the rest go to overflow chunks that double in size. a push reserves a slot with a
+// CAS on State and then fills it, consumers claim a range of reserved slots and wait for the (few instructions long) fill if needed.
+// the list can be closed, pushes fail after that
+template<typename T, uint32_t NumInlineItems>
+class TTaskList
+{
+	static constexpr uint32_t ClosedFlag = 0x80000000;
+	// ConsumeState packs the number of consumed items and the number of threads in ForEachUnconsumed into one word, so a list
+	// takes 8 bytes besides its slots
+	static constexpr uint32_t NumConsumedBits = 24;
+	static constexpr uint32_t ConsumedMask = (1u << NumConsumedBits) - 1;
+	static constexpr uint32_t OneVisitor = 1u << NumConsumedBits;
+
+	struct FChunk
+	{
+		explicit FChunk(uint32_t InCapacity)
+			: Items(new std::atomic<T*>[InCapacity]())
+		{
+		}
+
+		std::atomic<FChunk*> Next{ nullptr };
+		std::unique_ptr<std::atomic<T*>[]> Items;
+	};
+
+public:
+	TTaskList() = default;
+	TTaskList(const TTaskList&) = delete;
+	TTaskList& operator=(const TTaskList&) = delete;
+
+	~TTaskList()
+	{
+		FChunk* Chunk = Overflow.load(std::memory_order_relaxed);
+		while (Chunk != nullptr)
+		{
+			FChunk* Next = Chunk->Next.load(std::memory_order_relaxed);
+			delete Chunk;
+			Chunk = Next;
+		}
+	}
+
+	// failing is acquire: whoever pushed into a closed list synchronizes with what was done before closing it, e.g. a task
+	// that didn't become a subsequent sees the results of its completed prerequisite
+	bool PushIfNotClosed(T* Item)
+	{
+		uint32_t LocalState = State.load(std::memory_order_acquire);
+		do
+		{
+			if ((LocalState & ClosedFlag) != 0)
+			{
+				return false;
+			}
+		} while (!State.compare_exchange_weak(LocalState, LocalState + 1, std::memory_order_acq_rel, std::memory_order_acquire));
+
+		GetSlot(LocalState, true).store(Item, std::memory_order_release);
+		return true;
+	}
+
+	// calls Func for every item that was pushed and not consumed yet. can run concurrently with pushes and other consumers,
+	// every item is consumed exactly once. an item is handed over only when no thread is in ForEachUnconsumed, Func can free it
+	template<typename FuncType>
+	void ConsumeAll(FuncType&& Func)
+	{
+		uint32_t End = State.load(std::memory_order_acquire) & ~ClosedFlag;
+		assert(End <= ConsumedMask);
+		uint32_t LocalConsumeState = ConsumeState.load(std::memory_order_relaxed);
+		do
+		{
+			if ((LocalConsumeState & ConsumedMask) >= End)
+			{
+				return;
+			}
+		} while (!ConsumeState.compare_exchange_weak(LocalConsumeState, (LocalConsumeState & ~ConsumedMask) | End, std::memory_order_seq_cst, std::memory_order_relaxed));
+
+		auto WaitForVisitors = [this, &Func](T* Item)
+		{
+			// a visitor may have read the item before it was claimed and not be done with it yet
+			while ((ConsumeState.load(std::memory_order_seq_cst) & ~ConsumedMask) != 0)
+			{
+				std::this_thread::yield();
+			}
+			Func(Item);
+		};
+		ForEach(LocalConsumeState & ConsumedMask, End, WaitForVisitors);
+	}
+
+	// calls Func for every item that was pushed and not consumed yet without consuming it. the items stay alive until Func returns,
+	// ConsumeAll waits for that. returns false without calling Func if too many threads are visiting the list already
+	template<typename FuncType>
+	bool ForEachUnconsumed(FuncType&& Func)
+	{
+		// seq_cst pairs with the claim in ConsumeAll: either it sees the visitor, or the visitor doesn't see the claimed items
+		uint32_t LocalConsumeState = ConsumeState.load(std::memory_order_relaxed);
+		do
+		{
+			if ((LocalConsumeState & ~ConsumedMask) == ~ConsumedMask)
+			{
+				return false;
+			}
+		} while (!ConsumeState.compare_exchange_weak(LocalConsumeState, LocalConsumeState + OneVisitor, std::memory_order_seq_cst, std::memory_order_relaxed));
+
+		uint32_t Begin = LocalConsumeState & ConsumedMask;
+		uint32_t End = State.load(std::memory_order_seq_cst) & ~ClosedFlag;
+		if (Begin < End)
+		{
+			ForEach(Begin, End, Func);
+		}
+		ConsumeState.fetch_sub(OneVisitor, std::memory_order_release);
+		return true;
+	}
+
+	// closes the list and calls Func for every item, consumed or not. pushes that lost the race with closing fail
+	template<typename FuncType>
+	void Close(FuncType&& Func)
+	{
+		uint32_t PrevState = State.fetch_or(ClosedFlag, std::memory_order_seq_cst);
+		assert((PrevState & ClosedFlag) == 0);
+		ForEach(0, PrevState, Func);
+	}
+
+	bool IsClosed() const
+	{
+		return (State.load(std::memory_order_seq_cst) & ClosedFlag) != 0;
+	}
+
+private:
+	template<typename FuncType>
+	void ForEach(uint32_t Begin, uint32_t End, FuncType& Func)
+	{
+		for (uint32_t Index = Begin; Index != End; Index += 1)
+		{
+			std::atomic<T*>& Slot = GetSlot(Index, false);
+			T* Item = Slot.load(std::memory_order_acquire);
+			while (Item == nullptr)
+			{
+				// the slot is reserved but the pusher hasn't filled it yet
+				std::this_thread::yield();
+				Item = Slot.load(std::memory_order_acquire);
+			}
+			Func(Item);
+		}
+	}
+
+	std::atomic<T*>& GetSlot(uint32_t Index, bool bAllocate)
+	{
+		if (Index < NumInlineItems)
+		{
+			return InlineItems[Index];
+		}
+
+		Index -= NumInlineItems;
+		uint32_t Capacity = NumInlineItems * 2;
+		std::atomic<FChunk*>* Link = &Overflow;
+		while (true)
+		{
+			FChunk* Chunk = Link->load(std::memory_order_acquire);
+			while (Chunk == nullptr)
+			{
+				if (bAllocate)
+				{
+					FChunk* NewChunk = new FChunk(Capacity);
+					if (Link->compare_exchange_strong(Chunk, NewChunk, std::memory_order_acq_rel, std::memory_order_acquire))
+					{
+						Chunk = NewChunk;
+					}
+					else
+					{
+						delete NewChunk;
+					}
+				}
+				else
+				{
+					// the pusher that reserved a slot in this chunk is about to link it
+					std::this_thread::yield();
+					Chunk = Link->load(std::memory_order_acquire);
+				}
+			}
+
+			if (Index < Capacity)
+			{
+				return Chunk->Items[Index];
+			}
+			Index -= Capacity;
+			Capacity *= 2;
+			Link = &Chunk->Next;
+		}
+	}
+
+	// number of reserved slots and ClosedFlag
+	std::atomic_uint32_t State{ 0 };
+	// number of consumed slots and of visitors, see NumConsumedBits
+	std::atomic_uint32_t ConsumeState{ 0 };
+	std::atomic<T*> InlineItems[NumInlineItems] = {};
+	std::atomic<FChunk*> Overflow{ nullptr };
+};
+
+// the fields are grouped by the threads that write them, each group on a cache line of its own so that a thread unlocking the task
+// doesn't invalidate the line of a thread adding a subsequent or the worker executing it, see the static_assert below the class
 class FTask
 {
+	// a task with up to 4 prerequisites and 4 subsequents doesn't allocate, more go to overflow chunks
+	static constexpr uint32_t NumInlineEdges = 4;
+
 	// Ⱦ
 	class FPrerequisites
 	{
 	public:
 		void Push(FTask* Prerequisite)
 		{
-			std::lock_guard guard(mtx);
-			Prerequisites.push_back(Prerequisite);
+			bool bPushed = Prerequisites.PushIfNotClosed(Prerequisite);
+			assert(bPushed);
 		}
 
-		void PushNoLock(FTask* Prerequisite)
+		// the list holds a reference to every prerequisite, it's handed over once no visitor can be adding its own
+		template<typename FuncType>
+		void PopAll(FuncType&& Func)
 		{
-			Prerequisites.push_back(Prerequisite);
+			Prerequisites.ConsumeAll(std::forward<FuncType>(Func));
 		}
 
-		std::vector<FTask*> PopAll()
+		// calls Func for every prerequisite that wasn't popped yet without popping it. they stay alive until Func returns, PopAll
+		// waits for that. returns false if the prerequisites couldn't be visited
+		template<typename FuncType>
+		bool Visit(FuncType&& Func)
 		{
-			std::lock_guard guard(mtx);
-			return std::move(Prerequisites);
+			return Prerequisites.ForEachUnconsumed(std::forward<FuncType>(Func));
 		}
 	private:
-		std::mutex mtx;
-		std::vector<FTask*> Prerequisites;
+		TTaskList<FTask, NumInlineEdges> Prerequisites;
 	};
 
 	// 
@@ -320,32 +673,18 @@ class FTask
 	public:
 		bool PushIfNotClosed(FTask* NewTask)
 		{
-			if (bIsClosed.load(std::memory_order_relaxed))
-			{
-				return false;
-			}
-			std::lock_guard guard(mtx);
-			if (bIsClosed)
-			{
-				return false;
-			}
-
-			Subsequents.push_back(NewTask);
-			return true;
+			return Subsequents.PushIfNotClosed(NewTask);
 		}
 
-		std::vector<FTask*> Close()
+		template<typename FuncType>
+		void Close(FuncType&& Func)
 		{
-			std::lock_guard guard(mtx);
-			bIsClosed.store(true, std::memory_order_seq_cst);
-			return std::move(Subsequents);
+			Subsequents.Close(std::forward<FuncType>(Func));
 		}
 
-		bool IsClosed() const { return bIsClosed; }
+		bool IsClosed() const { return Subsequents.IsClosed(); }
 	private:
-		std::atomic_bool bIsClosed{ false };
-		std::mutex mtx;
-		std::vector<FTask*> Subsequents;
+		TTaskList<FTask, NumInlineEdges> Subsequents;
 	};
 
 public:
@@ -356,9 +695,31 @@ public:
 	{
 
 	}
-	~FTask() { assert(IsCompleted()); }
+	// virtual so that deleting through FTask* destroys the task body and passes the full object size to operator delete
+	virtual ~FTask() { assert(IsCompleted()); }
+
+	// tasks come from the slab allocator, see FTaskAllocator
+	static void* operator new(size_t Size)
+	{
+		return FTaskAllocator::Get().Allocate(Size);
+	}
+
+	static void operator delete(void* Ptr, size_t Size)
+	{
+		FTaskAllocator::Get().Free(Ptr, Size);
+	}
+
+	void Init(const char* DebugName, ETaskPriority InPriority, EExtendedTaskPriority InExtendedTaskPriority);
+
+	ETaskPriority GetPriority() const
+	{
+		return LowLevelTask.GetPriority();
+	}
 
-	void Init(const char* DebugName, EExtendedTaskPriority InExtendedTaskPriority);
+	const char* GetDebugName() const
+	{
+		return LowLevelTask.GetDebugName();
+	}
 
 	bool TrySetExecutionFlag()
 	{
@@ -366,16 +727,25 @@ public:
 		return NumLocks.compare_exchange_strong(ExpectedUnlocked, ExecutionFlag + 1, std::memory_order_acq_rel, std::memory_order_relaxed);
 	}
 
-	bool TryExecuteTask();
+	// OutContinuation, if given, receives a subsequent that got unlocked by the completion of the task and wasn't scheduled so
+	// that the calling worker runs it right away, see Close
+	bool TryExecuteTask(FLowLevelTask** OutContinuation = nullptr);
 	// 
 	bool IsCompleted() const
 	{
 		return Subsequents.IsClosed();
 	}
 
+	// the task's cancellation token was canceled before its body returned (the body was skipped or may have been cut short), or
+	// one of its prerequisites was canceled and the body was skipped. only meaningful once the task is completed
+	bool IsCanceled() const
+	{
+		return bCanceled.load(std::memory_order_relaxed);
+	}
+
 	bool IsAwaitable() const
 	{
-		return std::this_thread::get_id() != ExecutingThreadId.load(std::memory_order_relaxed);
+		return GetThreadOrdinal() != ExecutingThread.load(std::memory_order_relaxed);
 	}
 
 	// ͬpipeᰴ˳ִУҪͬһ߳
@@ -410,8 +780,11 @@ public:
 		}
 	}
 
-	// ִTaskTaskڵǰɣôݹִǰ
-	bool TryRetractAndExecute(FTimeout Timeout, uint32_t RecursionDepth = 0);
+	// ִTaskTaskڵǰɣôִǰnestedҲһ
+	// walks the dependency graph depth first with an explicit stack so long chains don't overflow the thread's stack. edges aren't
+	// consumed, a failed attempt (e.g. a prerequisite is running on another thread) can be repeated later. returns whether the task
+	// is completed
+	bool TryRetractAndExecute(FTimeout Timeout);
 
 	uint32_t GetRefCount()const { return RefCount.load(std::memory_order_relaxed); }
 
@@ -439,48 +812,86 @@ public:
 	{
 		return Subsequents.PushIfNotClosed(&Subsequent);
 	}
+protected:
+	void SetCanceled()
+	{
+		bCanceled.store(true, std::memory_order_relaxed);
+	}
+
 private:
 	bool WaitImpl(FTimeout Timeout);
+	// the walk behind TryRetractAndExecute. with HelpLowestPriority set it also helps with the nested tasks of the tasks in the
+	// graph that were started elsewhere, up to that priority (see EWaitHelpPolicy). returns whether it executed anything
+	bool RetractGraph(FTimeout Timeout, std::optional<ETaskPriority> HelpLowestPriority);
+
+	// threads blocked in Wait park on an event picked by hashing the task's address, Close notifies it. the events are shared
+	// and never freed, so notifying one can't race with the task being deleted by a waiter that woke up on its own
+	FEventCount& GetWaitEvent() const;
+	void WakeUpWaiters() const;
 
 	void ReleaseInternalReference()
 	{
 		LowLevelTask.TryCancel();
 	}
 
-	bool TryUnlock(bool& bWakeUpWorker);
+	bool TryUnlock(bool& bWakeUpWorker, FLowLevelTask** OutContinuation = nullptr);
 
-	void Schedule(bool& bWakeUpWorker);
+	void Schedule(bool& bWakeUpWorker, FLowLevelTask** OutContinuation);
 
 	// unlockͬʱflagΪ̬
-	void Close()
+	// with OutContinuation the first unlocked subsequent the calling worker is allowed to run and that isn't less urgent than this
+	// task is handed back instead of scheduled: a chain of tasks runs back-to-back on one worker without a queue round trip
+	void Close(FLowLevelTask** OutContinuation = nullptr)
 	{
 		assert(!IsCompleted());
 
-		bool bWakeUpWorker = false;
-		for (FTask* Subsequent : Subsequents.Close())
-		{
-			Subsequent->TryUnlock(bWakeUpWorker);
-		}
-
+		// done with the pipe before the task becomes completed, a waiter may destroy the pipe as soon as it sees the completion
 		if (GetPipe() != nullptr)
 		{
 			ClearPipe();
 		}
+
+		bool bWakeUpWorker = false;
+		bool bLocalCanceled = IsCanceled();
+		Subsequents.Close([this, &bWakeUpWorker, OutContinuation, bLocalCanceled](FTask* Subsequent)
+		{
+			// what depends on a canceled task is canceled too, except a parent that already ran and only waits for its nested tasks
+			// and the next task of the pipe, which is only ordered after this one. the flag is published by the unlock below
+			if (bLocalCanceled && Subsequent->IsLockedByPrerequisites() && (GetPipe() == nullptr || Subsequent->GetPipe() != GetPipe()))
+			{
+				Subsequent->SetCanceled();
+			}
+			bool bMayContinue = OutContinuation != nullptr && *OutContinuation == nullptr && Subsequent->GetPriority() <= GetPriority();
+			Subsequent->TryUnlock(bWakeUpWorker, bMayContinue ? OutContinuation : nullptr);
+		});
+		WakeUpWaiters();
+
 		ReleasePrerequisites();
 	}
 
 	void ClearPipe();
 
+	// the task hasn't passed "pre-scheduling" state yet: not all prerequisites are completed. the order doesn't matter as this
+	// "happens before" task execution
+	bool IsLockedByPrerequisites() const
+	{
+		uint32_t LocalNumLocks = NumLocks.load(std::memory_order_relaxed);
+		return LocalNumLocks != 0 && LocalNumLocks < ExecutionFlag;
+	}
+
 	void ReleasePrerequisites()
     	{
-		for (FTask* Prerequisite : Prerequisites.PopAll())
+		Prerequisites.PopAll([](FTask* Prerequisite)
 		{
 			Prerequisite->Release();
-		}
+		});
 	}
 
 	static thread_local FTask* CurrentTask;
 
+	// a small id of the calling thread, never 0. std::thread::id doesn't fit on the first line next to NumLocks
+	static uint32_t GetThreadOrdinal();
+
 	FTask* ExchangeCurrentTask(FTask* Task)
 	{
 		FTask* PrevTask = CurrentTask;
@@ -492,62 +903,247 @@ private:
 
 	
 private:
-	std::atomic_uint32_t RefCount{ 0 };
-
 	// λNumLocksﱣδprerequistitesδɵnested
 	static constexpr uint32_t ExecutionFlag = 0x80000000;
 
 	static constexpr uint32_t NumInitialLocks = 1;  // ĬΪ1˵launchǰִܴ
+
+	// first line, with the vtable pointer: what the task waits for. written while prerequisites are added, by the threads that
+	// complete them and by the worker that starts executing the task
 	std::atomic_uint32_t NumLocks{ NumInitialLocks };
+	// GetThreadOrdinal of the thread executing the task, 0 if none
+	std::atomic_uint32_t ExecutingThread{ 0 };
+	FPrerequisites Prerequisites;
 
+	// second line: what waits for the task. written by the threads that add subsequents or references and by the one completing
+	// the task, read by waiters
+	alignas(PLATFORM_CACHE_LINE_SIZE) FSubsequents Subsequents;
+	std::atomic_uint32_t RefCount{ 0 };
+	EExtendedTaskPriority ExtendedTaskPriority = EExtendedTaskPriority::None;
+	// set by a canceled prerequisite before it unlocks the task, or by the executing thread, see IsCanceled
+	std::atomic<bool> bCanceled{ false };
 	FPipe* Pipe{ nullptr };
 
-	FPrerequisites Prerequisites;
-	FSubsequents Subsequents;
-	FLowLevelTask LowLevelTask;
+	// third line: the scheduler's, written by queues and the executing worker
+	alignas(PLATFORM_CACHE_LINE_SIZE) FLowLevelTask LowLevelTask;
 
-	// ǰִе߳id
-	std::atomic<std::thread::id> ExecutingThreadId;
+	friend struct FTaskLayout;
+};
 
-	EExtendedTaskPriority ExtendedTaskPriority = EExtendedTaskPriority::None;
+// a group that outgrows its line pushes the next one over and the task takes an extra line. LowLevelTask takes LOWLEVEL_TASK_SIZE
+// bytes, task bodies and results start on the line after it
+struct FTaskLayout
+{
+	static_assert(LOWLEVEL_TASK_SIZE % PLATFORM_CACHE_LINE_SIZE == 0, "LOWLEVEL_TASK_SIZE must be a multiple of PLATFORM_CACHE_LINE_SIZE");
+	static_assert(alignof(FTask) == PLATFORM_CACHE_LINE_SIZE, "tasks must start on a cache line");
+	static_assert(sizeof(FTask) == 2 * PLATFORM_CACHE_LINE_SIZE + LOWLEVEL_TASK_SIZE, "every group of FTask fields must fit on its cache line");
+	static_assert(sizeof(FLowLevelTask) == LOWLEVEL_TASK_SIZE, "FLowLevelTask fills its lines");
+	static_assert(sizeof(FTask::FPrerequisites) + sizeof(void*) + 2 * sizeof(uint32_t) <= PLATFORM_CACHE_LINE_SIZE, "prerequisites share the first line with the vtable pointer, NumLocks and ExecutingThread");
 };
 
+// a flag shared by the tasks it's attached to. a task whose token is canceled by the time it's about to execute skips its body, is
+// completed as usual and cancels the tasks that depend on it. a body that is already running isn't interrupted, it can check
+// FCancellationTokenScope::IsCurrentWorkCanceled and return early, the task counts as canceled if the token was canceled before
+// the body returned. copies refer to the same token
+class FCancellationToken
+{
+public:
+	FCancellationToken()
+		: State(new FState())
+	{
+	}
 
-template<typename TaskBodyType>
-class TExecutableTask : public FTask
+	void Cancel()
+	{
+		State->bCanceled.store(true, std::memory_order_relaxed);
+	}
+
+	bool IsCanceled() const
+	{
+		return State->bCanceled.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct FState
+	{
+		std::atomic_uint32_t RefCount{ 0 };
+		std::atomic<bool> bCanceled{ false };
+
+		void AddRef()
+		{
+			RefCount.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		void Release()
+		{
+			if (RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				delete this;
+			}
+		}
+	};
+
+	TRefCountPtr<FState> State;
+};
+
+// tasks launched on this thread while the scope is alive get its token unless they're given one. the body of a task runs in a scope
+// of the task's token, so what it launches (nested tasks in particular) is canceled along with it. a scope of nullptr detaches
+// the tasks launched in it
+class FCancellationTokenScope
 {
 public:
-	TExecutableTask(const char* InDebugName, EExtendedTaskPriority InExtendedTaskPriority, TaskBodyType&& InTaskBody)
-		: FTask(2)
-		, TaskBody(std::move(InTaskBody))
+	explicit FCancellationTokenScope(const FCancellationToken* Token)
+		: PrevToken(CurrentToken)
+	{
+		CurrentToken = Token;
+	}
+
+	~FCancellationTokenScope()
+	{
+		CurrentToken = PrevToken;
+	}
+
+	FCancellationTokenScope(const FCancellationTokenScope&) = delete;
+	FCancellationTokenScope& operator=(const FCancellationTokenScope&) = delete;
+
+	static const FCancellationToken* GetCurrentToken()
+	{
+		return CurrentToken;
+	}
+
+	static bool IsCurrentWorkCanceled()
+	{
+		return CurrentToken != nullptr && CurrentToken->IsCanceled();
+	}
+
+private:
+	static thread_local const FCancellationToken* CurrentToken;
+
+	const FCancellationToken* PrevToken;
+};
+
+// a task whose body returns a value. the result is constructed in place inside the task object when the body returns and lives
+// as long as the task
+template<typename ResultType>
+class TTaskWithResult : public FTask
+{
+	static_assert(!std::is_reference_v<ResultType>, "task bodies must return by value");
+	static_assert(alignof(ResultType) <= PLATFORM_CACHE_LINE_SIZE, "tasks are allocated with cache line alignment");
+
+public:
+	explicit TTaskWithResult(uint32_t InitRefCount)
+		: FTask(InitRefCount)
+	{
+	}
+
+	virtual ~TTaskWithResult() override
+	{
+		if (bHasResult)
+		{
+			GetResult().~ResultType();
+		}
+	}
+
+	// only valid once the task is completed and if its body wasn't skipped, see FTask::IsCanceled
+	ResultType& GetResult()
 	{
-		Init(InDebugName, InExtendedTaskPriority);
+		assert(IsCompleted() && bHasResult);
+		return *std::launder(reinterpret_cast<ResultType*>(ResultStorage));
+	}
+
+protected:
+	template<typename TaskBodyType>
+	void ExecuteAndStoreResult(TaskBodyType& TaskBody)
+	{
+		// the returned prvalue initializes the storage directly, no temporary is moved or copied
+		new (ResultStorage) ResultType(TaskBody());
+		bHasResult = true;
+	}
+
+private:
+	alignas(ResultType) char ResultStorage[sizeof(ResultType)];
+	bool bHasResult = false;
+};
+
+template<typename TaskBodyType, typename ResultType = std::invoke_result_t<TaskBodyType&>>
+class TExecutableTask : public std::conditional_t<std::is_void_v<ResultType>, FTask, TTaskWithResult<ResultType>>
+{
+	using Super = std::conditional_t<std::is_void_v<ResultType>, FTask, TTaskWithResult<ResultType>>;
+
+public:
+	template<typename InTaskBodyType>
+	TExecutableTask(const char* InDebugName, ETaskPriority InPriority, EExtendedTaskPriority InExtendedTaskPriority, InTaskBodyType&& InTaskBody,
+		const FCancellationToken* InCancellationToken = FCancellationTokenScope::GetCurrentToken())
+		: Super(2)
+		, TaskBody(std::forward<InTaskBodyType>(InTaskBody))
+	{
+		// the body lives in the task object, FLowLevelTask's delegate only holds a trampoline back to the task
+		if constexpr (sizeof(TExecutableTask) > FTaskAllocator::MaxBlockSize)
+		{
+			static FTaskDelegateSpillCounter SpillCounter(InDebugName, sizeof(TaskBodyType));
+			SpillCounter.Increment();
+		}
+		if (InCancellationToken != nullptr)
+		{
+			CancellationToken.emplace(*InCancellationToken);
+		}
+		this->Init(InDebugName, InPriority, InExtendedTaskPriority);
 	}
 
 	virtual void ExecuteTask() override
 	{
-		TaskBody();
+		if (CancellationToken.has_value() && CancellationToken->IsCanceled())
+		{
+			this->SetCanceled();
+			return;
+		}
+
+		{
+			// also without a token: a task retracted by a waiting body mustn't hand the waiter's token to what it launches
+			FCancellationTokenScope Scope(CancellationToken.has_value() ? &*CancellationToken : nullptr);
+			if constexpr (std::is_void_v<ResultType>)
+			{
+				TaskBody();
+			}
+			else
+			{
+				this->ExecuteAndStoreResult(TaskBody);
+			}
+		}
+
+		// what the body launched may have been shed, what depends on its result is canceled as well
+		if (CancellationToken.has_value() && CancellationToken->IsCanceled())
+		{
+			this->SetCanceled();
+		}
 	}
 
 	TaskBodyType TaskBody;
+	std::optional<FCancellationToken> CancellationToken;
 };
 
+// the result type of a task launched with the given body
+template<typename TaskBodyType>
+using TTaskResult = std::invoke_result_t<std::decay_t<TaskBodyType>&>;
+
 class FTaskHandle
 {
 public:
 	FTaskHandle() = default;
 	template<typename TaskBodyType>
-	void Launch(const char* InDebugName, EExtendedTaskPriority InExtendedTaskPriority, TaskBodyType&& TaskBody)
+	void Launch(const char* InDebugName, ETaskPriority InPriority, EExtendedTaskPriority InExtendedTaskPriority, TaskBodyType&& TaskBody,
+		const FCancellationToken* CancellationToken = FCancellationTokenScope::GetCurrentToken())
 	{
-		TExecutableTask<TaskBodyType>* Task = new TExecutableTask(InDebugName, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
+		FTask* Task = new TExecutableTask<std::decay_t<TaskBodyType>>(InDebugName, InPriority, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody), CancellationToken);
 		*(Pimpl.GetInitReference()) = Task;
 		Task->TryLaunch();
 	}
 
 	template<typename TaskBodyType, typename PrerequisitesCollectionType>
-	void Launch(const char* InDebugName, PrerequisitesCollectionType&& Prereq, EExtendedTaskPriority InExtendedTaskPriority, TaskBodyType&& TaskBody)
+	void Launch(const char* InDebugName, PrerequisitesCollectionType&& Prereq, ETaskPriority InPriority, EExtendedTaskPriority InExtendedTaskPriority, TaskBodyType&& TaskBody,
+		const FCancellationToken* CancellationToken = FCancellationTokenScope::GetCurrentToken())
 	{
-		TExecutableTask<TaskBodyType>* Task = new TExecutableTask(InDebugName, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
+		FTask* Task = new TExecutableTask<std::decay_t<TaskBodyType>>(InDebugName, InPriority, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody), CancellationToken);
 		Task->AddPrerequisites(Prereq);
 		*(Pimpl.GetInitReference()) = Task;
 		Task->TryLaunch();
@@ -559,6 +1155,11 @@ public:
 	{
 		return !IsValid() || Pimpl->IsCompleted();
 	}
+	// whether the completed task was canceled, see FTask::IsCanceled
+	bool IsCanceled() const
+	{
+		return IsValid() && Pimpl->IsCanceled();
+	}
 	bool Wait(std::chrono::system_clock::duration duration)
 	{
 		return !IsValid() || Pimpl->Wait(FTimeout{ duration });
@@ -583,7 +1184,34 @@ public:
 template<typename ResultType>
 class TTask : public FTaskHandle
 {
+public:
+	TTask() = default;
+
+	explicit TTask(FTask* Other)
+		: FTaskHandle(Other)
+	{
+	}
+
+	// waits for the task like Wait() does (retracting it if possible) and returns its result. the result stays in the task,
+	// move from the returned reference to take it over without a copy
+	ResultType& GetResult()
+	{
+		assert(IsValid());
+		Wait();
+		return static_cast<TTaskWithResult<ResultType>*>(Pimpl.GetReference())->GetResult();
+	}
+};
+
+template<>
+class TTask<void> : public FTaskHandle
+{
+public:
+	TTask() = default;
 
+	explicit TTask(FTask* Other)
+		: FTaskHandle(Other)
+	{
+	}
 };
 
 
@@ -596,7 +1224,7 @@ private:
 	FTaskEventBase(const char* DebugName)
 		: FTask(1)
 	{
-		Init(DebugName, EExtendedTaskPriority::TaskEvent);
+		Init(DebugName, ETaskPriority::Normal, EExtendedTaskPriority::TaskEvent);
 	}
 
 	virtual void ExecuteTask() override final
@@ -632,21 +1260,103 @@ public:
 	}
 };
 template<typename TaskBodyType>
-FTaskHandle Launch(const char* InDebugName, TaskBodyType&& TaskBody, EExtendedTaskPriority InExtendedTaskPriority = EExtendedTaskPriority::None)
+TTask<TTaskResult<TaskBodyType>> Launch(const char* InDebugName, TaskBodyType&& TaskBody, ETaskPriority InPriority = ETaskPriority::Default, EExtendedTaskPriority InExtendedTaskPriority = EExtendedTaskPriority::None)
 {
-	FTaskHandle Handle;
-	Handle.Launch(InDebugName, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
+	TTask<TTaskResult<TaskBodyType>> Handle;
+	Handle.Launch(InDebugName, InPriority, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
 	return Handle;
 }
 
-template<typename TaskBodyType, typename PrerequisitesCollectionType>
-FTaskHandle Launch(const char* InDebugName, TaskBodyType&& TaskBody, PrerequisitesCollectionType&& Prerequisites, EExtendedTaskPriority InExtendedTaskPriority = EExtendedTaskPriority::None)
+template<typename TaskBodyType, typename PrerequisitesCollectionType, decltype(std::declval<PrerequisitesCollectionType>().Pimpl)* = nullptr>
+TTask<TTaskResult<TaskBodyType>> Launch(const char* InDebugName, TaskBodyType&& TaskBody, PrerequisitesCollectionType&& Prerequisites, ETaskPriority InPriority = ETaskPriority::Default, EExtendedTaskPriority InExtendedTaskPriority = EExtendedTaskPriority::None)
 {
-	FTaskHandle Handle;
-	Handle.Launch(InDebugName, Prerequisites, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
+	TTask<TTaskResult<TaskBodyType>> Handle;
+	Handle.Launch(InDebugName, Prerequisites, InPriority, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody));
 	return Handle;
 }
 
+// launches with the given cancellation token instead of the one of the current FCancellationTokenScope
+template<typename TaskBodyType>
+TTask<TTaskResult<TaskBodyType>> Launch(const char* InDebugName, TaskBodyType&& TaskBody, const FCancellationToken& CancellationToken, ETaskPriority InPriority = ETaskPriority::Default, EExtendedTaskPriority InExtendedTaskPriority = EExtendedTaskPriority::None)
+{
+	TTask<TTaskResult<TaskBodyType>> Handle;
+	Handle.Launch(InDebugName, InPriority, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody), &CancellationToken);
+	return Handle;
+}
+
+template<typename TaskBodyType, typename PrerequisitesCollectionType, decltype(std::declval<PrerequisitesCollectionType>().Pimpl)* = nullptr>
+TTask<TTaskResult<TaskBodyType>> Launch(const char* InDebugName, TaskBodyType&& TaskBody, PrerequisitesCollectionType&& Prerequisites, const FCancellationToken& CancellationToken, ETaskPriority InPriority = ETaskPriority::Default, EExtendedTaskPriority InExtendedTaskPriority = EExtendedTaskPriority::None)
+{
+	TTask<TTaskResult<TaskBodyType>> Handle;
+	Handle.Launch(InDebugName, Prerequisites, InPriority, InExtendedTaskPriority, std::forward<TaskBodyType>(TaskBody), &CancellationToken);
+	return Handle;
+}
+
+// while alive, tasks that get ready to be scheduled on this thread are collected instead of queued one at a time, and handed to
+// the scheduler together when it goes out of scope: one queue operation per priority and a single wake-up for as many workers as
+// needed. Wait retracts a collected task as usual, but nothing else must block on what collected tasks do before the batch ends.
+// batches nest, the outermost one launches
+class FLaunchBatch
+{
+public:
+	FLaunchBatch();
+	~FLaunchBatch();
+	FLaunchBatch(const FLaunchBatch&) = delete;
+	FLaunchBatch& operator=(const FLaunchBatch&) = delete;
+
+	// the batch tasks scheduled on this thread go to, nullptr if none
+	static FLaunchBatch* GetCurrent()
+	{
+		return Current;
+	}
+
+	// a collected task isn't queued anywhere yet, so its queue link is free until the batch ends
+	void Add(FLowLevelTask* Task)
+	{
+		Task->NextInQueue = nullptr;
+		if (Newest != nullptr)
+		{
+			Newest->NextInQueue = Task;
+		}
+		else
+		{
+			Oldest = Task;
+		}
+		Newest = Task;
+	}
+
+private:
+	static thread_local FLaunchBatch* Current;
+
+	bool bOutermost;
+	// the collected tasks linked through NextInQueue from the oldest one to the newest one, collecting doesn't allocate
+	FLowLevelTask* Oldest = nullptr;
+	FLowLevelTask* Newest = nullptr;
+};
+
+// fan-out of Num tasks running TaskBody(Index) with a single launch, see FLaunchBatch
+template<typename TaskBodyType>
+std::vector<TTask<std::invoke_result_t<std::decay_t<TaskBodyType>&, uint32_t>>> LaunchBatch(const char* InDebugName, uint32_t Num, TaskBodyType&& TaskBody, ETaskPriority InPriority = ETaskPriority::Default)
+{
+	std::vector<TTask<std::invoke_result_t<std::decay_t<TaskBodyType>&, uint32_t>>> Tasks;
+	Tasks.reserve(Num);
+	FLaunchBatch Batch;
+	auto LaunchOne = [&Tasks, InDebugName, InPriority](uint32_t Index, auto&& Body)
+	{
+		Tasks.push_back(Launch(InDebugName, [Body = std::forward<decltype(Body)>(Body), Index]() mutable { return Body(Index); }, InPriority));
+	};
+	// every task needs a body of its own, the last one takes over TaskBody if it's an rvalue
+	for (uint32_t Index = 0; Index + 1 < Num; Index += 1)
+	{
+		LaunchOne(Index, TaskBody);
+	}
+	if (Num != 0)
+	{
+		LaunchOne(Num - 1, std::forward<TaskBodyType>(TaskBody));
+	}
+	return Tasks;
+}
+
 template<typename TaskType>
 void AddNested(const TaskType& Nested)
 {
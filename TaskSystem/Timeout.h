@@ -48,7 +48,7 @@ public:
 		}
 
 		int64_t RemainingMsecs = std::chrono::duration_cast<std::chrono::milliseconds>(GetRemainingTime()).count();
-		int64_t RemainingMsecsClamped = std::max(0ll, std::min(RemainingMsecs, (int64_t)std::numeric_limits<uint32_t>::max()));
+		int64_t RemainingMsecsClamped = std::max((int64_t)0, std::min(RemainingMsecs, (int64_t)std::numeric_limits<uint32_t>::max()));
 		return (uint32_t)RemainingMsecsClamped;
 	}
 
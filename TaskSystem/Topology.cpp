@@ -0,0 +1,187 @@
+#include "Topology.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <cctype>
+
+static bool ReadFile(const std::string& Path, std::string& OutContent)
+{
+	std::ifstream File(Path);
+	if (!File)
+	{
+		return false;
+	}
+	std::getline(File, OutContent);
+	return true;
+}
+
+static uint32_t ReadUInt(const std::string& Path, uint32_t Default)
+{
+	std::string Content;
+	if (!ReadFile(Path, Content) || Content.empty())
+	{
+		return Default;
+	}
+	return uint32_t(std::stoul(Content));
+}
+
+const FCpuTopology& FCpuTopology::Get()
+{
+	static FCpuTopology Topology = Read();
+	return Topology;
+}
+
+std::vector<uint32_t> FCpuTopology::ParseCpuList(const std::string& List)
+{
+	std::vector<uint32_t> Result;
+	std::stringstream Stream(List);
+	std::string Range;
+	while (std::getline(Stream, Range, ','))
+	{
+		if (Range.empty() || !isdigit((unsigned char)Range[0]))
+		{
+			continue;
+		}
+		size_t Dash = Range.find('-');
+		uint32_t First = uint32_t(std::stoul(Range.substr(0, Dash)));
+		uint32_t Last = Dash == std::string::npos ? First : uint32_t(std::stoul(Range.substr(Dash + 1)));
+		for (uint32_t Cpu = First; Cpu <= Last; Cpu += 1)
+		{
+			Result.push_back(Cpu);
+		}
+	}
+	return Result;
+}
+
+FCpuTopology FCpuTopology::Read()
+{
+	FCpuTopology Topology;
+
+	std::string OnlineList;
+	if (ReadFile("/sys/devices/system/cpu/online", OnlineList))
+	{
+		for (uint32_t CpuIndex : ParseCpuList(OnlineList))
+		{
+			FCpu Cpu;
+			Cpu.Index = CpuIndex;
+			std::string TopologyDir = "/sys/devices/system/cpu/cpu" + std::to_string(CpuIndex) + "/topology/";
+			Cpu.Package = ReadUInt(TopologyDir + "physical_package_id", 0);
+			Cpu.Core = ReadUInt(TopologyDir + "core_id", CpuIndex);
+
+			std::string Siblings;
+			if (ReadFile(TopologyDir + "thread_siblings_list", Siblings))
+			{
+				std::vector<uint32_t> SiblingCpus = ParseCpuList(Siblings);
+				Cpu.ThreadInCore = uint32_t(std::find(SiblingCpus.begin(), SiblingCpus.end(), CpuIndex) - SiblingCpus.begin()) % std::max<size_t>(SiblingCpus.size(), 1);
+			}
+			Topology.Cpus.push_back(Cpu);
+		}
+
+		for (uint32_t Node = 0; ; Node += 1)
+		{
+			std::string NodeCpus;
+			if (!ReadFile("/sys/devices/system/node/node" + std::to_string(Node) + "/cpulist", NodeCpus))
+			{
+				Topology.NumNodes = std::max(Node, 1u);
+				break;
+			}
+			for (uint32_t CpuIndex : ParseCpuList(NodeCpus))
+			{
+				for (FCpu& Cpu : Topology.Cpus)
+				{
+					if (Cpu.Index == CpuIndex)
+					{
+						Cpu.Node = Node;
+					}
+				}
+			}
+		}
+	}
+
+	Topology.CacheLineSize = ReadUInt("/sys/devices/system/cpu/cpu0/cache/index0/coherency_line_size", 0);
+
+	if (Topology.Cpus.empty())
+	{
+		uint32_t NumCpus = std::max(std::thread::hardware_concurrency(), 1u);
+		for (uint32_t CpuIndex = 0; CpuIndex < NumCpus; CpuIndex += 1)
+		{
+			FCpu Cpu;
+			Cpu.Index = CpuIndex;
+			Cpu.Core = CpuIndex;
+			Topology.Cpus.push_back(Cpu);
+		}
+		Topology.NumNodes = 1;
+	}
+	return Topology;
+}
+
+const FCpuTopology::FCpu* FCpuTopology::FindCpu(uint32_t CpuIndex) const
+{
+	for (const FCpu& Cpu : Cpus)
+	{
+		if (Cpu.Index == CpuIndex)
+		{
+			return &Cpu;
+		}
+	}
+	return nullptr;
+}
+
+std::vector<uint32_t> FCpuTopology::AssignCpus(EAffinityPolicy Policy, uint32_t NumWorkers, const std::vector<uint32_t>& ExplicitCpus) const
+{
+	std::vector<uint32_t> Order;
+	switch (Policy)
+	{
+	case EAffinityPolicy::None:
+		return {};
+	case EAffinityPolicy::Explicit:
+		Order = ExplicitCpus;
+		break;
+	case EAffinityPolicy::Compact:
+	{
+		std::vector<FCpu> Sorted = Cpus;
+		std::sort(Sorted.begin(), Sorted.end(), [](const FCpu& A, const FCpu& B) {
+			return std::make_tuple(A.Node, A.Package, A.Core, A.ThreadInCore, A.Index) < std::make_tuple(B.Node, B.Package, B.Core, B.ThreadInCore, B.Index);
+		});
+		for (const FCpu& Cpu : Sorted)
+		{
+			Order.push_back(Cpu.Index);
+		}
+		break;
+	}
+	case EAffinityPolicy::Scatter:
+	{
+		// per node: first hardware thread of every core, then the second ones, ...
+		std::vector<std::vector<uint32_t>> PerNode(NumNodes);
+		std::vector<FCpu> Sorted = Cpus;
+		std::sort(Sorted.begin(), Sorted.end(), [](const FCpu& A, const FCpu& B) {
+			return std::make_tuple(A.ThreadInCore, A.Package, A.Core, A.Index) < std::make_tuple(B.ThreadInCore, B.Package, B.Core, B.Index);
+		});
+		for (const FCpu& Cpu : Sorted)
+		{
+			PerNode[std::min(Cpu.Node, NumNodes - 1)].push_back(Cpu.Index);
+		}
+		// then interleave the nodes
+		for (size_t Position = 0; Order.size() != Cpus.size(); Position += 1)
+		{
+			for (std::vector<uint32_t>& NodeCpus : PerNode)
+			{
+				if (Position < NodeCpus.size())
+				{
+					Order.push_back(NodeCpus[Position]);
+				}
+			}
+		}
+		break;
+	}
+	}
+
+	std::vector<uint32_t> Result;
+	for (uint32_t Worker = 0; Worker < NumWorkers && !Order.empty(); Worker += 1)
+	{
+		Result.push_back(Order[Worker % Order.size()]);
+	}
+	return Result;
+}
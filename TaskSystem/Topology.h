@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <string>
+
+enum class EAffinityPolicy
+{
+	// workers float freely, the OS decides
+	None,
+	// fill one NUMA node (and one core's hardware threads) before moving on to the next
+	Compact,
+	// spread workers round-robin over NUMA nodes and physical cores, hyper-threading siblings last
+	Scatter,
+	// worker N is pinned to the N-th entry of an explicit core list
+	Explicit
+};
+
+class FCpuTopology
+{
+public:
+	struct FCpu
+	{
+		uint32_t Index = 0;
+		uint32_t Node = 0;
+		uint32_t Package = 0;
+		uint32_t Core = 0;
+		// position among the hardware threads of its core, 0 for the first one
+		uint32_t ThreadInCore = 0;
+	};
+
+	// reads /sys/devices/system/{cpu,node} on linux. elsewhere (or if sysfs is unavailable) returns a flat single-node topology
+	// built from std::thread::hardware_concurrency
+	static const FCpuTopology& Get();
+
+	const std::vector<FCpu>& GetCpus() const { return Cpus; }
+	uint32_t GetNumNodes() const { return NumNodes; }
+	// coherency line size of the L1 data cache, 0 if unknown. PLATFORM_CACHE_LINE_SIZE should be at least that
+	uint32_t GetCacheLineSize() const { return CacheLineSize; }
+
+	// returns nullptr for unknown cpus
+	const FCpu* FindCpu(uint32_t CpuIndex) const;
+
+	// the cpu each of NumWorkers workers is pinned to, empty for EAffinityPolicy::None
+	std::vector<uint32_t> AssignCpus(EAffinityPolicy Policy, uint32_t NumWorkers, const std::vector<uint32_t>& ExplicitCpus) const;
+
+	// parses the sysfs list format, e.g. "0-3,8,10-11"
+	static std::vector<uint32_t> ParseCpuList(const std::string& List);
+
+private:
+	static FCpuTopology Read();
+
+	std::vector<FCpu> Cpus;
+	uint32_t NumNodes = 1;
+	uint32_t CacheLineSize = 0;
+};
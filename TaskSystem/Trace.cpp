@@ -0,0 +1,279 @@
+#include "Trace.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+
+std::atomic<bool> FTaskTrace::bRecording{ false };
+
+struct FTaskTrace::FBuffer
+{
+	// allocated by the first event, a thread that only got a name doesn't pay for it
+	std::unique_ptr<FTraceEvent[]> Events;
+	// written by the owning thread only, released after the event is in place
+	std::atomic<uint64_t> NumRecorded{ 0 };
+	std::atomic<uint32_t> Capture{ 0 };
+	uint32_t ThreadIndex = 0;
+	// guarded by FState::Mtx
+	std::string ThreadName;
+};
+
+struct FTaskTrace::FState
+{
+	// bumped by Start, a buffer that recorded into an older capture starts over
+	std::atomic<uint32_t> Capture{ 0 };
+
+	std::mutex Mtx;
+	// never freed, a capture can be written after its threads exited
+	std::vector<FBuffer*> Buffers;
+};
+
+FTaskTrace::FState& FTaskTrace::GetState()
+{
+	static FState* State = new FState();
+	return *State;
+}
+
+FTaskTrace::FBuffer& FTaskTrace::GetThreadBuffer()
+{
+	static thread_local FBuffer* Buffer = nullptr;
+	if (Buffer == nullptr)
+	{
+		FState& State = GetState();
+		std::lock_guard guard(State.Mtx);
+		Buffer = new FBuffer();
+		Buffer->ThreadIndex = uint32_t(State.Buffers.size());
+		State.Buffers.push_back(Buffer);
+	}
+	return *Buffer;
+}
+
+void FTaskTrace::Start()
+{
+	GetState().Capture.fetch_add(1, std::memory_order_relaxed);
+	bRecording.store(true, std::memory_order_relaxed);
+}
+
+void FTaskTrace::Stop()
+{
+	bRecording.store(false, std::memory_order_relaxed);
+}
+
+void FTaskTrace::RecordSlow(ETraceEventType Type, const void* Id, const char* Name, const void* OtherId)
+{
+	int64_t TimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+	FBuffer& Buffer = GetThreadBuffer();
+	uint64_t NumRecorded = Buffer.NumRecorded.load(std::memory_order_relaxed);
+	uint32_t Capture = GetState().Capture.load(std::memory_order_relaxed);
+	if (Buffer.Capture.load(std::memory_order_relaxed) != Capture)
+	{
+		Buffer.Capture.store(Capture, std::memory_order_relaxed);
+		NumRecorded = 0;
+	}
+	if (!Buffer.Events)
+	{
+		Buffer.Events.reset(new FTraceEvent[BufferCapacity]);
+	}
+
+	Buffer.Events[NumRecorded % BufferCapacity] = FTraceEvent{ TimeNs, Id, Name, OtherId, Type };
+	Buffer.NumRecorded.store(NumRecorded + 1, std::memory_order_release);
+}
+
+void FTaskTrace::SetThreadName(const std::string& Name)
+{
+	FBuffer& Buffer = GetThreadBuffer();
+	std::lock_guard guard(GetState().Mtx);
+	Buffer.ThreadName = Name;
+}
+
+namespace
+{
+	// events of the current capture in Buffer, oldest first
+	template<typename BufferType>
+	std::vector<FTraceEvent> CopyEvents(const BufferType& Buffer, uint32_t Capture, uint32_t Capacity)
+	{
+		std::vector<FTraceEvent> Events;
+		uint64_t NumRecorded = Buffer.NumRecorded.load(std::memory_order_acquire);
+		if (NumRecorded == 0 || Buffer.Capture.load(std::memory_order_relaxed) != Capture)
+		{
+			return Events;
+		}
+		uint64_t First = NumRecorded > Capacity ? NumRecorded - Capacity : 0;
+		Events.reserve(size_t(NumRecorded - First));
+		for (uint64_t Index = First; Index != NumRecorded; Index += 1)
+		{
+			Events.push_back(Buffer.Events[Index % Capacity]);
+		}
+		return Events;
+	}
+
+	void WriteEscaped(std::ostream& Stream, const char* String)
+	{
+		for (const char* Char = String != nullptr ? String : ""; *Char != 0; ++Char)
+		{
+			if (*Char == '"' || *Char == '\\')
+			{
+				Stream << '\\' << *Char;
+			}
+			else if (uint8_t(*Char) >= 0x20)
+			{
+				Stream << *Char;
+			}
+		}
+	}
+}
+
+std::vector<FTraceEvent> FTaskTrace::GetThreadEvents()
+{
+	return CopyEvents(GetThreadBuffer(), GetState().Capture.load(std::memory_order_relaxed), BufferCapacity);
+}
+
+std::vector<std::vector<FTraceEvent>> FTaskTrace::GetCaptureEvents()
+{
+	std::vector<std::vector<FTraceEvent>> Events;
+	FState& State = GetState();
+	std::lock_guard guard(State.Mtx);
+	uint32_t Capture = State.Capture.load(std::memory_order_relaxed);
+	for (FBuffer* Buffer : State.Buffers)
+	{
+		std::vector<FTraceEvent> ThreadEvents = CopyEvents(*Buffer, Capture, BufferCapacity);
+		if (!ThreadEvents.empty())
+		{
+			Events.push_back(std::move(ThreadEvents));
+		}
+	}
+	return Events;
+}
+
+void FTaskTrace::WriteChromeTrace(std::ostream& Stream)
+{
+	struct FThreadEvents
+	{
+		uint32_t ThreadIndex;
+		std::string ThreadName;
+		std::vector<FTraceEvent> Events;
+	};
+
+	std::vector<FThreadEvents> Threads;
+	{
+		FState& State = GetState();
+		std::lock_guard guard(State.Mtx);
+		uint32_t Capture = State.Capture.load(std::memory_order_relaxed);
+		for (FBuffer* Buffer : State.Buffers)
+		{
+			Threads.push_back({ Buffer->ThreadIndex, Buffer->ThreadName, CopyEvents(*Buffer, Capture, BufferCapacity) });
+		}
+	}
+
+	// timestamps are in microseconds from the first event of the capture
+	int64_t StartNs = INT64_MAX;
+	for (FThreadEvents& Thread : Threads)
+	{
+		if (!Thread.Events.empty())
+		{
+			StartNs = std::min(StartNs, Thread.Events.front().TimeNs);
+		}
+	}
+
+	std::ios_base::fmtflags PrevFlags = Stream.flags();
+	std::streamsize PrevPrecision = Stream.precision();
+	Stream << std::fixed << std::setprecision(3);
+
+	Stream << "{\"traceEvents\":[\n";
+	bool bFirst = true;
+	auto BeginEvent = [&Stream, &bFirst](const char* Phase, uint32_t ThreadIndex)
+	{
+		Stream << (bFirst ? "" : ",\n") << "{\"ph\":\"" << Phase << "\",\"pid\":1,\"tid\":" << ThreadIndex;
+		bFirst = false;
+	};
+
+	for (FThreadEvents& Thread : Threads)
+	{
+		if (Thread.Events.empty())
+		{
+			continue;
+		}
+
+		BeginEvent("M", Thread.ThreadIndex);
+		Stream << ",\"name\":\"thread_name\",\"args\":{\"name\":\"";
+		if (Thread.ThreadName.empty())
+		{
+			Stream << "Thread " << Thread.ThreadIndex;
+		}
+		else
+		{
+			WriteEscaped(Stream, Thread.ThreadName.c_str());
+		}
+		Stream << "\"}}";
+
+		for (const FTraceEvent& Event : Thread.Events)
+		{
+			double Ts = double(Event.TimeNs - StartNs) / 1000.0;
+			auto WriteCommon = [&Stream, &Event, Ts](const char* Prefix)
+			{
+				Stream << ",\"ts\":" << Ts << ",\"name\":\"" << Prefix;
+				WriteEscaped(Stream, Event.Name);
+				Stream << "\"";
+			};
+			// flow arrows connect the point a task got ready with the start of its execution
+			auto WriteFlow = [&](const char* Phase)
+			{
+				BeginEvent(Phase, Thread.ThreadIndex);
+				WriteCommon("");
+				Stream << ",\"cat\":\"task\",\"id\":\"" << Event.Id << "\"" << (Phase[0] == 'f' ? ",\"bp\":\"e\"}" : "}");
+			};
+
+			switch (Event.Type)
+			{
+			case ETraceEventType::Ready:
+				BeginEvent("i", Thread.ThreadIndex);
+				WriteCommon("Ready: ");
+				Stream << ",\"s\":\"t\"}";
+				WriteFlow("s");
+				break;
+			case ETraceEventType::ExecuteBegin:
+				BeginEvent("B", Thread.ThreadIndex);
+				WriteCommon("");
+				Stream << "}";
+				WriteFlow("f");
+				break;
+			case ETraceEventType::WaitBegin:
+				BeginEvent("B", Thread.ThreadIndex);
+				WriteCommon("Wait: ");
+				Stream << "}";
+				break;
+			case ETraceEventType::PipeBegin:
+				BeginEvent("B", Thread.ThreadIndex);
+				WriteCommon("Pipe: ");
+				Stream << "}";
+				break;
+			case ETraceEventType::ExecuteEnd:
+			case ETraceEventType::WaitEnd:
+			case ETraceEventType::PipeEnd:
+				BeginEvent("E", Thread.ThreadIndex);
+				Stream << ",\"ts\":" << Ts << "}";
+				break;
+			default:
+				// edges are for FTaskGraphAnalysis, the timeline shows them as the flows from Ready to execution
+				break;
+			}
+		}
+	}
+	Stream << "\n]}\n";
+	Stream.flags(PrevFlags);
+	Stream.precision(PrevPrecision);
+}
+
+bool FTaskTrace::WriteChromeTrace(const char* FileName)
+{
+	std::ofstream Stream(FileName);
+	if (!Stream)
+	{
+		return false;
+	}
+	WriteChromeTrace(Stream);
+	return bool(Stream);
+}
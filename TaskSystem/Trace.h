@@ -0,0 +1,125 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// task timeline recorder. compiled in with TASK_TRACE_ENABLED=1, otherwise the TASK_TRACE macros expand to nothing. when compiled
+// in and not recording an event costs one relaxed load. every thread records into a ring buffer of its own, no locks or shared
+// cache lines on the hot path. a capture is written as Chrome trace json, which chrome://tracing and ui.perfetto.dev open
+#ifndef TASK_TRACE_ENABLED
+#define TASK_TRACE_ENABLED 0
+#endif
+
+#if TASK_TRACE_ENABLED
+#define TASK_TRACE(Type, Id, Name) FTaskTrace::Record(ETraceEventType::Type, Id, Name)
+// records Type##Begin now and Type##End at the end of the scope
+#define TASK_TRACE_SCOPE(Type, Id, Name) FTaskTraceScope TaskTraceScope##Type(ETraceEventType::Type##Begin, ETraceEventType::Type##End, Id, Name)
+#define TASK_TRACE_THREAD_NAME(Name) FTaskTrace::SetThreadName(Name)
+// a dependency: Id can't complete (or start) before OtherId is completed
+#define TASK_TRACE_EDGE(Type, Id, OtherId) FTaskTrace::Record(ETraceEventType::Type##Edge, Id, nullptr, OtherId)
+#else
+#define TASK_TRACE(Type, Id, Name)
+#define TASK_TRACE_SCOPE(Type, Id, Name)
+#define TASK_TRACE_THREAD_NAME(Name)
+#define TASK_TRACE_EDGE(Type, Id, OtherId)
+#endif
+
+enum class ETraceEventType : uint8_t
+{
+	Ready,			// a task got unlocked and is handed to the scheduler
+	ExecuteBegin,
+	ExecuteEnd,
+	WaitBegin,		// a thread blocks in FTask::Wait
+	WaitEnd,
+	PipeBegin,		// a piped task executes, Id is the pipe
+	PipeEnd,
+	// dependencies between tasks, see FTaskGraphAnalysis
+	PrerequisiteEdge,	// task Id starts after prerequisite OtherId completed
+	NestedEdge,			// task Id completes after its nested task OtherId completed
+	PipeEdge,			// piped task Id starts after OtherId, the previous task in its pipe
+};
+
+struct FTraceEvent
+{
+	int64_t TimeNs;
+	// the task (or pipe) the event is about, links a Ready to the ExecuteBegin of the same task
+	const void* Id;
+	const char* Name;
+	// the other end of an edge
+	const void* OtherId;
+	ETraceEventType Type;
+};
+
+class FTaskTrace
+{
+public:
+	// events per thread, the oldest ones are overwritten
+	static constexpr uint32_t BufferCapacity = 1 << 16;
+
+	// starts a new capture, events of the previous one are dropped
+	static void Start();
+	static void Stop();
+
+	static bool IsRecording()
+	{
+		return bRecording.load(std::memory_order_relaxed);
+	}
+
+	static void Record(ETraceEventType Type, const void* Id, const char* Name, const void* OtherId = nullptr)
+	{
+		if (IsRecording())
+		{
+			RecordSlow(Type, Id, Name, OtherId);
+		}
+	}
+
+	// shows up as the thread's name in the capture
+	static void SetThreadName(const std::string& Name);
+
+	// writes the last capture, call it after Stop: a thread that is still recording can overwrite events being written
+	static void WriteChromeTrace(std::ostream& Stream);
+	static bool WriteChromeTrace(const char* FileName);
+
+	// events of the last capture recorded by the calling thread, oldest first
+	static std::vector<FTraceEvent> GetThreadEvents();
+	// events of the last capture of every thread that recorded something, oldest first
+	static std::vector<std::vector<FTraceEvent>> GetCaptureEvents();
+
+private:
+	struct FBuffer;
+	struct FState;
+
+	// never destroyed, threads can record until the process exits
+	static FState& GetState();
+	static FBuffer& GetThreadBuffer();
+	static void RecordSlow(ETraceEventType Type, const void* Id, const char* Name, const void* OtherId);
+
+	static std::atomic<bool> bRecording;
+};
+
+class FTaskTraceScope
+{
+public:
+	FTaskTraceScope(ETraceEventType BeginType, ETraceEventType InEndType, const void* InId, const char* InName)
+		: EndType(InEndType)
+		, Id(InId)
+		, Name(InName)
+	{
+		FTaskTrace::Record(BeginType, Id, Name);
+	}
+
+	~FTaskTraceScope()
+	{
+		FTaskTrace::Record(EndType, Id, Name);
+	}
+
+	FTaskTraceScope(const FTaskTraceScope&) = delete;
+	FTaskTraceScope& operator=(const FTaskTraceScope&) = delete;
+
+private:
+	ETraceEventType EndType;
+	const void* Id;
+	const char* Name;
+};